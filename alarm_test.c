@@ -22,11 +22,15 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
 #include "libsus.h"
 
+static time_t then;
+
 void callback(int fd, short ev, void *data)
 {
-	printf("Ping - got the event\n");
+	printf("Ping - got the event %ld seconds late\n",
+	       (long)(time(NULL) - then));
 	suspend_block(-1);
 	event_loopbreak();
 }
@@ -34,7 +38,6 @@ void callback(int fd, short ev, void *data)
 int main(int argc, char *argv[])
 {
 	time_t now;
-	time_t then;
 	int diff;
 	struct event *ev;
 
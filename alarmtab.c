@@ -0,0 +1,240 @@
+/*
+ * alarmtab - persistent table of wakealarmd alarms.
+ *
+ * Every connection to wakealarmd which has registered a time owns
+ * one slot in an mmapped file in /run/suspend.  A slot is a single
+ * 64bit timestamp which is zero when free, so each update is one
+ * atomic store and a crash can never leave a half-written entry.
+ * When wakealarmd restarts it recovers the slots that are still
+ * set so that the RTC can be armed for them before suspend is
+ * allowed again.
+ * The free list is only kept in memory and is rebuilt on open.
+ *
+ * Copyright (C) 2011 Neil Brown <neilb@suse.de>
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "susman.h"
+
+#define MAGIC	"SUSALRM1"
+
+struct tabhdr {
+	char		magic[8];
+	int64_t		next;		/* earliest pending alarm, or 0 */
+	char		pad[48];
+};
+
+struct alarmtab {
+	int		fd;
+	struct tabhdr	*hdr;
+	int64_t		*slots;
+	int		size;		/* number of slots */
+	int		*free;		/* stack of free slots */
+	int		nfree;
+};
+
+static int tab_map(struct alarmtab *tab, int size)
+{
+	size_t len = sizeof(struct tabhdr) + size * sizeof(int64_t);
+	int *stack;
+	void *m;
+
+	/* Room for the free stack first, so a failure leaves the old
+	 * mapping and stack as they were.
+	 */
+	stack = realloc(tab->free, size * sizeof(int));
+	if (!stack)
+		return -1;
+	tab->free = stack;
+	if (ftruncate(tab->fd, len) < 0)
+		return -1;
+	if (tab->hdr)
+		m = mremap(tab->hdr, sizeof(struct tabhdr)
+			   + tab->size * sizeof(int64_t),
+			   len, MREMAP_MAYMOVE);
+	else
+		m = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED,
+			 tab->fd, 0);
+	if (m == MAP_FAILED)
+		return -1;
+	tab->hdr = m;
+	tab->slots = (int64_t *)(tab->hdr + 1);
+	return 0;
+}
+
+struct alarmtab *alarmtab_open(const char *path)
+{
+	struct alarmtab *tab = calloc(1, sizeof(*tab));
+	struct stat stb;
+	int size;
+	int i;
+
+	if (!tab)
+		return NULL;
+	tab->fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+	if (tab->fd < 0 || fstat(tab->fd, &stb) < 0)
+		goto abort;
+
+	/* Trust the file length rather than anything in the header,
+	 * so that a crash while growing cannot lose slots.
+	 */
+	size = 0;
+	if (stb.st_size >= sizeof(struct tabhdr))
+		size = (stb.st_size - sizeof(struct tabhdr))
+			/ sizeof(int64_t);
+	if (size < 64)
+		size = 64;
+	if (tab_map(tab, size) < 0)
+		goto abort;
+	tab->size = size;
+	if (memcmp(tab->hdr->magic, MAGIC, 8) != 0) {
+		/* New or corrupt - start again */
+		memset(tab->hdr, 0, sizeof(struct tabhdr));
+		memset(tab->slots, 0, size * sizeof(int64_t));
+		memcpy(tab->hdr->magic, MAGIC, 8);
+	}
+	for (i = size - 1; i >= 0; i--)
+		if (tab->slots[i] == 0)
+			tab->free[tab->nfree++] = i;
+	return tab;
+
+abort:
+	if (tab->fd >= 0)
+		close(tab->fd);
+	free(tab->free);
+	free(tab);
+	return NULL;
+}
+
+void alarmtab_close(struct alarmtab *tab)
+{
+	munmap(tab->hdr, sizeof(struct tabhdr) + tab->size * sizeof(int64_t));
+	close(tab->fd);
+	free(tab->free);
+	free(tab);
+}
+
+int alarmtab_alloc(struct alarmtab *tab)
+{
+	if (!tab)
+		return -1;
+	if (tab->nfree == 0) {
+		int size = tab->size * 2;
+		int i;
+		if (tab_map(tab, size) < 0)
+			return -1;
+		for (i = size - 1; i >= tab->size; i--)
+			tab->free[tab->nfree++] = i;
+		tab->size = size;
+	}
+	return tab->free[--tab->nfree];
+}
+
+void alarmtab_set(struct alarmtab *tab, int slot, time_t stamp)
+{
+	if (slot < 0)
+		return;
+	/* zero means 'free', so 'wake at the epoch' becomes 1 */
+	tab->slots[slot] = stamp ? stamp : 1;
+}
+
+void alarmtab_free(struct alarmtab *tab, int slot)
+{
+	if (slot < 0)
+		return;
+	tab->slots[slot] = 0;
+	tab->free[tab->nfree++] = slot;
+}
+
+void alarmtab_set_next(struct alarmtab *tab, time_t stamp)
+{
+	if (tab)
+		tab->hdr->next = stamp;
+}
+
+/* The earliest pending alarm, for readers who aren't wakealarmd.
+ * Returns 0 if there is none or no table.
+ */
+time_t alarmtab_next(const char *path)
+{
+	struct tabhdr hdr;
+	int fd = open(path, O_RDONLY|O_CLOEXEC);
+	int n;
+
+	if (fd < 0)
+		return 0;
+	n = pread(fd, &hdr, sizeof(hdr), 0);
+	close(fd);
+	if (n != sizeof(hdr) || memcmp(hdr.magic, MAGIC, 8) != 0)
+		return 0;
+	return hdr.next;
+}
+
+/* Number of slots in use */
+int alarmtab_count(struct alarmtab *tab)
+{
+	if (!tab)
+		return 0;
+	return tab->size - tab->nfree;
+}
+
+struct ent {
+	int64_t	stamp;
+	int	slot;
+};
+
+static int ent_cmp(const void *a, const void *b)
+{
+	const struct ent *ea = a, *eb = b;
+
+	if (ea->stamp != eb->stamp)
+		return ea->stamp < eb->stamp ? -1 : 1;
+	return ea->slot - eb->slot;
+}
+
+/* Report every slot in use in order of time.  Each remains
+ * allocated until the caller frees it.
+ */
+int alarmtab_recover(struct alarmtab *tab,
+		     void (*fn)(int slot, time_t stamp, void *data),
+		     void *data)
+{
+	struct ent *ents;
+	int n = 0;
+	int i;
+
+	ents = malloc((tab->size - tab->nfree + 1) * sizeof(*ents));
+	if (!ents)
+		return -1;
+	for (i = 0; i < tab->size; i++)
+		if (tab->slots[i]) {
+			ents[n].stamp = tab->slots[i];
+			ents[n].slot = i;
+			n++;
+		}
+	qsort(ents, n, sizeof(*ents), ent_cmp);
+	for (i = 0; i < n; i++)
+		fn(ents[i].slot, ents[i].stamp, data);
+	free(ents);
+	return n;
+}
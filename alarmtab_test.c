@@ -0,0 +1,101 @@
+/*
+ * Time recovery of the wakealarmd alarm table.
+ * Fills a table with 'count' alarms (default 100000), then
+ * re-opens it and recovers them as wakealarmd would at startup.
+ * Exits with failure if recovery takes longer than 'msec'
+ * (default 1000).
+ *
+ * Copyright (C) 2011 Neil Brown <neilb@suse.de>
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "susman.h"
+
+static time_t last;
+static int misordered;
+
+static void found(int slot, time_t stamp, void *data)
+{
+	int *cnt = data;
+
+	if (stamp < last)
+		misordered++;
+	last = stamp;
+	(*cnt)++;
+}
+
+static double msec(struct timespec *a, struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000.0
+		+ (b->tv_nsec - a->tv_nsec) / 1000000.0;
+}
+
+int main(int argc, char *argv[])
+{
+	char path[] = "/tmp/alarmtab_testXXXXXX";
+	int count = 100000;
+	int bound = 1000;
+	struct alarmtab *tab;
+	struct timespec start, end;
+	time_t now = time(0);
+	int fd, i, n;
+	int cnt = 0;
+	double ms;
+
+	if (argc > 1)
+		count = atoi(argv[1]);
+	if (argc > 2)
+		bound = atoi(argv[2]);
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror(path);
+		exit(2);
+	}
+	close(fd);
+
+	tab = alarmtab_open(path);
+	if (!tab) {
+		fprintf(stderr, "alarmtab_test: cannot create table\n");
+		exit(2);
+	}
+	srandom(now);
+	for (i = 0; i < count; i++)
+		alarmtab_set(tab, alarmtab_alloc(tab),
+			     now + random() % (7*24*3600));
+	alarmtab_close(tab);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	tab = alarmtab_open(path);
+	n = alarmtab_recover(tab, found, &cnt);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	alarmtab_close(tab);
+	unlink(path);
+
+	ms = msec(&start, &end);
+	printf("recovered %d of %d alarms in %.1f msec\n", n, count, ms);
+	if (n != count || cnt != count || misordered) {
+		printf("FAIL: %d reported, %d out of order\n", cnt, misordered);
+		exit(1);
+	}
+	if (ms > bound) {
+		printf("FAIL: longer than %d msec\n", bound);
+		exit(1);
+	}
+	exit(0);
+}
@@ -0,0 +1,209 @@
+/*
+ * autosleep - let the kernel run the suspend loop.
+ *
+ * Kernels with CONFIG_PM_AUTOSLEEP suspend by themselves whenever
+ * no wakeup source is active, once "mem" is written to
+ * /sys/power/autosleep, and CONFIG_PM_WAKELOCKS lets userspace hold
+ * a wakeup source by writing a name to /sys/power/wake_lock.  That
+ * saves lsusd waking up for every attempt, but the kernel can't
+ * tell anyone it is about to suspend, so it is only used while
+ * nobody is watching /run/suspend/watching.  lsused and wakealarmd
+ * only watch while they have clients.
+ *
+ * While the kernel is allowed to suspend, lsusd holds 'disabled'
+ * exclusively so blockers can't get their shared lock without it
+ * noticing.  A blocker which finds the lock taken opens the file
+ * again (a "knock"), which we see through inotify: we take our wake
+ * lock and only then let go of 'disabled'.  The inotify fd is waited
+ * on through epoll with EPOLLWAKEUP, so from the moment of the knock
+ * the kernel holds a wakeup source for us until we have our wake lock
+ * and wait again; otherwise it could suspend in between.  We then wait for the
+ * blockers to finish with the wake lock held, just as the userspace
+ * loop does.  Anything else that happens in /run/suspend - a
+ * watcher arriving, a request, autosuspend being removed - also
+ * takes the wake lock while we look at it, and if the kernel can no
+ * longer be left to it we turn autosleep off and return to the
+ * userspace loop.
+ *
+ * Enabled by SUSMAN_SLEEP=autosleep.
+ *
+ * Copyright (C) 2011 Neil Brown <neilb@suse.de>
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/file.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include "susman.h"
+
+#define AUTOSLEEP	"/sys/power/autosleep"
+#define WAKE_LOCK	"/sys/power/wake_lock"
+#define WAKE_UNLOCK	"/sys/power/wake_unlock"
+#define SUCCESS		"/sys/power/suspend_stats/success"
+#define LOCKNAME	"susman"
+#define GRACE		200	/* msec for a knocker to get its lock */
+
+static struct metric *m_windows, *m_knocks, *m_suspends;
+
+int autosleep_enabled(void)
+{
+	const char *e = getenv("SUSMAN_SLEEP");
+
+	return e && strcmp(e, "autosleep") == 0 &&
+		access(sys_path(AUTOSLEEP), W_OK) == 0 &&
+		access(sys_path(WAKE_LOCK), W_OK) == 0 &&
+		access(sys_path(WAKE_UNLOCK), W_OK) == 0;
+}
+
+/* A previous lsusd may have died with autosleep on */
+void autosleep_reset(void)
+{
+	if (!autosleep_enabled())
+		return;
+	sys_write(AUTOSLEEP, "off");
+	sys_write(WAKE_UNLOCK, LOCKNAME);
+}
+
+/* Does some watcher need to be told about a suspend? */
+static int watched(int wfd)
+{
+	if (flock(wfd, LOCK_EX|LOCK_NB) != 0)
+		return 1;
+	flock(wfd, LOCK_UN);
+	return 0;
+}
+
+/* Returns the number of knocks on 'disabled' */
+static int drain(int ifd, int dwd)
+{
+	char buf[4096];
+	int knocks = 0;
+	int n;
+
+	while ((n = read(ifd, buf, sizeof(buf))) > 0) {
+		char *p = buf;
+		while (p < buf + n) {
+			struct inotify_event *ev = (void*)p;
+			if (ev->wd == dwd)
+				knocks++;
+			p += sizeof(*ev) + ev->len;
+		}
+	}
+	return knocks;
+}
+
+/* Called with nothing blocking suspend and only autosuspend asking
+ * for it.  Runs until the kernel can't be left to do the job, then
+ * returns 1, or 0 if it couldn't start.  'wanted' says whether
+ * autosuspend is still all that is asked for.
+ */
+int autosleep_run(int disable, int (*wanted)(void))
+{
+	struct epoll_event ev;
+	int wfd, ifd, efd, dwd;
+
+	if (!m_windows) {
+		m_windows = metric_new("lsusd_autosleep_windows_total",
+				       "Times the kernel was left to suspend",
+				       METRIC_COUNTER);
+		m_knocks = metric_new("lsusd_autosleep_knocks_total",
+				      "Blockers which had to wake lsusd",
+				      METRIC_COUNTER);
+		m_suspends = metric_new("lsusd_suspends_total",
+					"Suspends which completed",
+					METRIC_COUNTER);
+	}
+	/* Opened once: opening it again would wake us */
+	wfd = open("/run/suspend/watching", O_RDONLY|O_CLOEXEC);
+	if (wfd < 0)
+		return 0;
+	if (watched(wfd)) {
+		close(wfd);
+		return 0;
+	}
+	ifd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (ifd < 0) {
+		close(wfd);
+		return 0;
+	}
+	efd = epoll_create1(EPOLL_CLOEXEC);
+	ev.events = EPOLLIN | EPOLLWAKEUP;
+	ev.data.fd = ifd;
+	if (efd < 0 || epoll_ctl(efd, EPOLL_CTL_ADD, ifd, &ev) < 0) {
+		if (efd >= 0)
+			close(efd);
+		close(ifd);
+		close(wfd);
+		return 0;
+	}
+	dwd = inotify_add_watch(ifd, "/run/suspend/disabled", IN_OPEN);
+	inotify_add_watch(ifd, "/run/suspend/watching", IN_OPEN);
+	inotify_add_watch(ifd, "/run/suspend",
+			  IN_CREATE|IN_DELETE|IN_MOVED_TO|IN_MOVED_FROM);
+	if (dwd < 0 ||
+	    sys_write(WAKE_LOCK, LOCKNAME) < 0 ||
+	    sys_write(AUTOSLEEP, "mem") < 0) {
+		sys_write(WAKE_UNLOCK, LOCKNAME);
+		close(efd);
+		close(ifd);
+		close(wfd);
+		return 0;
+	}
+
+	while (1) {
+		long long before, after, n;
+		int knocks;
+
+		/* Wait out any blockers with the wake lock held */
+		flock(disable, LOCK_EX);
+		drain(ifd, dwd);
+		if (!wanted() || watched(wfd))
+			break;
+
+		before = sys_read_num(SUCCESS);
+		metric_add(m_windows, 1);
+		trace(TR_AUTOSLEEP, 1, 0);
+		sys_write(WAKE_UNLOCK, LOCKNAME);
+
+		/* Also lets go of the wakeup source from last time */
+		epoll_wait(efd, &ev, 1, -1);
+
+		sys_write(WAKE_LOCK, LOCKNAME);
+		after = sys_read_num(SUCCESS);
+		n = before >= 0 && after > before ? after - before : 0;
+		metric_add(m_suspends, n);
+		trace(TR_AUTOSLEEP, 0, n);
+
+		knocks = drain(ifd, dwd);
+		metric_add(m_knocks, knocks);
+		/* Let a knocker, or a new watcher, get its lock */
+		flock(disable, LOCK_UN);
+		poll(NULL, 0, GRACE);
+	}
+	sys_write(AUTOSLEEP, "off");
+	flock(disable, LOCK_UN);
+	sys_write(WAKE_UNLOCK, LOCKNAME);
+	close(efd);
+	close(ifd);
+	close(wfd);
+	return 1;
+}
@@ -0,0 +1,62 @@
+/* Test the C++ interface: a coroutine which follows suspend and
+ * resume, and one which sleeps until an alarm 'secs' (default 10)
+ * from now, with wakealarmd.
+ *
+ * Copyright (C) 2011 Neil Brown <neilb@suse.de>
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "libsus.hpp"
+
+static sus::Task watch(sus::SuspendWatcher &w)
+{
+	while (1) {
+		co_await w.suspending();
+		printf("Suspend: tidying up\n");
+		fflush(stdout);
+		co_await w.resumed();
+		printf("Resume\n");
+		fflush(stdout);
+	}
+}
+
+static sus::Task alarms(int secs)
+{
+	while (1) {
+		time_t when = time(0) + secs;
+		if (!co_await sus::alarm_at(when)) {
+			printf("Cannot reach wakealarmd\n");
+			exit(1);
+		}
+		printf("Alarm for %ld at %ld\n", (long)when, (long)time(0));
+		fflush(stdout);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	event_init();
+	sus::SuspendWatcher w;
+	if (!w) {
+		fprintf(stderr, "coro_test: cannot watch /run/suspend\n");
+		exit(1);
+	}
+	watch(w);
+	alarms(argc > 1 ? atoi(argv[1]) : 10);
+	event_loop(0);
+	exit(0);
+}
@@ -0,0 +1,213 @@
+/*
+ * fanout - send the same short message to many clients at once.
+ *
+ * lsused and wakealarmd tell every interested client about a
+ * suspend or a wakeup with a tiny write each, and those writes are
+ * in the critical path of a suspend attempt.  Messages are queued
+ * with fanout_add() and sent by fanout_flush().  Normally that is
+ * just a loop of write()s, but if SUSMAN_IO=uring is set in the
+ * environment the whole batch is handed to the kernel through an
+ * io_uring as a single io_uring_enter() call (or one per RING
+ * messages).  If the kernel won't give us a ring we quietly fall
+ * back to write().
+ *
+ * Messages must be string constants or otherwise outlive the flush.
+ *
+ * Copyright (C) 2011 Neil Brown <neilb@suse.de>
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "susman.h"
+
+#define RING	256
+
+struct msg {
+	int		fd;
+	int		len;
+	const char	*buf;
+};
+
+struct uring {
+	int		fd;
+	unsigned	*sq_tail, *sq_mask, *sq_array;
+	unsigned	*cq_head, *cq_tail;
+	struct io_uring_sqe *sqes;
+};
+
+static struct uring *uring_open(void)
+{
+	struct io_uring_params p;
+	struct uring *r;
+	size_t sqlen, cqlen;
+	char *sq, *cq;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	fd = syscall(__NR_io_uring_setup, RING, &p);
+	if (fd < 0)
+		return NULL;
+	sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cqlen > sqlen)
+			sqlen = cqlen;
+		cqlen = sqlen;
+	}
+	sq = mmap(NULL, sqlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		  fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto fail;
+	cq = sq;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		cq = mmap(NULL, cqlen, PROT_READ|PROT_WRITE,
+			  MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto fail;
+	}
+	r = malloc(sizeof(*r));
+	if (!r)
+		goto fail;
+	r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		       PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		       fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		free(r);
+		goto fail;
+	}
+	r->fd = fd;
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	return r;
+fail:
+	/* the mappings are released with the fd */
+	close(fd);
+	return NULL;
+}
+
+/* Send up to RING messages with one syscall and wait for them.
+ * Returns how many the ring took, or -1; the caller writes the rest.
+ */
+static int uring_send(struct uring *r, struct msg *m, int n)
+{
+	unsigned tail = *r->sq_tail;
+	unsigned head;
+	int i, done;
+
+	for (i = 0; i < n; i++) {
+		unsigned idx = (tail + i) & *r->sq_mask;
+		struct io_uring_sqe *sqe = &r->sqes[idx];
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = m[i].fd;
+		sqe->addr = (unsigned long)m[i].buf;
+		sqe->len = m[i].len;
+		sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+		r->sq_array[idx] = idx;
+	}
+	__atomic_store_n(r->sq_tail, tail + n, __ATOMIC_RELEASE);
+	done = syscall(__NR_io_uring_enter, r->fd, n, n,
+		       IORING_ENTER_GETEVENTS, NULL, 0);
+	if (done < n) {
+		/* The kernel doesn't wait after a short submit.  Take
+		 * back what it didn't consume - without SQPOLL it only
+		 * looks at the ring in io_uring_enter - and wait for
+		 * what it did.
+		 */
+		if (done < 0)
+			done = 0;
+		__atomic_store_n(r->sq_tail, tail + done, __ATOMIC_RELEASE);
+		if (done && syscall(__NR_io_uring_enter, r->fd, 0, done,
+				    IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+			return -1;
+	}
+	/* Results don't matter: a client which has gone will be
+	 * noticed when we next read from it.
+	 */
+	head = *r->cq_head;
+	while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		head++;
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	return done ? done : -1;
+}
+
+struct fanout *fanout_new(void)
+{
+	struct fanout *f = calloc(1, sizeof(*f));
+	char *io = getenv("SUSMAN_IO");
+
+	if (f && io && strcmp(io, "uring") == 0)
+		f->ring = uring_open();
+	return f;
+}
+
+const char *fanout_engine(struct fanout *f)
+{
+	return f->ring ? "uring" : "write";
+}
+
+void fanout_add(struct fanout *f, int fd, const char *buf, int len)
+{
+	if (f->n >= f->size) {
+		int size = f->size ? f->size * 2 : 64;
+		struct msg *m = realloc(f->msgs, size * sizeof(*m));
+		if (!m) {
+			write(fd, buf, len);
+			return;
+		}
+		f->msgs = m;
+		f->size = size;
+	}
+	f->msgs[f->n].fd = fd;
+	f->msgs[f->n].buf = buf;
+	f->msgs[f->n].len = len;
+	f->n++;
+}
+
+void fanout_flush(struct fanout *f)
+{
+	int i = 0;
+
+	if (f->n == 0)
+		return;
+	f->flushes++;
+	f->sent += f->n;
+	if (f->ring)
+		while (i < f->n) {
+			int n = f->n - i < RING ? f->n - i : RING;
+			int sent = uring_send(f->ring, f->msgs + i, n);
+			if (sent < 0)
+				break;
+			f->syscalls++;
+			i += sent;
+		}
+	/* Whatever the ring didn't take */
+	for (; i < f->n; i++) {
+		write(f->msgs[i].fd, f->msgs[i].buf, f->msgs[i].len);
+		f->syscalls++;
+	}
+	f->n = 0;
+}
@@ -0,0 +1,99 @@
+/*
+ * Compare the fanout engines.
+ * Creates 'clients' socketpairs (default 1000) and times sending
+ * one byte to every client, as lsused does with 'S' when a suspend
+ * starts, 'rounds' times (default 200) with write() and then with
+ * io_uring.  Reports the mean and worst time per fan-out, and the
+ * syscalls it took.
+ *
+ * Copyright (C) 2011 Neil Brown <neilb@suse.de>
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include "susman.h"
+
+static double msec(struct timespec *a, struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000.0
+		+ (b->tv_nsec - a->tv_nsec) / 1000000.0;
+}
+
+static void run(const char *engine, int (*sv)[2], int clients, int rounds)
+{
+	struct fanout *f;
+	struct timespec start, end;
+	double ms, total = 0, worst = 0;
+	char c;
+	int r, i;
+
+	setenv("SUSMAN_IO", engine, 1);
+	f = fanout_new();
+	if (!f) {
+		fprintf(stderr, "fanout_bench: no memory\n");
+		exit(2);
+	}
+	for (r = 0; r < rounds; r++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < clients; i++)
+			fanout_add(f, sv[i][0], "S", 1);
+		fanout_flush(f);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		ms = msec(&start, &end);
+		total += ms;
+		if (ms > worst)
+			worst = ms;
+		for (i = 0; i < clients; i++)
+			if (read(sv[i][1], &c, 1) != 1 || c != 'S') {
+				fprintf(stderr, "fanout_bench: %s lost a message\n",
+					fanout_engine(f));
+				exit(1);
+			}
+	}
+	printf("%-6s %d clients: mean %.3fms worst %.3fms, %.1f syscalls per fan-out\n",
+	       fanout_engine(f), clients, total / rounds, worst,
+	       (double)f->syscalls / f->flushes);
+}
+
+int main(int argc, char *argv[])
+{
+	int clients = 1000;
+	int rounds = 200;
+	int (*sv)[2];
+	struct rlimit rl;
+	int i;
+
+	if (argc > 1)
+		clients = atoi(argv[1]);
+	if (argc > 2)
+		rounds = atoi(argv[2]);
+
+	getrlimit(RLIMIT_NOFILE, &rl);
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+	sv = calloc(clients, sizeof(*sv));
+	for (i = 0; i < clients; i++)
+		if (socketpair(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK, 0, sv[i]) < 0) {
+			perror("socketpair");
+			exit(2);
+		}
+	run("write", sv, clients, rounds);
+	run("uring", sv, clients, rounds);
+	exit(0);
+}
@@ -0,0 +1,322 @@
+/*
+ * handoff - pass a running daemon's sockets and state to a new
+ * copy of its binary so it can be upgraded without clients noticing.
+ *
+ * The old daemon forks and execs whatever binary is now installed
+ * where it was started from, with SUSMAN_HANDOFF naming one end of
+ * a SOCK_SEQPACKET socketpair and SUSMAN_SERVICE naming the service
+ * (so that susman knows which one to run).  Over that socket it
+ * sends a header, its serialised state, and then all its fds in
+ * batches with SCM_RIGHTS.  The new daemon rebuilds itself from
+ * these, starts watching for suspend, and then sends back a single
+ * byte, at which point the old one can exit.  Until then the old
+ * daemon holds a suspend block so nothing can be missed in between.
+ * If the new one dies instead, the old one simply carries on.
+ *
+ * listen_socket() and listen_seqpacket() similarly let a daemon be
+ * given its listening sockets, by susman or anything else following
+ * the LISTEN_FDS convention, rather than binding them itself.
+ *
+ * Copyright (C) 2011 Neil Brown <neilb@suse.de>
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "libsus.h"
+#include "susman.h"
+
+#define FDS_PER_MSG	250	/* SCM_MAX_FD is 253 */
+#define CHUNK		65536
+#define ACK_WAIT	10000	/* ms for the new instance to get going */
+
+struct hdr {
+	int	nfds;
+	int	len;
+};
+
+static int send_fds(int sock, int *fds, int n)
+{
+	struct msghdr msg = {0};
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char buf[CMSG_SPACE(FDS_PER_MSG * sizeof(int))];
+
+	memset(buf, 0, sizeof(buf));
+	msg.msg_control = buf;
+	msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, n * sizeof(int));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	iov.iov_base = "F";
+	iov.iov_len = 1;
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+static int recv_fds(int sock, int *fds, int n)
+{
+	struct msghdr msg = {0};
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char buf[CMSG_SPACE(FDS_PER_MSG * sizeof(int))];
+	char c;
+
+	msg.msg_control = buf;
+	msg.msg_controllen = sizeof(buf);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1)
+		return -1;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(n * sizeof(int)))
+		return -1;
+	memcpy(fds, CMSG_DATA(cmsg), n * sizeof(int));
+	return 0;
+}
+
+static void exec_new(const char *service, int sock, char *argv[])
+{
+	char exe[4096];
+	char num[20];
+	char *args[2];
+	int n;
+
+	n = readlink("/proc/self/exe", exe, sizeof(exe)-1);
+	if (n <= 0)
+		return;
+	exe[n] = 0;
+	/* If we have been replaced, we want the replacement */
+	if (n > 10 && strcmp(exe + n - 10, " (deleted)") == 0)
+		exe[n - 10] = 0;
+
+	fcntl(sock, F_SETFD, 0);
+	snprintf(num, sizeof(num), "%d", sock);
+	setenv("SUSMAN_HANDOFF", num, 1);
+	setenv("SUSMAN_SERVICE", service, 1);
+	if (!argv) {
+		args[0] = exe;
+		args[1] = NULL;
+		argv = args;
+	}
+	execv(exe, argv);
+}
+
+/* Hand everything over to a new instance.  Returns 0 when the
+ * new instance is running and the caller should exit, or -1
+ * if the caller must continue as before.  Sends don't raise SIGPIPE
+ * if the new instance dies, and it has ACK_WAIT to say it is
+ * running before it is killed and we carry on.
+ */
+int handoff_start(const char *service, char *argv[],
+		  int *fds, int nfds, void *state, int len)
+{
+	struct hdr hdr;
+	struct pollfd pfd;
+	int sv[2];
+	int blockfd;
+	pid_t pid = -1;
+	int i;
+	char c;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, sv) < 0)
+		return -1;
+	blockfd = suspend_block(-1);
+	pid = fork();
+	if (pid < 0)
+		goto fail;
+	if (pid == 0) {
+		close(sv[0]);
+		exec_new(service, sv[1], argv);
+		_exit(1);
+	}
+	close(sv[1]);
+	sv[1] = -1;
+
+	hdr.nfds = nfds;
+	hdr.len = len;
+	if (send(sv[0], &hdr, sizeof(hdr), MSG_NOSIGNAL) != sizeof(hdr))
+		goto fail;
+	for (i = 0; i < len; i += CHUNK) {
+		int n = len - i < CHUNK ? len - i : CHUNK;
+		if (send(sv[0], (char*)state + i, n, MSG_NOSIGNAL) != n)
+			goto fail;
+	}
+	for (i = 0; i < nfds; i += FDS_PER_MSG) {
+		int n = nfds - i < FDS_PER_MSG ? nfds - i : FDS_PER_MSG;
+		if (send_fds(sv[0], fds + i, n) < 0)
+			goto fail;
+	}
+	/* Wait until the new instance is watching for suspend */
+	pfd.fd = sv[0];
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, ACK_WAIT) != 1 || read(sv[0], &c, 1) != 1)
+		goto fail;
+	close(sv[0]);
+	suspend_close(blockfd);
+	return 0;
+
+fail:
+	close(sv[0]);
+	if (sv[1] >= 0)
+		close(sv[1]);
+	if (pid > 0) {
+		/* It must not start serving the fds we keep */
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+	}
+	suspend_close(blockfd);
+	return -1;
+}
+
+static int handoff_sock = -1;
+
+/* If we were started by handoff_start, collect what was sent.
+ * Returns the number of fds or -1 if this is a normal start.
+ * *fdsp and *statep are malloced.
+ */
+int handoff_receive(int **fdsp, void **statep, int *lenp)
+{
+	char *env = getenv("SUSMAN_HANDOFF");
+	struct hdr hdr;
+	int *fds = NULL;
+	char *state = NULL;
+	int sock;
+	int i;
+
+	if (!env)
+		return -1;
+	sock = atoi(env);
+	unsetenv("SUSMAN_HANDOFF");
+	unsetenv("SUSMAN_SERVICE");
+	fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+	if (recv(sock, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+		goto fail;
+	fds = malloc((hdr.nfds + 1) * sizeof(int));
+	state = malloc(hdr.len + 1);
+	if (!fds || !state)
+		goto fail;
+	for (i = 0; i < hdr.len; ) {
+		int n = recv(sock, state + i, hdr.len - i, 0);
+		if (n <= 0)
+			goto fail;
+		i += n;
+	}
+	for (i = 0; i < hdr.nfds; i += FDS_PER_MSG) {
+		int n = hdr.nfds - i < FDS_PER_MSG ? hdr.nfds - i : FDS_PER_MSG;
+		if (recv_fds(sock, fds + i, n) < 0)
+			goto fail;
+	}
+	handoff_sock = sock;
+	*fdsp = fds;
+	*statep = state;
+	*lenp = hdr.len;
+	return hdr.nfds;
+
+fail:
+	/* The old instance will carry on */
+	exit(1);
+}
+
+/* Tell the old instance that we are fully running, and tell
+ * susman, if it is supervising us, who we are now.
+ */
+void handoff_done(void)
+{
+	char *sup = getenv("SUSMAN_SUPERVISOR");
+	pid_t pid = getpid();
+
+	if (handoff_sock < 0)
+		return;
+	if (sup)
+		send(atoi(sup), &pid, sizeof(pid), MSG_NOSIGNAL);
+	send(handoff_sock, "D", 1, MSG_NOSIGNAL);
+	close(handoff_sock);
+	handoff_sock = -1;
+}
+
+/* Return a listening socket of 'type' for 'path'.  If one was
+ * passed to us from fd 3 up with LISTEN_FDS and LISTEN_PID set, and
+ * it is bound to the right path, use that.  Otherwise bind a new one.
+ */
+static int listen_type(const char *path, int type)
+{
+	static int passed;
+	struct sockaddr_un addr;
+	socklen_t len;
+	char *fds = getenv("LISTEN_FDS");
+	char *pid = getenv("LISTEN_PID");
+	int s, t;
+
+	/* Remembered for the next call, but not for our children */
+	if (fds) {
+		passed = pid && atoi(pid) == getpid() ? atoi(fds) : 0;
+		unsetenv("LISTEN_FDS");
+		unsetenv("LISTEN_PID");
+	}
+	for (s = 3; s < 3 + passed; s++) {
+		len = sizeof(addr);
+		if (getsockname(s, (struct sockaddr *)&addr, &len) == 0 &&
+		    addr.sun_family == AF_UNIX &&
+		    strcmp(addr.sun_path, path) == 0) {
+			len = sizeof(t);
+			if (getsockopt(s, SOL_SOCKET, SO_TYPE, &t, &len) < 0 ||
+			    t != type)
+				continue;
+			fcntl(s, F_SETFD, FD_CLOEXEC);
+			fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+			return s;
+		}
+	}
+
+	s = socket(AF_UNIX, type | SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (s < 0)
+		return -1;
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(s);
+		return -1;
+	}
+	listen(s, 20);
+	return s;
+}
+
+int listen_socket(const char *path)
+{
+	return listen_type(path, SOCK_STREAM);
+}
+
+int listen_seqpacket(const char *path)
+{
+	return listen_type(path, SOCK_SEQPACKET);
+}
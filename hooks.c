@@ -0,0 +1,324 @@
+/*
+ * hooks - run executables before suspend and after resume.
+ *
+ * Every executable in /etc/suspend/hooks.d (or $SUSMAN_HOOKS) is run
+ * with "suspend" before each suspend attempt and with "resume" after
+ * it, whether or not the suspend happened.  A leading number orders
+ * them: all hooks with the same number run together, and the next
+ * number starts when they have all finished.  Numbers go up before
+ * suspend and down after resume, and hooks without one come last
+ * before suspend (so first after resume).  So "10-net" and "10-disk"
+ * run in parallel, then "20-flush".
+ *
+ * A hook may give itself a deadline with a line such as
+ *	# susman-timeout: 2000
+ * (msec, default 5000).  A hook still running then is killed along
+ * with its process group.  We wait for each hook through a pidfd, so
+ * all the hooks of a level and their deadlines are one poll().
+ *
+ * How long each hook took and how it ended are written to
+ * /run/suspend/hooks-suspend and hooks-resume, and totals are kept
+ * as metrics.
+ *
+ * Copyright (C) 2011 Neil Brown <neilb@suse.de>
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include "susman.h"
+
+#define HOOKS		"/etc/suspend/hooks.d"
+#define REPORT		"/run/suspend/hooks-"
+#define DEFAULT_MS	5000
+#define NOLEVEL		1000000	/* no leading number */
+
+struct hook {
+	char		name[64];
+	int		level;
+	int		timeout;	/* msec */
+	pid_t		pid;		/* 0 when not running */
+	int		pidfd;		/* -1 if we must poll waitpid */
+	struct timespec	start;
+	double		ms;
+	int		status;		/* exit status, -1 if killed by us */
+};
+
+static struct hook *hooks;
+static int nhooks, size;
+static int phase;		/* HOOK_SUSPEND or HOOK_RESUME */
+static int next;		/* first hook not yet started */
+static struct timespec began;
+static struct metric *m_phase[2], *m_timeouts, *m_failed;
+
+static const char *dir(void)
+{
+	const char *d = getenv("SUSMAN_HOOKS");
+
+	return d && *d ? d : HOOKS;
+}
+
+static int read_timeout(const char *path)
+{
+	char buf[1024], *p;
+	int fd = open(path, O_RDONLY|O_CLOEXEC);
+	int n;
+
+	if (fd < 0)
+		return DEFAULT_MS;
+	n = read(fd, buf, sizeof(buf)-1);
+	close(fd);
+	buf[n > 0 ? n : 0] = 0;
+	p = strstr(buf, "susman-timeout:");
+	if (p && atoi(p + 15) > 0)
+		return atoi(p + 15);
+	return DEFAULT_MS;
+}
+
+static int hook_cmp(const void *a, const void *b)
+{
+	const struct hook *ha = a, *hb = b;
+
+	if (ha->level != hb->level) {
+		int d = ha->level < hb->level ? -1 : 1;
+		return phase == HOOK_SUSPEND ? d : -d;
+	}
+	return strcmp(ha->name, hb->name);
+}
+
+static void scan(void)
+{
+	DIR *d = opendir(dir());
+	struct dirent *de;
+
+	nhooks = 0;
+	if (!d)
+		return;
+	while ((de = readdir(d)) != NULL) {
+		char path[512];
+		struct stat stb;
+		struct hook *h;
+		int len = strlen(de->d_name);
+
+		if (de->d_name[0] == '.' || de->d_name[len-1] == '~' ||
+		    len >= sizeof(h->name))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir(), de->d_name);
+		if (stat(path, &stb) < 0 || !S_ISREG(stb.st_mode) ||
+		    access(path, X_OK) < 0)
+			continue;
+		if (nhooks >= size) {
+			int nsize = size ? size * 2 : 16;
+			h = realloc(hooks, nsize * sizeof(*h));
+			if (!h)
+				break;
+			hooks = h;
+			size = nsize;
+		}
+		h = &hooks[nhooks++];
+		memset(h, 0, sizeof(*h));
+		strcpy(h->name, de->d_name);
+		h->level = (de->d_name[0] >= '0' && de->d_name[0] <= '9')
+			? atoi(de->d_name) : NOLEVEL;
+		h->timeout = read_timeout(path);
+		h->pidfd = -1;
+	}
+	closedir(d);
+}
+
+static void spawn(struct hook *h)
+{
+	char path[512];
+
+	snprintf(path, sizeof(path), "%s/%s", dir(), h->name);
+	clock_gettime(CLOCK_MONOTONIC, &h->start);
+	h->pid = fork();
+	if (h->pid == 0) {
+		/* so a timeout can kill anything it started */
+		setpgid(0, 0);
+		execl(path, h->name,
+		      phase == HOOK_SUSPEND ? "suspend" : "resume", NULL);
+		_exit(127);
+	}
+	if (h->pid < 0) {
+		h->pid = 0;
+		h->status = 127;
+		return;
+	}
+	setpgid(h->pid, h->pid);
+	h->pidfd = syscall(SYS_pidfd_open, h->pid, 0);
+}
+
+static void reap(struct hook *h, int status)
+{
+	h->ms = metric_ms(&h->start);
+	if (h->status != -1)
+		h->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128;
+	if (h->status)
+		metric_add(h->status == -1 ? m_timeouts : m_failed, 1);
+	trace(TR_HOOK, h->status, h->ms * 1000);
+	if (h->pidfd >= 0)
+		close(h->pidfd);
+	h->pidfd = -1;
+	h->pid = 0;
+}
+
+/* Start the hooks of the next level, return the first after it */
+static int start_level(void)
+{
+	int end;
+
+	if (next >= nhooks)
+		return next;
+	for (end = next; end < nhooks &&
+		     hooks[end].level == hooks[next].level; end++)
+		spawn(&hooks[end]);
+	return end;
+}
+
+/* Wait for hooks [from, to) to finish or run out of time */
+static void wait_level(int from, int to)
+{
+	struct pollfd pfd[to - from + 1];
+	int i;
+
+	while (1) {
+		int n = 0, wait = -1, slow = 0;
+		for (i = from; i < to; i++) {
+			struct hook *h = &hooks[i];
+			int status, left;
+			if (!h->pid)
+				continue;
+			if (waitpid(h->pid, &status, WNOHANG) == h->pid) {
+				reap(h, status);
+				continue;
+			}
+			left = h->timeout - metric_ms(&h->start);
+			if (left <= 0) {
+				kill(-h->pid, SIGKILL);
+				h->status = -1;
+				waitpid(h->pid, &status, 0);
+				reap(h, status);
+				continue;
+			}
+			if (wait < 0 || left < wait)
+				wait = left;
+			if (h->pidfd >= 0) {
+				pfd[n].fd = h->pidfd;
+				pfd[n++].events = POLLIN;
+			} else
+				slow = 1;
+		}
+		if (wait < 0)
+			return;
+		/* Without pidfds, look again every 10ms */
+		if (slow && wait > 10)
+			wait = 10;
+		poll(pfd, n, wait);
+	}
+}
+
+void hooks_start(int ph)
+{
+	if (!m_timeouts) {
+		m_phase[HOOK_SUSPEND] = metric_new(
+			"lsusd_hooks_seconds{phase=\"suspend\"}",
+			"Time to run all hooks", METRIC_HISTOGRAM);
+		m_phase[HOOK_RESUME] = metric_new(
+			"lsusd_hooks_seconds{phase=\"resume\"}",
+			"", METRIC_HISTOGRAM);
+		m_timeouts = metric_new("lsusd_hook_timeouts_total",
+					"Hooks killed at their deadline",
+					METRIC_COUNTER);
+		m_failed = metric_new("lsusd_hook_failures_total",
+				      "Hooks which exited with an error",
+				      METRIC_COUNTER);
+	}
+	phase = ph;
+	scan();
+	qsort(hooks, nhooks, sizeof(*hooks), hook_cmp);
+	clock_gettime(CLOCK_MONOTONIC, &began);
+	next = 0;
+	/* The first level can run while we wait for the watchers */
+	next = start_level();
+}
+
+static void report(void)
+{
+	const char *ph = phase == HOOK_SUSPEND ? "suspend" : "resume";
+	char path[64], new[sizeof(path) + 4];
+	FILE *f;
+	int i;
+
+	snprintf(path, sizeof(path), REPORT "%s", ph);
+	snprintf(new, sizeof(new), "%s.new", path);
+	f = fopen(new, "w");
+	if (!f)
+		return;
+	for (i = 0; i < nhooks; i++)
+		fprintf(f, "%s level %d ms %.1f %s %d\n", hooks[i].name,
+			hooks[i].level == NOLEVEL ? -1 : hooks[i].level,
+			hooks[i].ms, hooks[i].status == -1 ? "timeout"
+			: "status", hooks[i].status);
+	fprintf(f, "total ms %.1f\n", metric_ms(&began));
+	fclose(f);
+	rename(new, path);
+}
+
+/* Finish the level hooks_start() began, then run the rest.
+ * Returns the number of hooks which failed or timed out.
+ */
+int hooks_finish(void)
+{
+	int from = 0, failed = 0;
+	int i;
+
+	if (!nhooks)
+		return 0;
+	while (from < nhooks) {
+		wait_level(from, next);
+		from = next;
+		next = start_level();
+	}
+	for (i = 0; i < nhooks; i++)
+		if (hooks[i].status)
+			failed++;
+	metric_observe(m_phase[phase], metric_ms(&began));
+	report();
+	return failed;
+}
+
+/* Are there any hooks to run? */
+int hooks_present(void)
+{
+	scan();
+	return nhooks > 0;
+}
+
+int hooks_run(int ph)
+{
+	hooks_start(ph);
+	return hooks_finish();
+}
@@ -0,0 +1,166 @@
+#!/usr/bin/env python
+
+# Watch files in a directory through an inotify fd, with the same
+# interface as dnotify.py but no signals: the caller polls fileno()
+# (select, poll, or asyncio's add_reader) and calls handle() when it
+# is readable, which runs the callbacks for the files named in the
+# events.  Nothing is stat()ed and no signal handler is installed,
+# so any number of these can live in one process alongside
+# libraries that use signals, and flock() is never interrupted.
+#
+# The kernel interface is reached through ctypes, so there is
+# nothing to build.
+
+# Copyright (C) 2011 Neil Brown <neilb@suse.de>
+#
+#    This program is free software; you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation; either version 2 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License along
+#    with this program; if not, write to the Free Software Foundation, Inc.,
+#    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+import os, errno, struct, ctypes, ctypes.util
+
+IN_MODIFY       = 0x00000002
+IN_CLOSE_WRITE  = 0x00000008
+IN_MOVED_FROM   = 0x00000040
+IN_MOVED_TO     = 0x00000080
+IN_CREATE       = 0x00000100
+IN_DELETE       = 0x00000200
+IN_Q_OVERFLOW   = 0x00004000
+IN_IGNORED      = 0x00008000
+IN_NONBLOCK     = 0o4000
+IN_CLOEXEC      = 0o2000000
+
+# What dnotify.py asked for: DN_MODIFY|DN_RENAME|DN_CREATE|DN_DELETE
+CHANGES = IN_MODIFY|IN_MOVED_FROM|IN_MOVED_TO|IN_CREATE|IN_DELETE
+
+_libc = ctypes.CDLL(ctypes.util.find_library('c') or 'libc.so.6',
+                    use_errno=True)
+_event = struct.Struct('iIII')
+
+def _check(rv):
+    if rv < 0:
+        e = ctypes.get_errno()
+        raise OSError(e, os.strerror(e))
+    return rv
+
+class inotify():
+    # The bare fd: add watches, then read() (wd, mask, cookie, name)
+    # tuples when fileno() is readable.
+    def __init__(self):
+        self.fd = _check(_libc.inotify_init1(IN_NONBLOCK|IN_CLOEXEC))
+
+    def fileno(self):
+        return self.fd
+
+    def add_watch(self, path, mask):
+        if not isinstance(path, bytes):
+            path = path.encode()
+        return _check(_libc.inotify_add_watch(self.fd, path, mask))
+
+    def rm_watch(self, wd):
+        _check(_libc.inotify_rm_watch(self.fd, wd))
+
+    def read(self):
+        events = []
+        while True:
+            try:
+                buf = os.read(self.fd, 65536)
+            except OSError as e:
+                if e.errno in (errno.EAGAIN, errno.EINTR):
+                    return events
+                raise
+            pos = 0
+            while pos < len(buf):
+                wd, mask, cookie, length = _event.unpack_from(buf, pos)
+                pos += _event.size
+                name = buf[pos:pos + length].rstrip(b'\0').decode()
+                pos += length
+                events.append((wd, mask, cookie, name))
+
+    def close(self):
+        if self.fd >= 0:
+            os.close(self.fd)
+            self.fd = -1
+
+class dir():
+    def __init__(self, dname, notifier = None):
+        self.dname = dname
+        self.notifier = notifier or inotify()
+        self.wd = self.notifier.add_watch(dname, CHANGES)
+        self.files = []
+        self.callbacks = []
+
+    def fileno(self):
+        return self.notifier.fileno()
+
+    def watch(self, fname, callback):
+        f = file(self, fname, callback)
+        self.files.append(f)
+        return f
+
+    def watchall(self, callback):
+        self.callbacks.append(callback)
+
+    def handle(self, events = None):
+        # Run the callbacks for whatever has changed.  With a shared
+        # notifier, pass the events read from it.
+        if events is None:
+            events = self.notifier.read()
+        changed = set()
+        everything = False
+        for wd, mask, cookie, name in events:
+            if mask & IN_Q_OVERFLOW:
+                everything = True
+            elif wd == self.wd:
+                changed.add(name)
+        if not changed and not everything:
+            return
+        newlist = []
+        for c in self.callbacks:
+            if c():
+                newlist.append(c)
+        self.callbacks = newlist
+
+        for f in self.files[:]:
+            if everything or f.base in changed:
+                f.callback(f)
+
+    def cancel(self, victim):
+        if victim in self.files:
+            self.files.remove(victim)
+
+class file():
+    def __init__(self, d, fname, callback):
+        self.dir = d
+        self.base = fname
+        self.name = os.path.join(d.dname, fname)
+        self.callback = callback
+
+    def cancel(self):
+        self.dir.cancel(self)
+
+
+if __name__ == "__main__" :
+    import select
+
+    def ping(f): print("got " + f.name)
+
+    d = dir("/tmp/n")
+    a = d.watch("a", ping)
+    b = d.watch("b", ping)
+    c = d.watch("c", ping)
+
+    while True:
+        select.select([d], [], [])
+        d.handle()
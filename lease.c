@@ -0,0 +1,56 @@
+
+/*
+ * Library code to take a named suspend lease from leased.
+ * The handle returned is the connection; suspend stays blocked
+ * until it is released or closed, or the lease times out, in which
+ * case leased writes "X" so the handle becomes readable.
+ *
+ * Copyright (C) 2011 Neil Brown <neilb@suse.de>
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include "libsus.h"
+#include "susman.h"
+
+/* 'timeout' is in msec, 0 for none.  Returns a handle, or -1 */
+int suspend_lease(const char *name, int timeout)
+{
+	char buf[80];
+	int fd = sus_connect("/run/suspend/lease");
+	int n;
+
+	if (fd < 0)
+		return -1;
+	/* We must not return until suspend is blocked */
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+	n = snprintf(buf, sizeof(buf), "L %s %d\n", name, timeout);
+	if (n >= sizeof(buf) || write(fd, buf, n) != n ||
+	    read(fd, buf, 3) != 3 || strncmp(buf, "OK\n", 3) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+void suspend_release(int handle)
+{
+	if (handle >= 0)
+		close(handle);
+}
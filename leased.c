@@ -0,0 +1,445 @@
+
+/*
+ * leased - named suspend leases.
+ *
+ * A client connects to /run/suspend/lease and writes
+ *	L name [timeout-ms]
+ * and once we are blocking suspend on its behalf we reply "OK".
+ * Suspend stays blocked until the client writes "U", closes the
+ * connection (or dies), or the timeout passes, in which case we
+ * write "X".  One connection holds at most one lease, but may take
+ * another after releasing the first.
+ *
+ * Unlike a plain shared lock on /run/suspend/disabled, we know who
+ * holds each lease: by the name given and by the uid of the
+ * connection.  For each we keep the number of active leases, how
+ * many were taken and expired, and the total and longest time they
+ * were held.  These are written to /run/suspend/leases whenever a
+ * lease is taken or ends, and "?" gets the same text back, ending
+ * with ".".
+ *
+ * Replies never block or raise SIGPIPE: what a client doesn't read
+ * at once is queued, up to OUT_MAX, and a client which lets more
+ * than that pile up is dropped.
+ *
+ * Copyright (C) 2011 Neil Brown <neilb@suse.de>
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <event.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "libsus.h"
+#include "susman.h"
+
+#define REPORT	"/run/suspend/leases"
+#define OUT_MAX	(1 << 20)	/* unread replies we keep for a client */
+
+static struct metric *m_active, *m_taken, *m_expired, *m_held;
+
+/* Totals for one lease name, or one uid */
+struct acct {
+	struct acct	*next;
+	char		key[64];	/* "name foo" or "uid 1000" */
+	int		active;
+	unsigned long	taken, expired;
+	double		held_ms;	/* by leases which have ended */
+	double		max_ms;
+};
+
+struct conn {
+	struct event	ev;
+	struct event	tev;		/* expiry */
+	struct event	wev;		/* while 'out' is waiting */
+	struct state	*state;
+	struct conn	*next;
+	uid_t		uid;
+	pid_t		pid;
+	int		held;
+	struct timespec	start;
+	struct acct	*byname, *byuid;
+	char		buf[128];	/* partial line */
+	int		len;
+	char		*out;		/* replies not yet taken */
+	int		outlen;
+	int		dead;		/* too much was left unread */
+};
+
+struct state {
+	struct conn	*conns;
+	struct acct	*accts;
+	int		active;
+	int		disablefd;
+	int		disabled;
+};
+
+static void metrics_init(void)
+{
+	metrics_open("leased");
+	m_active = metric_new("leased_active", "Leases now held",
+			      METRIC_GAUGE);
+	m_taken = metric_new("leased_taken_total", "Leases taken",
+			     METRIC_COUNTER);
+	m_expired = metric_new("leased_expired_total",
+			       "Leases ended by their timeout",
+			       METRIC_COUNTER);
+	m_held = metric_new("leased_held_seconds",
+			    "How long each lease was held", METRIC_HISTOGRAM);
+	metric_set(m_active, 0);
+}
+
+static struct acct *find_acct(struct state *state, const char *key)
+{
+	struct acct *a;
+
+	for (a = state->accts; a; a = a->next)
+		if (strcmp(a->key, key) == 0)
+			return a;
+	a = calloc(1, sizeof(*a));
+	if (!a)
+		return NULL;
+	strncpy(a->key, key, sizeof(a->key)-1);
+	a->next = state->accts;
+	state->accts = a;
+	return a;
+}
+
+static void report(struct state *state, FILE *f)
+{
+	struct acct *a;
+	struct conn *c;
+
+	for (a = state->accts; a; a = a->next) {
+		double held = a->held_ms, max = a->max_ms;
+		/* include leases still held */
+		for (c = state->conns; c; c = c->next)
+			if (c->held && (c->byname == a || c->byuid == a)) {
+				double ms = metric_ms(&c->start);
+				held += ms;
+				if (ms > max)
+					max = ms;
+			}
+		fprintf(f, "%s active %d taken %lu expired %lu "
+			"held_ms %.0f max_ms %.0f\n",
+			a->key, a->active, a->taken, a->expired, held, max);
+	}
+	for (c = state->conns; c; c = c->next)
+		if (c->held)
+			fprintf(f, "lease %s uid %d pid %d for_ms %.0f\n",
+				c->byname->key + 5, (int)c->uid, (int)c->pid,
+				metric_ms(&c->start));
+}
+
+static void write_report(struct state *state)
+{
+	FILE *f = fopen(REPORT ".new", "w");
+
+	if (!f)
+		return;
+	report(state, f);
+	fclose(f);
+	rename(REPORT ".new", REPORT);
+}
+
+static void end_lease(struct conn *c, int expired)
+{
+	struct state *state = c->state;
+	double ms;
+
+	if (!c->held)
+		return;
+	ms = metric_ms(&c->start);
+	c->held = 0;
+	evtimer_del(&c->tev);
+	c->byname->active--;
+	c->byuid->active--;
+	c->byname->held_ms += ms;
+	c->byuid->held_ms += ms;
+	if (ms > c->byname->max_ms)
+		c->byname->max_ms = ms;
+	if (ms > c->byuid->max_ms)
+		c->byuid->max_ms = ms;
+	if (expired) {
+		c->byname->expired++;
+		c->byuid->expired++;
+		metric_add(m_expired, 1);
+	}
+	metric_observe(m_held, ms);
+	trace(TR_RELEASE, c->uid, ms);
+	if (--state->active == 0 && state->disabled) {
+		suspend_allow(state->disablefd);
+		state->disabled = 0;
+	}
+	metric_set(m_active, state->active);
+	write_report(state);
+}
+
+static void do_write(int fd, short ev, void *data)
+{
+	struct conn *c = data;
+	int n;
+
+	n = send(fd, c->out, c->outlen, MSG_NOSIGNAL|MSG_DONTWAIT);
+	if (n < 0 && errno == EAGAIN) {
+		event_add(&c->wev, NULL);
+		return;
+	}
+	if (n <= 0)
+		/* Gone: do_read will see that */
+		n = c->outlen;
+	c->outlen -= n;
+	memmove(c->out, c->out + n, c->outlen);
+	if (c->outlen)
+		event_add(&c->wev, NULL);
+}
+
+static void reply(struct conn *c, const char *buf, int len)
+{
+	char *out;
+	int n = 0;
+
+	if (c->dead)
+		return;
+	if (!c->outlen) {
+		n = send(EVENT_FD(&c->ev), buf, len,
+			 MSG_NOSIGNAL|MSG_DONTWAIT);
+		if (n < 0 && errno != EAGAIN)
+			return;
+		if (n < 0)
+			n = 0;
+		if (n == len)
+			return;
+	}
+	if (c->outlen + len - n > OUT_MAX) {
+		c->dead = 1;
+		return;
+	}
+	out = realloc(c->out, c->outlen + len - n);
+	if (!out) {
+		c->dead = 1;
+		return;
+	}
+	c->out = out;
+	memcpy(c->out + c->outlen, buf + n, len - n);
+	if (!c->outlen)
+		event_add(&c->wev, NULL);
+	c->outlen += len - n;
+}
+
+static void del_conn(struct conn *c);
+
+static void do_expire(int fd, short ev, void *data)
+{
+	struct conn *c = data;
+
+	end_lease(c, 1);
+	reply(c, "X\n", 2);
+	if (c->dead)
+		del_conn(c);
+}
+
+static int valid_name(const char *name)
+{
+	if (!*name || strlen(name) > 48)
+		return 0;
+	for (; *name; name++)
+		if (!isalnum(*name) && !strchr("._-:@/", *name))
+			return 0;
+	return 1;
+}
+
+static void take_lease(struct conn *c, char *args)
+{
+	struct state *state = c->state;
+	char name[64], key[64], num[16], *end;
+	long ms = 0;
+	int n;
+
+	n = sscanf(args, "%63s %15s %c", name, num, key);
+	if (n == 2) {
+		ms = strtol(num, &end, 10);
+		if (*end)
+			n = 0;
+	}
+	if (c->held || n < 1 || n > 2 || !valid_name(name) || ms < 0) {
+		reply(c, "E\n", 2);
+		return;
+	}
+	/* valid_name() has made sure this fits */
+	if (snprintf(key, sizeof(key), "name %s", name) >= sizeof(key)) {
+		reply(c, "E\n", 2);
+		return;
+	}
+	c->byname = find_acct(state, key);
+	snprintf(key, sizeof(key), "uid %d", (int)c->uid);
+	c->byuid = find_acct(state, key);
+	if (!c->byname || !c->byuid) {
+		reply(c, "E\n", 2);
+		return;
+	}
+	/* Must be blocking suspend before we say OK */
+	if (!state->disabled) {
+		suspend_block(state->disablefd);
+		state->disabled = 1;
+	}
+	state->active++;
+	c->held = 1;
+	clock_gettime(CLOCK_MONOTONIC, &c->start);
+	c->byname->active++;
+	c->byuid->active++;
+	c->byname->taken++;
+	c->byuid->taken++;
+	if (ms) {
+		struct timeval tv;
+		tv.tv_sec = ms / 1000;
+		tv.tv_usec = (ms % 1000) * 1000;
+		evtimer_add(&c->tev, &tv);
+	}
+	metric_add(m_taken, 1);
+	metric_set(m_active, state->active);
+	trace(TR_LEASE, c->uid, ms);
+	reply(c, "OK\n", 3);
+	write_report(state);
+}
+
+static void del_conn(struct conn *c)
+{
+	struct conn **cp = &c->state->conns;
+
+	end_lease(c, 0);
+	while (*cp && *cp != c)
+		cp = &(*cp)->next;
+	if (*cp)
+		*cp = c->next;
+	event_del(&c->ev);
+	event_del(&c->wev);
+	close(EVENT_FD(&c->ev));
+	free(c->out);
+	free(c);
+}
+
+static void do_read(int fd, short ev, void *data)
+{
+	struct conn *c = data;
+	char *nl;
+	int n;
+
+	n = read(fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+	if (n < 0 && errno == EAGAIN)
+		return;
+	if (n <= 0) {
+		del_conn(c);
+		return;
+	}
+	c->len += n;
+	c->buf[c->len] = 0;
+	while ((nl = strchr(c->buf, '\n')) != NULL) {
+		*nl = 0;
+		switch (c->buf[0]) {
+		case 'L':
+			take_lease(c, c->buf + 1);
+			break;
+		case 'U':
+			end_lease(c, 0);
+			break;
+		case '?': {
+			char *text;
+			size_t size;
+			FILE *f = open_memstream(&text, &size);
+			if (f) {
+				report(c->state, f);
+				fprintf(f, ".\n");
+				fclose(f);
+				reply(c, text, size);
+				free(text);
+			}
+			break;
+		}
+		}
+		c->len -= nl + 1 - c->buf;
+		memmove(c->buf, nl + 1, c->len + 1);
+	}
+	if (c->len == sizeof(c->buf) - 1 || c->dead)
+		/* no line is that long */
+		del_conn(c);
+}
+
+static void do_accept(int fd, short ev, void *data)
+{
+	struct state *state = data;
+	struct ucred cred;
+	socklen_t len;
+	struct conn *c;
+	int newfd;
+
+	/* Take everyone who is waiting, not just one per wakeup */
+	while ((newfd = accept4(fd, NULL, NULL,
+				SOCK_NONBLOCK|SOCK_CLOEXEC)) >= 0) {
+		c = calloc(1, sizeof(*c));
+		if (!c) {
+			close(newfd);
+			continue;
+		}
+		len = sizeof(cred);
+		if (getsockopt(newfd, SOL_SOCKET, SO_PEERCRED,
+			       &cred, &len) == 0) {
+			c->uid = cred.uid;
+			c->pid = cred.pid;
+		} else
+			c->uid = c->pid = -1;
+		c->state = state;
+		event_set(&c->ev, newfd, EV_READ | EV_PERSIST, do_read, c);
+		event_add(&c->ev, NULL);
+		evtimer_set(&c->tev, do_expire, c);
+		event_set(&c->wev, newfd, EV_WRITE, do_write, c);
+		c->next = state->conns;
+		state->conns = c;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct state state;
+	struct event ev;
+	int s;
+
+	memset(&state, 0, sizeof(state));
+	metrics_init();
+	trace_open("leased");
+	state.disablefd = suspend_open();
+	if (state.disablefd < 0)
+		exit(1);
+
+	event_init();
+	s = listen_socket("/run/suspend/lease");
+	if (s < 0)
+		exit(1);
+	write_report(&state);
+	event_set(&ev, s, EV_READ | EV_PERSIST, do_accept, &state);
+	event_add(&ev, NULL);
+	/* Incase someone is waiting for us... */
+	close(0);
+
+	event_loop(0);
+	exit(0);
+}
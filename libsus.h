@@ -16,24 +16,94 @@
  *    with this program; if not, write to the Free Software Foundation, Inc.,
  *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
+#include <stdint.h>
+
 int suspend_open();
 int suspend_block(int handle);
 void suspend_allow(int handle);
 int suspend_close(int handle);
 void suspend_abort(int handle);
 
+int suspend_lease(const char *name, int timeout);
+void suspend_release(int handle);
+
 void *suspend_watch(int (*will_suspend)(void *data),
 		    void (*did_resume)(void *data),
 		    void *data);
 void suspend_ok(void *han);
 void suspend_unwatch(void *v);
+void suspend_resumed_at(void *han, struct timespec *ts);
+void suspend_watch_data(void *han, void *data);
 
 struct event *wake_set(int fd, void(*fn)(int,short,void*),
 		       void *data, int prio);
 void wake_destroy(struct event *ev);
+/* Order in which lsused tells clients about resume */
+enum { WAKE_PROMPT, WAKE_NORMAL, WAKE_BULK, WAKE_CLASSES };
+void wake_set_class(struct event *ev, int cls,
+		    void (*resumed)(void *data));
+void wake_set_data(struct event *ev, void *data);
 
 struct event *wakealarm_set(time_t when, void(*fn)(int, short, void*),
 			    void *data);
 void wakealarm_destroy(struct event *ev);
+void wakealarm_set_data(struct event *ev, void *data);
+
+/* Binary protocol on the SOCK_SEQPACKET sockets (see susproto.c).
+ * Each datagram is a header and 'count' fixed size messages.
+ */
+#define SUSP_REGISTRATION	"/run/suspend/registration.pkt"
+#define SUSP_WAKEALARM		"/run/suspend/wakealarm.pkt"
+#define SUSP_MAGIC		0x50535553	/* "SUSP" */
+#define SUSP_VERSION		1
+#define SUSP_BATCH		64	/* most messages per datagram */
+#define SUSP_MAXFDS		64	/* most fds per datagram */
+
+enum {
+	SUSP_HELLO = 1,		/* arg: capabilities */
+	SUSP_ERROR,		/* arg: the op not understood */
+	SUSP_WATCH,		/* arg: how many of the fds sent are for it */
+	SUSP_WATCHED,
+	SUSP_SUSPEND,		/* lsused: suspend soon, reply SUSP_READY */
+	SUSP_READY,
+	SUSP_AWAKE,
+	SUSP_CLASS,		/* arg: WAKE_PROMPT etc */
+	SUSP_ALARM,		/* arg: time to wake */
+	SUSP_ALARM_SET,		/* arg: the time registered */
+	SUSP_NOW,		/* arg: the time which has come */
+	SUSP_OPS
+};
+
+/* Capabilities, offered by the client and granted in the reply */
+#define SUSP_CAP_WATCH		1	/* WATCH, SUSPEND/READY/AWAKE */
+#define SUSP_CAP_CLASS		2
+#define SUSP_CAP_ALARM		4
+
+struct susp_hdr {
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	count;
+};
+
+struct susp_msg {
+	uint16_t	op;
+	uint16_t	flags;
+	uint32_t	id;		/* chosen by the client, echoed in replies */
+	int64_t		arg;
+};
+
+struct susp_frame {
+	struct susp_hdr	hdr;
+	struct susp_msg	msg[SUSP_BATCH];
+};
 
+#define SUSP_ONE	(sizeof(struct susp_hdr) + sizeof(struct susp_msg))
 
+int susp_connect(const char *path);
+void susp_init(struct susp_frame *f);
+int susp_add(struct susp_frame *f, int op, uint32_t id, int64_t arg);
+int susp_len(const struct susp_frame *f);
+int susp_one(void *buf, int op, uint32_t id, int64_t arg);
+int susp_parse(const void *buf, int len);
+int susp_send(int sock, struct susp_frame *f, const int *fds, int nfds);
+int susp_recv(int sock, struct susp_frame *f, int *fds, int *nfds);
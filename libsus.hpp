@@ -0,0 +1,344 @@
+/* C++20 interface to libsus.
+ *
+ * Move-only owners for the libsus handles, so they are released on
+ * every path out of a scope, and awaitables so a coroutine can wait
+ * for the next suspend, the next resume or a wake alarm.  Everything
+ * is inline over the C functions: a SuspendBlocker is just the fd,
+ * and a WakeFd or WakeAlarm is the C handle plus the callable, with
+ * the callable called directly from the C callback.  Neither awaiting
+ * nor moving allocates; registering allocates just what the C call
+ * does.
+ *
+ * As with the C interface, callbacks and coroutines run from the
+ * libevent loop, so the program must call event_init() first and
+ * then event_dispatch() (or event_loop()).
+ *
+ *	sus::Task watch(sus::SuspendWatcher &w)
+ *	{
+ *		while (1) {
+ *			co_await w.suspending();
+ *			save_state();	// suspend waits until we await again
+ *			co_await w.resumed();
+ *			reconnect();
+ *		}
+ *	}
+ *
+ * Copyright (C) 2011 Neil Brown <neilb@suse.de>
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef LIBSUS_HPP
+#define LIBSUS_HPP
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include <time.h>
+#include <event.h>
+
+extern "C" {
+#include "libsus.h"
+}
+
+namespace sus {
+
+/* Fire-and-forget coroutine: starts at once, frees itself at the end */
+struct Task {
+	struct promise_type {
+		Task get_return_object() noexcept { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+	};
+};
+
+/* A shared lock on /run/suspend/disabled */
+class SuspendBlocker {
+public:
+	explicit SuspendBlocker(bool blocked = false)
+		: fd_(suspend_open()), blocked_(false)
+	{
+		if (blocked)
+			block();
+	}
+	SuspendBlocker(SuspendBlocker &&o) noexcept
+		: fd_(std::exchange(o.fd_, -1)),
+		  blocked_(std::exchange(o.blocked_, false)) {}
+	SuspendBlocker &operator=(SuspendBlocker &&o) noexcept
+	{
+		if (this != &o) {
+			suspend_close(fd_);
+			fd_ = std::exchange(o.fd_, -1);
+			blocked_ = std::exchange(o.blocked_, false);
+		}
+		return *this;
+	}
+	SuspendBlocker(const SuspendBlocker &) = delete;
+	SuspendBlocker &operator=(const SuspendBlocker &) = delete;
+	~SuspendBlocker() { suspend_close(fd_); }
+
+	/* Returns false if /run/suspend/disabled couldn't be opened */
+	explicit operator bool() const noexcept { return fd_ >= 0; }
+	bool blocked() const noexcept { return blocked_; }
+	void block() noexcept
+	{
+		if (fd_ >= 0 && !blocked_) {
+			suspend_block(fd_);
+			blocked_ = true;
+		}
+	}
+	void allow() noexcept
+	{
+		if (blocked_) {
+			suspend_allow(fd_);
+			blocked_ = false;
+		}
+	}
+	/* Abort a suspend in progress */
+	void abort() noexcept { suspend_abort(fd_); }
+	int fd() const noexcept { return fd_; }
+
+private:
+	int fd_;
+	bool blocked_;
+};
+
+/* Blocks suspend while 'fd' is readable, and calls 'fn(fd)' with
+ * suspend blocked.  See wake_set().
+ */
+template <class F>
+class WakeFd {
+public:
+	WakeFd(int fd, F fn, int prio = 0)
+		: fn_(std::move(fn)),
+		  ev_(wake_set(fd, &WakeFd::call, this, prio)) {}
+	WakeFd(WakeFd &&o) noexcept
+		: fn_(std::move(o.fn_)), ev_(std::exchange(o.ev_, nullptr))
+	{
+		if (ev_)
+			wake_set_data(ev_, this);
+	}
+	WakeFd &operator=(WakeFd &&o) noexcept
+	{
+		if (this != &o) {
+			reset();
+			fn_ = std::move(o.fn_);
+			ev_ = std::exchange(o.ev_, nullptr);
+			if (ev_)
+				wake_set_data(ev_, this);
+		}
+		return *this;
+	}
+	WakeFd(const WakeFd &) = delete;
+	WakeFd &operator=(const WakeFd &) = delete;
+	~WakeFd() { reset(); }
+
+	explicit operator bool() const noexcept { return ev_ != nullptr; }
+	/* WAKE_PROMPT, WAKE_NORMAL or WAKE_BULK */
+	void set_class(int cls) noexcept
+	{
+		if (ev_)
+			wake_set_class(ev_, cls, nullptr);
+	}
+	void reset() noexcept
+	{
+		if (ev_)
+			wake_destroy(std::exchange(ev_, nullptr));
+	}
+
+private:
+	static void call(int fd, short, void *data)
+	{
+		static_cast<WakeFd *>(data)->fn_(fd);
+	}
+	F fn_;
+	struct event *ev_;
+};
+
+/* Calls 'fn()' at 'when', waking the system for it if need be, with
+ * suspend blocked until it returns.  See wakealarm_set().
+ */
+template <class F>
+class WakeAlarm {
+public:
+	WakeAlarm(time_t when, F fn)
+		: fn_(std::move(fn)),
+		  ev_(wakealarm_set(when, &WakeAlarm::call, this)) {}
+	WakeAlarm(WakeAlarm &&o) noexcept
+		: fn_(std::move(o.fn_)), ev_(std::exchange(o.ev_, nullptr))
+	{
+		if (ev_)
+			wakealarm_set_data(ev_, this);
+	}
+	WakeAlarm &operator=(WakeAlarm &&o) noexcept
+	{
+		if (this != &o) {
+			cancel();
+			fn_ = std::move(o.fn_);
+			ev_ = std::exchange(o.ev_, nullptr);
+			if (ev_)
+				wakealarm_set_data(ev_, this);
+		}
+		return *this;
+	}
+	WakeAlarm(const WakeAlarm &) = delete;
+	WakeAlarm &operator=(const WakeAlarm &) = delete;
+	~WakeAlarm() { cancel(); }
+
+	/* True until it fires or is cancelled */
+	bool pending() const noexcept { return ev_ != nullptr; }
+	void cancel() noexcept
+	{
+		if (ev_)
+			wakealarm_destroy(std::exchange(ev_, nullptr));
+	}
+
+private:
+	static void call(int, short, void *data)
+	{
+		WakeAlarm *a = static_cast<WakeAlarm *>(data);
+		/* libsus frees the handle when we return */
+		a->ev_ = nullptr;
+		a->fn_();
+	}
+	F fn_;
+	struct event *ev_;
+};
+
+/* co_await sus::alarm_at(t): resumes at 't' (with the system woken
+ * for it), with suspend blocked until the coroutine next suspends.
+ * Yields false if wakealarmd couldn't be reached.
+ */
+class alarm_at {
+public:
+	explicit alarm_at(time_t when) noexcept : when_(when) {}
+	alarm_at(const alarm_at &) = delete;
+	~alarm_at()
+	{
+		if (ev_)
+			wakealarm_destroy(ev_);
+	}
+	bool await_ready() const noexcept { return false; }
+	bool await_suspend(std::coroutine_handle<> h) noexcept
+	{
+		h_ = h;
+		ev_ = wakealarm_set(when_, &alarm_at::call, this);
+		return ev_ != nullptr;
+	}
+	bool await_resume() const noexcept { return fired_; }
+
+private:
+	static void call(int, short, void *data)
+	{
+		alarm_at *a = static_cast<alarm_at *>(data);
+		a->ev_ = nullptr;
+		a->fired_ = true;
+		a->h_.resume();
+	}
+	time_t when_;
+	struct event *ev_ = nullptr;
+	bool fired_ = false;
+	std::coroutine_handle<> h_;
+};
+
+/* Told about each suspend and resume through the 'watching' file.
+ * A coroutine waiting in suspending() is resumed when a suspend is
+ * about to happen, and the suspend waits until it suspends again
+ * (or finishes) - or, if it called hold(), until it calls ready().
+ * Nobody waiting means no objection.
+ */
+class SuspendWatcher {
+public:
+	SuspendWatcher()
+		: han_(suspend_watch(&SuspendWatcher::will, &SuspendWatcher::did,
+				     this)) {}
+	SuspendWatcher(SuspendWatcher &&o) noexcept
+		: suspend_(std::exchange(o.suspend_, nullptr)),
+		  resume_(std::exchange(o.resume_, nullptr)),
+		  held_(std::exchange(o.held_, false)),
+		  han_(std::exchange(o.han_, nullptr))
+	{
+		if (han_)
+			suspend_watch_data(han_, this);
+	}
+	SuspendWatcher &operator=(SuspendWatcher &&o) noexcept
+	{
+		if (this != &o) {
+			reset();
+			han_ = std::exchange(o.han_, nullptr);
+			suspend_ = std::exchange(o.suspend_, nullptr);
+			resume_ = std::exchange(o.resume_, nullptr);
+			held_ = std::exchange(o.held_, false);
+			if (han_)
+				suspend_watch_data(han_, this);
+		}
+		return *this;
+	}
+	SuspendWatcher(const SuspendWatcher &) = delete;
+	SuspendWatcher &operator=(const SuspendWatcher &) = delete;
+	~SuspendWatcher() { reset(); }
+
+	explicit operator bool() const noexcept { return han_ != nullptr; }
+	void reset() noexcept
+	{
+		if (han_)
+			suspend_unwatch(std::exchange(han_, nullptr));
+	}
+	/* Keep the current suspend waiting past our next co_await */
+	void hold() noexcept { held_ = true; }
+	void ready() noexcept
+	{
+		if (held_ && han_) {
+			held_ = false;
+			suspend_ok(han_);
+		}
+	}
+
+	struct Awaiter {
+		std::coroutine_handle<> *slot;
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> h) noexcept
+		{
+			*slot = h;
+		}
+		void await_resume() const noexcept {}
+	};
+	Awaiter suspending() noexcept { return Awaiter{&suspend_}; }
+	Awaiter resumed() noexcept { return Awaiter{&resume_}; }
+
+private:
+	static int will(void *data)
+	{
+		SuspendWatcher *w = static_cast<SuspendWatcher *>(data);
+		if (auto h = std::exchange(w->suspend_, nullptr))
+			h.resume();
+		return !w->held_;
+	}
+	static void did(void *data)
+	{
+		SuspendWatcher *w = static_cast<SuspendWatcher *>(data);
+		if (auto h = std::exchange(w->resume_, nullptr))
+			h.resume();
+	}
+	std::coroutine_handle<> suspend_, resume_;
+	bool held_ = false;
+	/* last: suspend_watch() may call will() before it returns */
+	void *han_;
+};
+
+} /* namespace sus */
+
+#endif /* LIBSUS_HPP */
@@ -0,0 +1,109 @@
+/*
+ * Compare libsus.hpp with the C calls it wraps.
+ * Times 'rounds' (default 200000) block/allow pairs on
+ * /run/suspend/disabled through suspend_block()/suspend_allow() and
+ * through a SuspendBlocker, then the same number of open/close
+ * pairs, alternating the two in batches so neither gets a warmer
+ * cache.  Also reports what each C++ handle costs in memory over
+ * the C handle it owns.  Needs /run/suspend/disabled to exist.
+ *
+ * Copyright (C) 2011 Neil Brown <neilb@suse.de>
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "libsus.hpp"
+
+#define BATCH	1000
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void c_block(int fd)
+{
+	suspend_block(fd);
+	suspend_allow(fd);
+}
+
+static void cxx_block(sus::SuspendBlocker &b)
+{
+	b.block();
+	b.allow();
+}
+
+static void c_open(void)
+{
+	suspend_close(suspend_open());
+}
+
+static void cxx_open(void)
+{
+	sus::SuspendBlocker b;
+}
+
+int main(int argc, char *argv[])
+{
+	int rounds = argc > 1 ? atoi(argv[1]) : 200000;
+	double c = 0, cxx = 0, t;
+	int fd, r, i;
+
+	fd = suspend_open();
+	sus::SuspendBlocker b;
+	if (fd < 0 || !b) {
+		fprintf(stderr, "libsus_bench: cannot open /run/suspend/disabled\n");
+		exit(2);
+	}
+	for (r = 0; r < rounds; r += BATCH) {
+		t = now_ns();
+		for (i = 0; i < BATCH; i++)
+			c_block(fd);
+		c += now_ns() - t;
+		t = now_ns();
+		for (i = 0; i < BATCH; i++)
+			cxx_block(b);
+		cxx += now_ns() - t;
+	}
+	printf("block+allow: C %.1fns  C++ %.1fns  (%+.1f%%)\n",
+	       c / rounds, cxx / rounds, (cxx - c) * 100 / c);
+
+	c = cxx = 0;
+	for (r = 0; r < rounds; r += BATCH) {
+		t = now_ns();
+		for (i = 0; i < BATCH; i++)
+			c_open();
+		c += now_ns() - t;
+		t = now_ns();
+		for (i = 0; i < BATCH; i++)
+			cxx_open();
+		cxx += now_ns() - t;
+	}
+	printf("open+close:  C %.1fns  C++ %.1fns  (%+.1f%%)\n",
+	       c / rounds, cxx / rounds, (cxx - c) * 100 / c);
+
+	auto fn = [](int) {};
+	printf("sizeof: SuspendBlocker %zu (fd %zu), WakeFd %zu (event * %zu), "
+	       "SuspendWatcher %zu\n",
+	       sizeof(sus::SuspendBlocker), sizeof(int),
+	       sizeof(sus::WakeFd<decltype(fn)>), sizeof(struct event *),
+	       sizeof(sus::SuspendWatcher));
+	suspend_close(fd);
+	exit(0);
+}
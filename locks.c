@@ -0,0 +1,224 @@
+/*
+ * locks - who holds locks on the files in /run/suspend.
+ *
+ * Anyone may block suspend with a shared flock on 'disabled', and
+ * watchers hold shared locks on 'watching' and 'watching-next', but
+ * the only place to find out who is /proc/locks, which lists every
+ * lock on the system.  We keep a table of the holders we have seen,
+ * and rescan at most every CACHE_MS: each line of /proc/locks is
+ * only checked for the device:inode of our three files, and only a
+ * holder not already in the table costs a read of its comm.  As the
+ * kernel doesn't say when a lock was taken, 'since' is when we first
+ * saw it.
+ *
+ * Copyright (C) 2011 Neil Brown <neilb@suse.de>
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include "susman.h"
+
+#define CACHE_MS	100
+
+const char *lock_files[LOCK_FILES] = { "disabled", "watching", "watching-next" };
+
+static struct lock_holder *holders;
+static int nholders, size;
+static struct timespec scanned;
+static char *buf;
+static int bufsize;
+
+/* Read all of /proc/locks.  Returns the length, or -1 */
+static int slurp(void)
+{
+	int fd = open("/proc/locks", O_RDONLY|O_CLOEXEC);
+	int len = 0, n;
+
+	if (fd < 0)
+		return -1;
+	while (1) {
+		if (bufsize - len < 4096) {
+			char *b = realloc(buf, bufsize + 65536);
+			if (!b)
+				break;
+			buf = b;
+			bufsize += 65536;
+		}
+		n = read(fd, buf + len, bufsize - len - 1);
+		if (n <= 0)
+			break;
+		len += n;
+	}
+	close(fd);
+	buf[len] = 0;
+	return len;
+}
+
+static void get_comm(struct lock_holder *h)
+{
+	char path[32];
+	int fd, n;
+
+	strcpy(h->comm, "?");
+	snprintf(path, sizeof(path), "/proc/%d/comm", (int)h->pid);
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return;
+	n = read(fd, h->comm, sizeof(h->comm)-1);
+	close(fd);
+	if (n <= 0)
+		n = 0;
+	h->comm[n] = 0;
+	h->comm[strcspn(h->comm, "\n")] = 0;
+}
+
+static void note(int file, pid_t pid, int write, int waiting, time_t now)
+{
+	struct lock_holder *h;
+	int i;
+
+	for (i = 0; i < nholders; i++) {
+		h = &holders[i];
+		if (h->file == file && h->pid == pid &&
+		    h->write == write && h->waiting == waiting) {
+			if (!h->seen)
+				h->count = 0;
+			h->seen = 1;
+			h->count++;
+			return;
+		}
+	}
+	if (nholders >= size) {
+		int nsize = size ? size * 2 : 16;
+		h = realloc(holders, nsize * sizeof(*h));
+		if (!h)
+			return;
+		holders = h;
+		size = nsize;
+	}
+	h = &holders[nholders++];
+	h->file = file;
+	h->pid = pid;
+	h->write = write;
+	h->waiting = waiting;
+	h->since = now;
+	h->seen = 1;
+	h->count = 1;
+	get_comm(h);
+}
+
+static void scan(void)
+{
+	char keys[LOCK_FILES][48];
+	struct stat stb;
+	time_t now = time(0);
+	char *line, *end;
+	int len, i;
+
+	for (i = 0; i < LOCK_FILES; i++) {
+		char path[64];
+		snprintf(path, sizeof(path), "/run/suspend/%s", lock_files[i]);
+		if (stat(path, &stb) == 0)
+			snprintf(keys[i], sizeof(keys[i]), " %02x:%02x:%lu ",
+				 major(stb.st_dev), minor(stb.st_dev),
+				 (unsigned long)stb.st_ino);
+		else
+			keys[i][0] = 0;
+	}
+	for (i = 0; i < nholders; i++)
+		holders[i].seen = 0;
+	len = slurp();
+	for (line = buf; len > 0 && line < buf + len; line = end + 1) {
+		char *p;
+		int f;
+
+		end = strchr(line, '\n');
+		if (!end)
+			end = buf + len;
+		*end = 0;
+		for (f = 0; f < LOCK_FILES; f++)
+			if (keys[f][0] && strstr(line, keys[f]))
+				break;
+		if (f == LOCK_FILES)
+			continue;
+		/* "N: [-> ]FLOCK  ADVISORY  READ|WRITE pid dev:ino ..." */
+		p = strstr(line, "FLOCK");
+		if (!p)
+			continue;
+		p = strstr(p, "ADVISORY");
+		if (!p)
+			continue;
+		p += 8;
+		while (*p == ' ')
+			p++;
+		if (!strchr(p, ' '))
+			continue;
+		note(f, atoi(strchr(p, ' ')), strncmp(p, "WRITE", 5) == 0,
+		     strstr(line, "->") != NULL, now);
+	}
+	/* Forget those that have gone */
+	for (i = 0; i < nholders; )
+		if (!holders[i].seen)
+			holders[i] = holders[--nholders];
+		else
+			i++;
+	clock_gettime(CLOCK_MONOTONIC, &scanned);
+}
+
+/* The current holders, rescanning if the table is stale */
+struct lock_holder *locks_get(int *n)
+{
+	if (scanned.tv_sec == 0 || metric_ms(&scanned) >= CACHE_MS)
+		scan();
+	*n = nholders;
+	return holders;
+}
+
+/* Shared locks on 'disabled' - i.e. suspend blockers */
+int locks_blockers(void)
+{
+	struct lock_holder *h;
+	int n, i, cnt = 0;
+
+	h = locks_get(&n);
+	for (i = 0; i < n; i++)
+		if (h[i].file == 0 && !h[i].write && !h[i].waiting)
+			cnt += h[i].count;
+	return cnt;
+}
+
+void locks_report(FILE *f)
+{
+	struct lock_holder *h;
+	time_t now = time(0);
+	int n, i;
+
+	h = locks_get(&n);
+	for (i = 0; i < n; i++)
+		fprintf(f, "%s %s%s pid %d comm %s locks %d since %ld "
+			"seen_for %lds\n",
+			lock_files[h[i].file],
+			h[i].waiting ? "waiting-" : "",
+			h[i].write ? "exclusive" : "shared",
+			(int)h[i].pid, h[i].comm, h[i].count,
+			(long)h[i].since, (long)(now - h[i].since));
+}
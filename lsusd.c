@@ -2,6 +2,19 @@
  * lsusd - Linus SUSpend daemon.
  * This daemon enters suspend when required and allows clients
  * to block suspend, request suspend, or be notified of suspend.
+ * After each resume it records which wakeup sources woke us
+ * (see wakeup.c).
+ * If /run/suspend/autosuspend exists, lsusd also suspends whenever
+ * nothing blocks it, but only when policy.c predicts the system
+ * will stay asleep long enough to be worth it.  The file may hold
+ * settings for the policy, e.g. "min_ms=2000 ratio=4".
+ * With SUSMAN_SLEEP=autosleep, and while no watcher needs to be told
+ * about suspend, autosuspend is handed to the kernel's autosleep
+ * instead (see autosleep.c) and the policy isn't consulted.
+ * Hooks in /etc/suspend/hooks.d are run around each attempt (see
+ * hooks.c); the first of them run while we wait for the watchers.
+ * How each requested attempt went is written into the request file
+ * before it is removed, for request_suspend to report.
  *
  * Copyright (C) 2011 Neil Brown <neilb@suse.de>
  *
@@ -28,6 +41,92 @@
 #include <string.h>
 #include <signal.h>
 #include <dirent.h>
+#include <poll.h>
+#include "susman.h"
+
+static struct metric *m_attempts, *m_suspends, *m_entry, *m_blocked;
+static struct metric *m_abort_busy, *m_abort_cancel, *m_abort_read;
+static struct metric *m_abort_count, *m_abort_kernel;
+static struct metric *m_awake, *m_asleep;
+static struct metric *m_pdecide, *m_pdefer, *m_pshort, *m_perr;
+static struct metric *m_ppredict, *m_pbreakeven, *m_pcost;
+
+static struct policy policy;
+static struct timespec idle_since;	/* tv_sec == 0 if not idle */
+
+static void metrics_init(void)
+{
+	metrics_open("lsusd");
+	m_attempts = metric_new("lsusd_attempts_total",
+				"Suspend attempts started", METRIC_COUNTER);
+	m_suspends = metric_new("lsusd_suspends_total",
+				"Suspends which completed", METRIC_COUNTER);
+	m_abort_busy = metric_new("lsusd_aborts_total{reason=\"blocked\"}",
+				  "Suspend attempts abandoned, by reason",
+				  METRIC_COUNTER);
+	m_abort_cancel = metric_new("lsusd_aborts_total{reason=\"cancelled\"}",
+				    "", METRIC_COUNTER);
+	m_abort_read = metric_new("lsusd_aborts_total{reason=\"abort\"}",
+				  "", METRIC_COUNTER);
+	m_abort_count = metric_new("lsusd_aborts_total{reason=\"wakeup_count\"}",
+				   "", METRIC_COUNTER);
+	m_abort_kernel = metric_new("lsusd_aborts_total{reason=\"kernel\"}",
+				    "", METRIC_COUNTER);
+	m_entry = metric_new("lsusd_entry_seconds",
+			     "From request to entering suspend",
+			     METRIC_HISTOGRAM);
+	m_blocked = metric_new("lsusd_blocked_seconds",
+			       "Time a request waited for blockers",
+			       METRIC_HISTOGRAM);
+	m_awake = metric_new("lsusd_awake_ms_total",
+			     "Milliseconds awake, as of the last attempt",
+			     METRIC_COUNTER);
+	m_pdecide = metric_new("lsusd_policy_decisions_total",
+			       "Times autosuspend considered suspending",
+			       METRIC_COUNTER);
+	m_pdefer = metric_new("lsusd_policy_deferrals_total",
+			      "Times autosuspend decided it wasn't worth it",
+			      METRIC_COUNTER);
+	m_pshort = metric_new("lsusd_policy_short_sleeps_total",
+			      "Suspends shorter than the break-even time",
+			      METRIC_COUNTER);
+	m_perr = metric_new("lsusd_policy_error_seconds",
+			    "Difference between predicted and actual sleep",
+			    METRIC_HISTOGRAM);
+	m_ppredict = metric_new("lsusd_policy_predicted_ms",
+				"Predicted sleep at the last decision",
+				METRIC_GAUGE);
+	m_pbreakeven = metric_new("lsusd_policy_breakeven_ms",
+				  "Break-even sleep at the last decision",
+				  METRIC_GAUGE);
+	m_pcost = metric_new("lsusd_policy_cost_ms",
+			     "Average time to suspend and resume",
+			     METRIC_GAUGE);
+	m_asleep = metric_new("lsusd_suspended_ms_total",
+			      "Milliseconds suspended, as of the last attempt",
+			      METRIC_COUNTER);
+}
+
+/* MONOTONIC stops while suspended, BOOTTIME doesn't */
+static void account_time(void)
+{
+	static struct timespec boot, mono;
+	struct timespec b, m;
+	long long db, dm;
+
+	clock_gettime(CLOCK_BOOTTIME, &b);
+	clock_gettime(CLOCK_MONOTONIC, &m);
+	if (boot.tv_sec) {
+		db = (b.tv_sec - boot.tv_sec) * 1000LL
+			+ (b.tv_nsec - boot.tv_nsec) / 1000000;
+		dm = (m.tv_sec - mono.tv_sec) * 1000LL
+			+ (m.tv_nsec - mono.tv_nsec) / 1000000;
+		metric_add(m_awake, dm);
+		metric_add(m_asleep, db - dm);
+	}
+	boot = b;
+	mono = m;
+}
 
 static void alert_watchers(void)
 {
@@ -71,7 +170,7 @@ static int read_wakeup_count()
 	int n;
 	char buf[20];
 
-	fd = open("/sys/power/wakeup_count", O_RDONLY);
+	fd = open(sys_path("/sys/power/wakeup_count"), O_RDONLY);
 	if (fd < 0)
 		return -1;
 	n = read(fd, buf, sizeof(buf)-1);
@@ -91,7 +190,7 @@ static int set_wakeup_count(int count)
 	if (count < 0)
 		return 1; /* Something wrong - just suspend */
 
-	fd = open("/sys/power/wakeup_count", O_RDWR);
+	fd = open(sys_path("/sys/power/wakeup_count"), O_RDWR);
 	if (fd < 0)
 		return 1;
 
@@ -108,11 +207,23 @@ static void catch(int sig)
 	return;
 }
 
-static void wait_request(int dirfd)
+/* Wait for a request.  With 'wait' (msec), the autosuspend policy
+ * has deferred it: only an explicit request counts, and we give up
+ * after that long.
+ */
+static void wait_request(int dirfd, long wait)
 {
 	int found_immediate = 0;
 	int found_request = 0;
+	struct timespec end, now, ts;
 
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec += wait / 1000;
+	end.tv_nsec += (wait % 1000) * 1000000;
+	if (end.tv_nsec >= 1000000000) {
+		end.tv_sec++;
+		end.tv_nsec -= 1000000000;
+	}
 	do {
 		DIR *dir;
 		struct dirent *de;
@@ -132,16 +243,36 @@ static void wait_request(int dirfd)
 				found_immediate = 1;
 			if (strcmp(de->d_name, "request") == 0)
 				found_request = 1;
+			if (strcmp(de->d_name, "autosuspend") == 0 && !wait)
+				found_request = 1;
 		}
 
-		if (!found_request && !found_immediate)
-			sigsuspend(&oldset);
+		if (!found_request && !found_immediate) {
+			if (!wait)
+				sigsuspend(&oldset);
+			else {
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				ts.tv_sec = end.tv_sec - now.tv_sec;
+				ts.tv_nsec = end.tv_nsec - now.tv_nsec;
+				if (ts.tv_nsec < 0) {
+					ts.tv_sec--;
+					ts.tv_nsec += 1000000000;
+				}
+				if (ts.tv_sec < 0 ||
+				    sigtimedwait(&set, NULL, &ts) < 0)
+					/* time's up */
+					found_request = 1;
+			}
+		}
 		closedir(dir);
 		signal(SIGIO, SIG_DFL);
 		sigprocmask(SIG_UNBLOCK, &set, &oldset);
 	} while (!found_immediate && !found_request);
 }
 
+/* Returns 1 if someone asked for suspend, 2 if only the
+ * autosuspend policy wants it, or 0.
+ */
 static int request_valid()
 {
 	/* check if the request to suspend is still valid.
@@ -161,31 +292,127 @@ static int request_valid()
 		}
 	}
 	fd = open("/run/suspend/request", O_RDONLY);
+	if (fd >= 0) {
+		close(fd);
+		return 1;
+	}
+	if (access("/run/suspend/autosuspend", F_OK) == 0)
+		return 2;
+	return 0;
+}
+
+/* Nothing is blocking suspend; ask the policy if it is worth it.
+ * Returns 0 to go ahead, or how many msec to wait.
+ */
+static long policy_check(void)
+{
+	char conf[256];
+	time_t next;
+	double alarm_ms = -1;
+	long wait;
+	int fd, n;
+
+	fd = open("/run/suspend/autosuspend", O_RDONLY);
+	if (fd >= 0) {
+		n = read(fd, conf, sizeof(conf)-1);
+		close(fd);
+		conf[n > 0 ? n : 0] = 0;
+		policy_parse(&policy, conf);
+	}
+	next = alarmtab_next("/run/suspend/wakealarm.table");
+	if (next) {
+		alarm_ms = (next - time(0)) * 1000.0;
+		if (alarm_ms < 0)
+			alarm_ms = 0;
+	}
+	if (idle_since.tv_sec == 0)
+		clock_gettime(CLOCK_MONOTONIC, &idle_since);
+	else
+		policy_idle(&policy, metric_ms(&idle_since), 0);
+
+	wait = policy_decide(&policy, alarm_ms);
+	metric_add(m_pdecide, 1);
+	metric_set(m_ppredict, policy.predicted);
+	metric_set(m_pbreakeven, policy.breakeven);
+	trace(TR_POLICY, policy.predicted, policy.breakeven);
+	if (wait)
+		metric_add(m_pdefer, 1);
+	return wait;
+}
+
+static int autosleep_wanted(void)
+{
+	return request_valid() == 2;
+}
+
+static const char *abort_names[] = {
+	[AB_BLOCKED]	= "blocked",
+	[AB_CANCELLED]	= "cancelled",
+	[AB_READ]	= "read",
+	[AB_COUNT]	= "wakeup_count",
+	[AB_KERNEL]	= "kernel",
+};
+
+/* One line of key=value: request_suspend reads it from its own fd
+ * once the file is unlinked.  'in' and 'out' are CLOCK_REALTIME.
+ */
+static void report_result(int why, double ms, struct timespec *in,
+			  struct timespec *out, double slept_ms)
+{
+	char buf[200];
+	int fd, n;
+
+	fd = open("/run/suspend/request", O_WRONLY|O_TRUNC|O_CLOEXEC);
 	if (fd < 0)
-		return 0;
+		return;
+	if (why)
+		n = snprintf(buf, sizeof(buf), "aborted reason=%s after_ms=%.1f\n",
+			     abort_names[why], ms);
+	else
+		n = snprintf(buf, sizeof(buf), "suspended entry_ms=%.1f "
+			     "entered=%ld.%03ld resumed=%ld.%03ld slept_ms=%.0f\n",
+			     ms, (long)in->tv_sec, in->tv_nsec / 1000000,
+			     (long)out->tv_sec, out->tv_nsec / 1000000,
+			     slept_ms > 0 ? slept_ms : 0);
+	if (write(fd, buf, n) != n)
+		unlink("/run/suspend/request");
 	close(fd);
-	return 1;
 }
 
-static void do_suspend(void)
+static void policy_blocked(void)
 {
-	int fd = open("/sys/power/state", O_RDWR);
+	/* A blocker ended an idle period */
+	if (idle_since.tv_sec) {
+		policy_idle(&policy, metric_ms(&idle_since), 1);
+		idle_since.tv_sec = 0;
+	}
+}
+
+static int do_suspend(void)
+{
+	int fd = open(sys_path("/sys/power/state"), O_RDWR);
+	int n = 4;
+
 	if (fd >= 0) {
-		write(fd, "mem\n", 4);
+		n = write(fd, "mem\n", 4);
 		close(fd);
 	} else
 		sleep(5);
+	return n == 4;
 }
 
 main(int argc, char *argv)
 {
 	int dir;
 	int disable;
+	int kernel;
+	long wait = 0;
 
 	mkdir("/run/suspend", 0770);
 
-	dir = open("/run/suspend", O_RDONLY);
-	disable = open("/run/suspend/disabled", O_RDWR|O_CREAT, 0640);
+	/* Hooks mustn't inherit these */
+	dir = open("/run/suspend", O_RDONLY|O_CLOEXEC);
+	disable = open("/run/suspend/disabled", O_RDWR|O_CREAT|O_CLOEXEC, 0640);
 
 	if (dir < 0 || disable < 0)
 		exit(1);
@@ -193,20 +420,52 @@ main(int argc, char *argv)
 	/* Create the initial files */
 	alert_watchers();
 	cycle_watchers();
+	metrics_init();
+	account_time();
+	trace_open("lsusd");
+	policy_init(&policy);
+	kernel = autosleep_enabled();
+	autosleep_reset();
 
 	close(0);
 
 	while (1) {
-		int count;
-		struct timespec ts;
+		int count, why, valid;
+		struct timespec ts, start;
 		struct stat stb;
 
-		/* Don't accept an old request */
-		unlink("/run/suspend/request");
-		wait_request(dir);
+		if (wait) {
+			/* Deferred by the policy, but an explicit
+			 * request cuts that short.
+			 */
+			wait_request(dir, wait);
+			wait = 0;
+			valid = request_valid();
+			if (!valid)
+				/* autosuspend was turned off */
+				continue;
+		} else {
+			/* Don't accept an old request */
+			unlink("/run/suspend/request");
+			wait_request(dir, 0);
+			valid = 1;
+		}
+		account_time();
+		/* Going back to a deferred autosuspend isn't another */
+		if (valid == 1) {
+			metric_add(m_attempts, 1);
+			trace(TR_REQUEST, 0, 0);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
 		if (flock(disable, LOCK_EX|LOCK_NB) != 0) {
+			metric_add(m_abort_busy, 1);
+			trace(TR_ABORT, AB_BLOCKED, 0);
+			policy_blocked();
 			flock(disable, LOCK_EX);
 			flock(disable, LOCK_UN);
+			metric_observe(m_blocked, metric_ms(&start));
+			trace(TR_BLOCKED, metric_ms(&start) * 1000, 0);
+			report_result(AB_BLOCKED, metric_ms(&start), NULL, NULL, 0);
 			unlink("/run/suspend/request");
 			/* blocked - so need to ensure request still valid */
 			continue;
@@ -214,20 +473,89 @@ main(int argc, char *argv)
 		flock(disable, LOCK_UN);;
 		/* we got that without blocking but are not holding it */
 
+		if (request_valid() == 2) {
+			if (kernel && !hooks_present() &&
+			    autosleep_run(disable, autosleep_wanted)) {
+				account_time();
+				continue;
+			}
+			wait = policy_check();
+			if (wait)
+				continue;
+		}
+
 		/* Next two might block, but that doesn't abort suspend */
 		count = read_wakeup_count();
+		trace(TR_COUNT, count, 0);
 		fstat(disable, &stb);
 		ts = stb.st_atim;
+		hooks_start(HOOK_SUSPEND);
 		alert_watchers();
+		trace(TR_ALERT, 0, 0);
+		hooks_finish();
 
 		fstat(disable, &stb);
-		if (flock(disable, LOCK_EX|LOCK_NB) == 0
-		    && request_valid()
-		    && ts.tv_sec == stb.st_atim.tv_sec
-		    && ts.tv_nsec == stb.st_atim.tv_nsec
-		    && set_wakeup_count(count))
-			do_suspend();
+		why = 0;
+		if (flock(disable, LOCK_EX|LOCK_NB) != 0) {
+			metric_add(m_abort_busy, 1);
+			why = AB_BLOCKED;
+		} else if (!request_valid()) {
+			metric_add(m_abort_cancel, 1);
+			why = AB_CANCELLED;
+		} else if (ts.tv_sec != stb.st_atim.tv_sec ||
+			   ts.tv_nsec != stb.st_atim.tv_nsec) {
+			metric_add(m_abort_read, 1);
+			why = AB_READ;
+		} else if (!set_wakeup_count(count)) {
+			metric_add(m_abort_count, 1);
+			why = AB_COUNT;
+		} else {
+			struct timespec b0, m0, b1, m1, r0, r1;
+			double entry = metric_ms(&start);
+			int ok;
+			metric_observe(m_entry, entry);
+			wakeup_before();
+			trace(TR_SUSPEND, count, 0);
+			clock_gettime(CLOCK_REALTIME, &r0);
+			clock_gettime(CLOCK_BOOTTIME, &b0);
+			clock_gettime(CLOCK_MONOTONIC, &m0);
+			ok = do_suspend();
+			clock_gettime(CLOCK_BOOTTIME, &b1);
+			clock_gettime(CLOCK_MONOTONIC, &m1);
+			clock_gettime(CLOCK_REALTIME, &r1);
+			idle_since.tv_sec = 0;
+			if (ok) {
+				/* MONOTONIC only counts the transitions */
+				double total = (b1.tv_sec - b0.tv_sec) * 1000.0
+					+ (b1.tv_nsec - b0.tv_nsec) / 1e6;
+				double cost = (m1.tv_sec - m0.tv_sec) * 1000.0
+					+ (m1.tv_nsec - m0.tv_nsec) / 1e6;
+				unsigned long shorts = policy.short_sleeps;
+
+				trace(TR_RESUME, 1, total - cost);
+				report_result(0, entry, &r0, &r1, total - cost);
+				metric_add(m_suspends, 1);
+				wakeup_after();
+				policy_slept(&policy, total - cost, cost);
+				metric_set(m_pcost, policy.cost_ms);
+				if (policy.decisions) {
+					metric_observe(m_perr, policy.last_err_ms);
+					metric_add(m_pshort,
+						   policy.short_sleeps - shorts);
+				}
+			} else {
+				trace(TR_RESUME, 0, 0);
+				metric_add(m_abort_kernel, 1);
+				why = AB_KERNEL;
+			}
+			account_time();
+		}
+		if (why) {
+			trace(TR_ABORT, why, why == AB_COUNT ? count : 0);
+			report_result(why, metric_ms(&start), NULL, NULL, 0);
+		}
 		flock(disable, LOCK_UN);
 		cycle_watchers();
+		hooks_run(HOOK_RESUME);
 	}
 }
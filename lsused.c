@@ -14,7 +14,36 @@
  * Suspend Soon and wait for 'R' to say 'Ready'.
  * We don't bother checking the fds again until the next suspend
  * attempt.
+ * After resume each client which got 'S' gets 'A'.  A client may
+ * send 'P' (prompt), 'N' (normal, the default) or 'B' (bulk) at any
+ * time to choose its class: classes are sent 'A' in that order, and
+ * with SUSMAN_STAGGER=ms each class waits that long after the one
+ * before, so that input or network clients aren't stuck behind
+ * everyone else.  How long after lsusd announced the resume each
+ * class was told is kept in lsused_resume_notify_seconds.
  *
+ * The same service is offered with the binary protocol of
+ * susproto.c on /run/suspend/registration.pkt, where SUSP_WATCH,
+ * SUSP_READY and SUSP_CLASS stand for 'W', 'R' and the class, and
+ * SUSP_SUSPEND and SUSP_AWAKE for 'S' and 'A'.  Any number of them,
+ * and the fds for all the SUSP_WATCHes, can go in one datagram.
+ *
+ * On SIGHUP we pass the listening socket, all clients and their
+ * fds to a freshly exec'ed copy of ourselves (see handoff.c) so
+ * that we can be upgraded without clients noticing.
+ *
+ * With SUSMAN_SHARDS=n (n > 1) clients are dealt out to n threads,
+ * each with its own event_base, fanout, handles and fds to poll, so
+ * registrations and replies are spread over cores instead of
+ * queueing behind one another.  The main thread keeps the listening
+ * sockets and the watch on lsusd.  When lsusd asks, every shard
+ * polls its own fds and sends its own 'S's; they share a single
+ * atomic count of replies outstanding (plus one for each shard still
+ * checking, and one for the main thread), and whoever takes it to
+ * zero pokes the main thread to call suspend_ok().  Shards only talk
+ * to each other through that count and command pipes.  There are
+ * never more shards than online CPUs: beyond that they only add
+ * thread switches to every check.
  *
  * Copyright (C) 2011 Neil Brown <neilb@suse.de>
  *
@@ -33,6 +62,7 @@
  *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 #define _GNU_SOURCE
+#include <unistd.h>
 #include <stdlib.h>
 #include <event.h>
 #include <poll.h>
@@ -40,32 +70,112 @@
 #include <sys/un.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <pthread.h>
 #include "libsus.h"
+#include "susman.h"
+
 
+static struct metric *m_clients, *m_fds, *m_checks, *m_sent, *m_reply;
+static struct metric *m_notify[WAKE_CLASSES];
+
+static const char class_msg[] = "PNB";	/* by class */
+static const char *class_names[WAKE_CLASSES] = { "prompt", "normal", "bulk" };
+
+/* What we send each protocol for 'S' and for 'A' after resume */
+enum { MSG_SUSPEND, MSG_AWAKE };
+static const char stream_msg[] = "SA";
+static char pkt_msg[2][SUSP_ONE];
 
 struct handle {
 	struct event	ev;
 	int		sent;		/* 'S' has been sent */
 	int		suspending;	/* ... 'R' hasn't been received yet */
+	int		class;		/* WAKE_PROMPT etc */
+	int		pkt;		/* on the SOCK_SEQPACKET socket */
 	struct handle	*next;
 	struct state	*state;
+	int		index;		/* used when handing off */
 };
 
 struct state {
 	int		waiting;	/* Number of replies waiting for */
+	struct state	*top;		/* the one watching lsusd */
 	struct handle	*handles;	/* linked list of handles */
 	struct pollfd	*fds;		/* for 'poll' */
 	struct handle	**hans;		/* aligned with fds */
 	int		nfds;		/* number of active 'fds' */
 	int		fdsize;		/* allocated size of fds array */
 	void		*sus;		/* handle from suspend_watch */
+	struct fanout	*fan;		/* for 'S' and 'A' */
+	int		listen;		/* listening socket */
+	int		listen_pkt;	/* and the SOCK_SEQPACKET one */
+	struct timespec	sent_at;	/* when 'S' was sent */
+	struct timespec	resumed_at;	/* when lsusd announced resume */
+	int		next_class;	/* next to be sent 'A' */
+	int		stagger_ms;
+	struct event	stagger;
+
+	/* The rest is only for SUSMAN_SHARDS.  In top: */
+	struct state	*shards;
+	int		nshards;
+	int		next_shard;	/* for the next client */
+	int		registered;	/* fds in all shards */
+	int		owed[WAKE_CLASSES];	/* 'A's, by class */
+	int		ready_pending;	/* top has been poked for these */
+	int		watch_pending;
+	/* In a shard: */
+	struct event_base *base;
+	pthread_t	thread;
+	int		cmd[2];		/* to this shard, or to top */
+	struct event	cmd_ev;
 };
 
+/* What the main thread asks of a shard */
+enum { CMD_NEW, CMD_CHECK, CMD_AWAKE, CMD_QUIT };
+struct cmd {
+	int		op;
+	int		fd;		/* CMD_NEW */
+	int		arg;		/* pkt for CMD_NEW, class for CMD_AWAKE */
+};
+
+static void metrics_init(void)
+{
+	int i;
+
+	metrics_open("lsused");
+	m_clients = metric_new("lsused_clients", "Connected clients",
+			       METRIC_GAUGE);
+	m_fds = metric_new("lsused_fds", "Registered wakeup fds",
+			   METRIC_GAUGE);
+	m_checks = metric_new("lsused_checks_total",
+			      "Suspend attempts checked", METRIC_COUNTER);
+	m_sent = metric_new("lsused_suspend_sent_total",
+			    "'S' messages sent", METRIC_COUNTER);
+	m_reply = metric_new("lsused_reply_seconds",
+			     "From 'S' to the client's 'R'", METRIC_HISTOGRAM);
+	for (i = 0; i < WAKE_CLASSES; i++) {
+		char name[64];
+		snprintf(name, sizeof(name),
+			 "lsused_resume_notify_seconds{class=\"%s\"}",
+			 class_names[i]);
+		m_notify[i] = metric_new(name, i ? "" :
+					 "From resume until a class was sent 'A'",
+					 METRIC_HISTOGRAM);
+	}
+	/* these are only ever set from our own state */
+	metric_set(m_clients, 0);
+	metric_set(m_fds, 0);
+}
+
 static void del_fd(struct state *state, int i)
 {
 	state->fds[i] = state->fds[state->nfds - 1];
 	state->hans[i] = state->hans[state->nfds - 1];
 	state->nfds--;
+	__atomic_sub_fetch(&state->top->registered, 1, __ATOMIC_RELAXED);
+	metric_add(m_fds, -1);
 }
 
 static void add_fd(struct state *state, struct handle *han,
@@ -86,6 +196,8 @@ static void add_fd(struct state *state, struct handle *han,
 	state->fds[n].fd = fd;
 	state->fds[n].events = events;
 	state->nfds++;
+	__atomic_add_fetch(&state->top->registered, 1, __ATOMIC_RELAXED);
+	metric_add(m_fds, 1);
 }
 
 static void add_han(struct handle *han, struct state *state)
@@ -93,6 +205,7 @@ static void add_han(struct handle *han, struct state *state)
 
 	han->next = state->handles;
 	state->handles = han;
+	metric_add(m_clients, 1);
 }
 
 static void del_han(struct handle *han)
@@ -113,11 +226,90 @@ static void del_han(struct handle *han)
 	for (h = *hanp; h; hanp = &h->next, h = *hanp) {
 		if (h == han) {
 			*hanp = h->next;
+			metric_add(m_clients, -1);
 			break;
 		}
 	}
 }
 
+static void update_watch(struct state *top);
+
+static int release(struct state *top, int n)
+{
+	return __atomic_add_fetch(&top->waiting, n, __ATOMIC_ACQ_REL);
+}
+
+static void all_ready(struct state *top)
+{
+	trace(TR_READY, 0, 0);
+	suspend_ok(top->sus);
+	update_watch(top);
+}
+
+/* Ask the main thread to look at 'flag' */
+static void poke_top(struct state *top, int *flag)
+{
+	if (!__atomic_exchange_n(flag, 1, __ATOMIC_ACQ_REL))
+		write(top->cmd[1], "x", 1);
+}
+
+/* Nothing more to wait for */
+static void ready(struct state *top)
+{
+	if (top->shards)
+		poke_top(top, &top->ready_pending);
+	else
+		all_ready(top);
+}
+
+/* The fds registered may have come or gone */
+static void watch_changed(struct state *state)
+{
+	struct state *top = state->top;
+
+	if (top->shards)
+		poke_top(top, &top->watch_pending);
+	else
+		update_watch(top);
+}
+
+static void queue(struct state *state, struct handle *han, int m)
+{
+	if (han->pkt)
+		fanout_add(state->fan, EVENT_FD(&han->ev), pkt_msg[m], SUSP_ONE);
+	else
+		fanout_add(state->fan, EVENT_FD(&han->ev), &stream_msg[m], 1);
+}
+
+static void got_ready(struct handle *han)
+{
+	struct state *top = han->state->top;
+
+	if (han->suspending) {
+		double ms = metric_ms(&top->sent_at);
+		metric_observe(m_reply, ms);
+		trace(TR_REPLY, EVENT_FD(&han->ev), ms * 1000);
+		han->suspending = 0;
+		if (release(top, -1) == 0)
+			ready(top);
+	}
+}
+
+static void drop_han(struct handle *han)
+{
+	struct state *state = han->state;
+	int fd = EVENT_FD(&han->ev);
+
+	event_del(&han->ev);
+	if (han->suspending && release(state->top, -1) == 0)
+		/* it won't be replying */
+		ready(state->top);
+	del_han(han);
+	close(fd);
+	free(han);
+	watch_changed(state);
+}
+
 static void do_read(int fd, short ev, void *data)
 {
 	struct handle *han = data;
@@ -158,109 +350,603 @@ static void do_read(int fd, short ev, void *data)
 					add_fd(han->state, han, fdptr[i],
 						POLLIN|POLLPRI);
 			}
+		watch_changed(han->state);
 		write(fd, "A", 1);
 		break;
 
+	case 'P':
+	case 'N':
+	case 'B':
+		han->class = strchr(class_msg, buf) - class_msg;
+		break;
+
 	case 'R':
-		if (han->suspending) {
-			han->suspending = 0;
-			han->state->waiting--;
-			if (han->state->waiting == 0)
-				suspend_ok(han->state->sus);
-		}
+		got_ready(han);
 		break;
 
 	default:
-		event_del(&han->ev);
-		del_han(han);
-		close(fd);
+		drop_han(han);
 	}
 }
 
-static void do_accept(int fd, short ev, void *data)
+/* One datagram of requests gets one datagram of replies */
+static void do_read_pkt(int fd, short ev, void *data)
 {
-	struct state *state = data;
-	struct handle *han;
-	int newfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
-	if (newfd < 0)
+	struct handle *han = data;
+	struct state *state = han->state;
+	struct susp_frame in, out;
+	int fds[SUSP_MAXFDS];
+	int nfds, used = 0;
+	int n, i, j;
+
+	n = susp_recv(fd, &in, fds, &nfds);
+	if (n < 0 && errno == EAGAIN)
 		return;
+	if (n <= 0) {
+		drop_han(han);
+		return;
+	}
+	susp_init(&out);
+	for (i = 0; i < n; i++) {
+		struct susp_msg *m = &in.msg[i];
+		switch (m->op) {
+		case SUSP_HELLO:
+			susp_add(&out, SUSP_HELLO, m->id,
+				 m->arg & (SUSP_CAP_WATCH | SUSP_CAP_CLASS));
+			break;
+		case SUSP_WATCH:
+			for (j = 0; j < m->arg && used < nfds; j++)
+				add_fd(state, han, fds[used++], POLLIN|POLLPRI);
+			watch_changed(state);
+			susp_add(&out, SUSP_WATCHED, m->id, j);
+			break;
+		case SUSP_READY:
+			got_ready(han);
+			break;
+		case SUSP_CLASS:
+			if (m->arg >= 0 && m->arg < WAKE_CLASSES) {
+				han->class = m->arg;
+				break;
+			}
+			/* fall through */
+		default:
+			susp_add(&out, SUSP_ERROR, m->id, m->op);
+		}
+	}
+	/* fds nobody asked us to watch */
+	while (used < nfds)
+		close(fds[used++]);
+	if (out.hdr.count)
+		susp_send(fd, &out, NULL, 0);
+}
+
+static struct handle *new_han(struct state *state, int fd, int pkt)
+{
+	struct handle *han = malloc(sizeof(*han));
 
-	han = malloc(sizeof(*han));
 	if (!han) {
-		close(newfd);
-		return;
+		close(fd);
+		return NULL;
 	}
 	han->sent = 0;
 	han->suspending = 0;
+	han->class = WAKE_NORMAL;
+	han->pkt = pkt;
 	han->state = state;
-	add_han(han, state);
-	event_set(&han->ev, newfd, EV_READ | EV_PERSIST, do_read, han);
+	event_set(&han->ev, fd, EV_READ | EV_PERSIST,
+		  pkt ? do_read_pkt : do_read, han);
+	if (state->base)
+		event_base_set(state->base, &han->ev);
 	event_add(&han->ev, NULL);
-	write(newfd, "A", 1);
+	return han;
 }
 
-static int do_suspend(void *data)
+static void do_accept(int fd, short ev, void *data)
 {
 	struct state *state = data;
+	struct handle *han;
+	int pkt = fd == state->listen_pkt;
+	int newfd;
+
+	/* Take everyone who is waiting, not just one per wakeup */
+	while ((newfd = accept4(fd, NULL, NULL,
+				SOCK_NONBLOCK|SOCK_CLOEXEC)) >= 0) {
+		if (state->shards) {
+			struct cmd c = { CMD_NEW, newfd, pkt };
+			struct state *s = &state->shards[state->next_shard++
+							 % state->nshards];
+			write(s->cmd[1], &c, sizeof(c));
+			continue;
+		}
+		han = new_han(state, newfd, pkt);
+		if (!han)
+			continue;
+		add_han(han, state);
+		/* binary clients start with SUSP_HELLO instead */
+		if (!pkt)
+			fanout_add(state->fan, newfd, "A", 1);
+	}
+	fanout_flush(state->fan);
+}
+
+/* Send 'A' to everyone in 'class' still owed one.  Returns how many */
+static int send_class(struct state *state, int class)
+{
 	struct handle *han;
 	int n;
+
+	for (han = state->handles ; han ; han = han->next)
+		if (han->sent && han->class == class) {
+			han->sent = 0;
+			queue(state, han, MSG_AWAKE);
+		}
+	n = state->fan->n;
+	if (!n)
+		return 0;
+	trace(TR_AWAKE, n, class);
+	fanout_flush(state->fan);
+	return n;
+}
+
+/* Have each shard send its 'A's for 'class'.  Returns how many were
+ * owed, as the shards haven't sent them yet.
+ */
+static int notify_class(struct state *top, int class)
+{
+	struct cmd c = { CMD_AWAKE, -1, class };
+	int i, n;
+
+	if (!top->shards)
+		n = send_class(top, class);
+	else {
+		for (i = 0; i < top->nshards; i++)
+			write(top->shards[i].cmd[1], &c, sizeof(c));
+		n = __atomic_exchange_n(&top->owed[class], 0,
+					__ATOMIC_ACQ_REL);
+	}
+	/* Once per class, however many shards it is spread over */
+	if (n)
+		metric_observe(m_notify[class], metric_ms(&top->resumed_at));
+	return n;
+}
+
+/* Send the remaining classes in order, waiting stagger_ms after
+ * each one which had anyone in it.
+ */
+static void notify_classes(int fd, short ev, void *data)
+{
+	struct state *state = data;
+	struct timeval tv;
+
+	while (state->next_class < WAKE_CLASSES) {
+		if (notify_class(state, state->next_class++) &&
+		    state->stagger_ms && state->next_class < WAKE_CLASSES) {
+			tv.tv_sec = state->stagger_ms / 1000;
+			tv.tv_usec = (state->stagger_ms % 1000) * 1000;
+			evtimer_add(&state->stagger, &tv);
+			return;
+		}
+	}
+}
+
+/* Nobody may still be waiting for 'A' from last time when we
+ * check again, or hand off.
+ */
+static void notify_all(struct state *state)
+{
+	int ms = state->stagger_ms;
+
+	evtimer_del(&state->stagger);
+	state->stagger_ms = 0;
+	notify_classes(0, 0, state);
+	state->stagger_ms = ms;
+}
+
+/* One shard's part of a check: 'S' to each client with a readable
+ * fd, then give up the shard's hold on top->waiting, and on anyone
+ * who never answered an earlier check.
+ */
+static void check(struct state *state)
+{
+	struct state *top = state->top;
+	struct handle *han;
+	int n, sent = 0, stale = 0;
 	int i;
 
 	n = poll(state->fds, state->nfds, 0);
-	if (n == 0)
-		/* nothing happening */
-		return 1;
-	for (han = state->handles ; han ; han = han->next)
-		han->sent = 0;
-	state->waiting = 1;
-	for (i = 0; i < state->nfds; i++)
-		if (state->fds[i].revents) {
-			han = state->hans[i];
-			if (!han->sent) {
-				han->sent = 1;
-				han->suspending = 1;
-				write(EVENT_FD(&han->ev), "S", 1);
-				state->waiting++;
+	trace(TR_CHECK, n, state->nfds);
+	for (han = state->handles ; han ; han = han->next) {
+		if (han->suspending)
+			stale++;
+		han->suspending = 0;
+		if (n > 0)
+			han->sent = 0;
+	}
+	if (n > 0) {
+		for (i = 0; i < state->nfds; i++)
+			if (state->fds[i].revents) {
+				han = state->hans[i];
+				if (!han->sent) {
+					han->sent = 1;
+					han->suspending = 1;
+					queue(state, han, MSG_SUSPEND);
+					metric_add(m_sent, 1);
+					trace(TR_SEND, EVENT_FD(&han->ev), 0);
+					if (top->shards)
+						__atomic_add_fetch(&top->owed[han->class],
+								   1, __ATOMIC_RELAXED);
+					sent++;
+				}
 			}
-		}
-	state->waiting--;
-	return (state->waiting == 0);
+	}
+	if (release(top, sent - 1 - stale) == 0)
+		ready(top);
+	fanout_flush(state->fan);
+}
+
+static int do_suspend(void *data)
+{
+	struct state *state = data;
+	struct cmd c = { CMD_CHECK, -1, 0 };
+	int i;
+
+	notify_all(state);
+	metric_add(m_checks, 1);
+	clock_gettime(CLOCK_MONOTONIC, &state->sent_at);
+	/* One for each shard until it has checked, and one for us.
+	 * Anyone still to answer an aborted check is counted until
+	 * their shard checks, so a late 'R' can't be taken for one of
+	 * this time's.
+	 */
+	release(state, (state->shards ? state->nshards : 1) + 1);
+	if (!state->shards)
+		check(state);
+	for (i = 0; i < state->nshards; i++)
+		write(state->shards[i].cmd[1], &c, sizeof(c));
+	return release(state, -1) == 0;
 }
 
 static void did_resume(void *data)
 {
 	struct state *state = data;
+	struct timespec real, then;
+	long long lag;
+
+	/* Latency is measured from when lsusd wrote 'watching', but
+	 * that is by the wall clock.
+	 */
+	clock_gettime(CLOCK_REALTIME, &real);
+	clock_gettime(CLOCK_MONOTONIC, &state->resumed_at);
+	suspend_resumed_at(state->sus, &then);
+	lag = (real.tv_sec - then.tv_sec) * 1000000000LL
+		+ real.tv_nsec - then.tv_nsec;
+	if (then.tv_sec && lag > 0 && lag < 60000000000LL) {
+		lag = state->resumed_at.tv_sec * 1000000000LL
+			+ state->resumed_at.tv_nsec - lag;
+		state->resumed_at.tv_sec = lag / 1000000000;
+		state->resumed_at.tv_nsec = lag % 1000000000;
+	}
+	state->next_class = 0;
+	notify_classes(0, 0, state);
+}
+
+/* There is only something to tell about suspend while fds are
+ * registered.  Without a watcher lsusd can leave suspend to the
+ * kernel's autosleep.
+ */
+static void update_watch(struct state *top)
+{
+	int registered = __atomic_load_n(&top->registered, __ATOMIC_RELAXED);
+
+	if (registered && !top->sus)
+		top->sus = suspend_watch(do_suspend, did_resume, top);
+	else if (!registered && top->sus &&
+		 !__atomic_load_n(&top->waiting, __ATOMIC_ACQUIRE)) {
+		suspend_unwatch(top->sus);
+		top->sus = NULL;
+	}
+}
+
+/* Shards */
+
+static void do_cmd(int fd, short ev, void *data)
+{
+	struct state *state = data;
+	struct cmd c[64];
 	struct handle *han;
+	int n, i;
 
-	for (han = state->handles ; han ; han = han->next)
-		if (han->sent)
-			write(EVENT_FD(&han->ev), "A", 1);
+	n = read(fd, c, sizeof(c));
+	for (i = 0; i < n / (int)sizeof(c[0]); i++)
+		switch (c[i].op) {
+		case CMD_NEW:
+			han = new_han(state, c[i].fd, c[i].arg);
+			if (!han)
+				break;
+			add_han(han, state);
+			if (!c[i].arg)
+				fanout_add(state->fan, c[i].fd, "A", 1);
+			break;
+		case CMD_CHECK:
+			check(state);
+			break;
+		case CMD_AWAKE:
+			send_class(state, c[i].arg);
+			break;
+		case CMD_QUIT:
+			event_base_loopbreak(state->base);
+			break;
+		}
+	fanout_flush(state->fan);
+}
+
+/* Shards have asked for suspend_ok() or update_watch() */
+static void from_shards(int fd, short ev, void *data)
+{
+	struct state *top = data;
+	char buf[16];
+
+	read(fd, buf, sizeof(buf));
+	if (__atomic_exchange_n(&top->ready_pending, 0, __ATOMIC_ACQ_REL))
+		all_ready(top);
+	if (__atomic_exchange_n(&top->watch_pending, 0, __ATOMIC_ACQ_REL))
+		update_watch(top);
+}
+
+static void *shard_main(void *data)
+{
+	struct state *state = data;
+
+	event_base_dispatch(state->base);
+	return NULL;
+}
+
+static int init_shards(struct state *top, int n)
+{
+	struct state *s;
+	int i;
+
+	top->shards = calloc(n, sizeof(*top->shards));
+	if (!top->shards ||
+	    pipe2(top->cmd, O_CLOEXEC | O_NONBLOCK) < 0)
+		return -1;
+	top->nshards = n;
+	for (i = 0; i < n; i++) {
+		s = &top->shards[i];
+		s->top = top;
+		s->base = event_base_new();
+		s->fan = fanout_new();
+		if (!s->base || !s->fan || pipe2(s->cmd, O_CLOEXEC) < 0)
+			return -1;
+		event_set(&s->cmd_ev, s->cmd[0], EV_READ | EV_PERSIST,
+			  do_cmd, s);
+		event_base_set(s->base, &s->cmd_ev);
+		event_add(&s->cmd_ev, NULL);
+	}
+	return 0;
+}
+
+/* Signals are for the main thread's event_base */
+static void start_shards(struct state *top)
+{
+	sigset_t all, old;
+	int i;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (i = 0; i < top->nshards; i++)
+		if (pthread_create(&top->shards[i].thread, NULL, shard_main,
+				   &top->shards[i]) != 0)
+			exit(1);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Wait for them to finish what they were asked, and stop */
+static void stop_shards(struct state *top)
+{
+	struct cmd c = { CMD_QUIT, -1, 0 };
+	int i;
+
+	for (i = 0; i < top->nshards; i++)
+		write(top->shards[i].cmd[1], &c, sizeof(c));
+	for (i = 0; i < top->nshards; i++)
+		pthread_join(top->shards[i].thread, NULL);
+}
+
+/* Where the k'th shard's handles and fds are: top itself if unsharded */
+static struct state *shard(struct state *top, int k)
+{
+	return top->shards ? &top->shards[k] : top;
+}
+
+static int nshard(struct state *top)
+{
+	return top->shards ? top->nshards : 1;
+}
+
+/* Handoff state is an array of ints: number of handles, number
+ * of fds, then 'sent' and 'suspending' for each handle, then the
+ * index of the owning handle for each fd, then the class of each
+ * handle, then whether each is on the SOCK_SEQPACKET socket (these
+ * two absent if handed off by an older copy).
+ * The fds sent are the listening socket, one per handle, then the
+ * registered fds, then the SOCK_SEQPACKET listening socket if any.
+ * Shards are stopped while we do this, and their handles and fds
+ * go one shard after another.
+ */
+static void do_upgrade(int sig, short ev, void *data)
+{
+	struct state *state = data;
+	struct handle *han;
+	int nhan = 0, nreg = 0;
+	int *rec = NULL, *fds = NULL;
+	int r = 0, f = 0;
+	int i, k;
+
+	notify_all(state);
+	if (state->shards)
+		stop_shards(state);
+	for (k = 0; k < nshard(state); k++) {
+		for (han = shard(state, k)->handles ; han ; han = han->next)
+			han->index = nhan++;
+		nreg += shard(state, k)->nfds;
+	}
+	rec = malloc((2 + 4 * nhan + nreg) * sizeof(int));
+	fds = malloc((2 + nhan + nreg) * sizeof(int));
+	if (!rec || !fds)
+		goto out;
+	rec[r++] = nhan;
+	rec[r++] = nreg;
+	fds[f++] = state->listen;
+	for (k = 0; k < nshard(state); k++)
+		for (han = shard(state, k)->handles ; han ; han = han->next) {
+			rec[r++] = han->sent;
+			rec[r++] = han->suspending;
+			fds[f++] = EVENT_FD(&han->ev);
+		}
+	for (k = 0; k < nshard(state); k++) {
+		struct state *s = shard(state, k);
+		for (i = 0; i < s->nfds; i++) {
+			rec[r++] = s->hans[i]->index;
+			fds[f++] = s->fds[i].fd;
+		}
+	}
+	for (k = 0; k < nshard(state); k++)
+		for (han = shard(state, k)->handles ; han ; han = han->next)
+			rec[r++] = han->class;
+	for (k = 0; k < nshard(state); k++)
+		for (han = shard(state, k)->handles ; han ; han = han->next)
+			rec[r++] = han->pkt;
+	if (state->listen_pkt >= 0)
+		fds[f++] = state->listen_pkt;
+	if (handoff_start("lsused", NULL, fds, f, rec, r * sizeof(int)) == 0)
+		exit(0);
+out:
+	free(rec);
+	free(fds);
+	if (state->shards)
+		start_shards(state);
+}
+
+static int restore(struct state *state)
+{
+	struct handle **hans;
+	int *rec, *fds, *pkt;
+	int nhan, nreg;
+	int nfds, len;
+	int i;
+
+	nfds = handoff_receive(&fds, (void**)&rec, &len);
+	if (nfds < 0)
+		return -1;
+	nhan = rec[0];
+	nreg = rec[1];
+	pkt = NULL;
+	if (len >= (2 + 4*nhan + nreg) * sizeof(int))
+		pkt = rec + 2 + 3*nhan + nreg;
+	if (nfds > 1 + nhan + nreg)
+		state->listen_pkt = fds[1 + nhan + nreg];
+	hans = calloc(nhan + 1, sizeof(*hans));
+	for (i = 0; i < nhan; i++) {
+		hans[i] = new_han(shard(state, i % nshard(state)), fds[1 + i],
+				  pkt ? pkt[i] : 0);
+		if (!hans[i])
+			exit(1);
+		hans[i]->sent = rec[2 + 2*i];
+		hans[i]->suspending = rec[3 + 2*i];
+	}
+	/* add_han pushes on the front, so go backwards to keep order */
+	for (i = nhan; i > 0; i--)
+		add_han(hans[i-1], hans[i-1]->state);
+	for (i = 0; i < nreg; i++) {
+		struct handle *han = hans[rec[2 + 2*nhan + i]];
+		add_fd(han->state, han, fds[1 + nhan + i], POLLIN|POLLPRI);
+	}
+	if (len >= (2 + 3*nhan + nreg) * sizeof(int))
+		for (i = 0; i < nhan; i++) {
+			int class = rec[2 + 2*nhan + nreg + i];
+			if (class >= 0 && class < WAKE_CLASSES)
+				hans[i]->class = class;
+		}
+	/* Replies the old copy was still waiting for */
+	for (i = 0; i < nhan; i++)
+		if (hans[i]->suspending)
+			state->waiting++;
+	/* Shards count the 'A's owed as they send 'S' */
+	if (state->shards)
+		for (i = 0; i < nhan; i++)
+			if (hans[i]->sent)
+				state->owed[hans[i]->class]++;
+	i = fds[0];
+	free(hans);
+	free(rec);
+	free(fds);
+	return i;
 }
 
 main(int argc, char *argv[])
 {
-	struct sockaddr_un addr;
 	struct state state;
-	struct event ev;
+	struct event ev, pev, hupev, sev;
+	int restored, nshards = 1;
 	int s;
 
 	memset(&state, 0, sizeof(state));
-
-	s = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
-	addr.sun_family = AF_UNIX;
-	strcpy(addr.sun_path, "/run/suspend/registration");
-	unlink("/run/suspend/registration");
-	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	state.top = &state;
+	state.listen_pkt = -1;
+	state.next_class = WAKE_CLASSES;
+	susp_one(pkt_msg[MSG_SUSPEND], SUSP_SUSPEND, 0, 0);
+	susp_one(pkt_msg[MSG_AWAKE], SUSP_AWAKE, 0, 0);
+	if (getenv("SUSMAN_STAGGER"))
+		state.stagger_ms = atoi(getenv("SUSMAN_STAGGER"));
+	metrics_init();
+	trace_open("lsused");
+	state.fan = fanout_new();
+	if (!state.fan)
 		exit(1);
-	listen(s, 20);
-	/* Incase someone is waiting for us... */
-	close(0);
 
 	event_init();
+	evtimer_set(&state.stagger, notify_classes, &state);
+	if (getenv("SUSMAN_SHARDS"))
+		nshards = atoi(getenv("SUSMAN_SHARDS"));
+	if (nshards > sysconf(_SC_NPROCESSORS_ONLN))
+		nshards = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nshards > 1) {
+		if (init_shards(&state, nshards) < 0)
+			exit(1);
+		event_set(&sev, state.cmd[0], EV_READ | EV_PERSIST,
+			  from_shards, &state);
+		event_add(&sev, NULL);
+	}
+
+	s = restore(&state);
+	restored = s >= 0;
+	if (!restored)
+		s = listen_socket("/run/suspend/registration");
+	if (s < 0)
+		exit(1);
+	state.listen = s;
 
-	state.sus = suspend_watch(do_suspend, did_resume, &state);
+	if (state.listen_pkt < 0)
+		state.listen_pkt = listen_seqpacket(SUSP_REGISTRATION);
+
+	update_watch(&state);
+	if (state.shards)
+		start_shards(&state);
 	event_set(&ev, s, EV_READ | EV_PERSIST, do_accept, &state);
 	event_add(&ev, NULL);
+	if (state.listen_pkt >= 0) {
+		event_set(&pev, state.listen_pkt, EV_READ | EV_PERSIST,
+			  do_accept, &state);
+		event_add(&pev, NULL);
+	}
+	signal_set(&hupev, SIGHUP, do_upgrade, &state);
+	signal_add(&hupev, NULL);
+	if (restored)
+		handoff_done();
+	else
+		/* Incase someone is waiting for us... */
+		close(0);
 
 	event_loop(0);
 	exit(0);
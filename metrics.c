@@ -0,0 +1,344 @@
+/*
+ * metrics - counters and histograms for the susman daemons.
+ *
+ * Each process keeps its metrics in a small file mmapped from
+ * /run/suspend/stats/<component>.  Only that process updates them,
+ * with relaxed atomic adds, so there is no locking and no syscall on
+ * any hot path.  Anyone can read the files at any time; susman
+ * serves them all in the Prometheus text format on
+ * /run/suspend/metrics.
+ *
+ * Metrics are found again by name when the file is re-opened, so
+ * counters carry on across a restart or an upgrade of the daemon.
+ * If the file can't be set up, or is full, metric_new() returns a
+ * scratch metric so callers never need to check; those that didn't
+ * fit are counted and exported as susman_metrics_dropped.
+ *
+ * A component with an open-ended set of series can instead write
+ * them in the text format to a <name>.prom file there, replacing it
+ * with rename(); it is exported as it is.
+ *
+ * Copyright (C) 2011 Neil Brown <neilb@suse.de>
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "susman.h"
+
+#define MAGIC		"SUSMET1"
+#define STATS		"/run/suspend/stats"
+#define NMETRICS	64
+
+struct metfile {
+	char		magic[8];
+	uint32_t	count;		/* entries in use */
+	uint32_t	dropped;	/* metric_new()s which didn't fit */
+	struct metric	m[NMETRICS];
+};
+
+/* upper bounds in msec, the last bucket is +Inf */
+static const double bounds[METRIC_BUCKETS - 1] = {
+	1, 2, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000
+};
+
+static struct metfile *mf;
+static struct metric scratch;
+
+int metrics_open(const char *component)
+{
+	char path[256];
+	int fd;
+
+	mkdir(STATS, 0755);
+	if (snprintf(path, sizeof(path), STATS "/%s", component)
+	    >= sizeof(path))
+		return -1;
+	fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, sizeof(*mf)) < 0) {
+		close(fd);
+		return -1;
+	}
+	mf = mmap(NULL, sizeof(*mf), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mf == MAP_FAILED) {
+		mf = NULL;
+		return -1;
+	}
+	if (memcmp(mf->magic, MAGIC, 8) != 0 || mf->count > NMETRICS) {
+		memset(mf, 0, sizeof(*mf));
+		memcpy(mf->magic, MAGIC, 8);
+	}
+	mf->dropped = 0;
+	return 0;
+}
+
+/* 'name' may carry Prometheus labels, e.g. foo_total{reason="x"} */
+struct metric *metric_new(const char *name, const char *help, int type)
+{
+	struct metric *m;
+	unsigned i;
+
+	if (!mf)
+		return &scratch;
+	for (i = 0; i < mf->count; i++)
+		if (strcmp(mf->m[i].name, name) == 0)
+			return &mf->m[i];
+	if (mf->count >= NMETRICS) {
+		__atomic_fetch_add(&mf->dropped, 1, __ATOMIC_RELAXED);
+		return &scratch;
+	}
+	m = &mf->m[mf->count];
+	memset(m, 0, sizeof(*m));
+	strncpy(m->name, name, sizeof(m->name)-1);
+	strncpy(m->help, help, sizeof(m->help)-1);
+	m->type = type;
+	/* Readers must never see a half-made entry */
+	__atomic_store_n(&mf->count, mf->count + 1, __ATOMIC_RELEASE);
+	return m;
+}
+
+void metric_add(struct metric *m, int64_t v)
+{
+	__atomic_fetch_add(&m->value, v, __ATOMIC_RELAXED);
+}
+
+void metric_set(struct metric *m, int64_t v)
+{
+	__atomic_store_n(&m->value, v, __ATOMIC_RELAXED);
+}
+
+void metric_observe(struct metric *m, double ms)
+{
+	int b;
+
+	for (b = 0; b < METRIC_BUCKETS - 1; b++)
+		if (ms <= bounds[b])
+			break;
+	__atomic_fetch_add(&m->bucket[b], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&m->sum_us, (int64_t)(ms * 1000), __ATOMIC_RELAXED);
+	__atomic_fetch_add(&m->value, 1, __ATOMIC_RELAXED);
+}
+
+double metric_ms(struct timespec *from)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - from->tv_sec) * 1000.0
+		+ (now.tv_nsec - from->tv_nsec) / 1000000.0;
+}
+
+static const char *types[] = { "counter", "gauge", "histogram" };
+
+/* The family a metric belongs to: its name without the labels */
+static char *base_name(const char *name, char *base)
+{
+	char *labels;
+
+	strcpy(base, name);
+	labels = strchr(base, '{');
+	if (labels) {
+		/* keep just the inside of the braces */
+		*labels++ = 0;
+		labels[strlen(labels)-1] = 0;
+	}
+	return labels;
+}
+
+static void export_one(FILE *f, struct metric *m, char *last)
+{
+	char base[sizeof(m->name)];
+	char *labels;
+	uint64_t cum = 0;
+	int b;
+
+	labels = base_name(m->name, base);
+	if (strcmp(base, last) != 0) {
+		fprintf(f, "# HELP %s %s\n# TYPE %s %s\n",
+			base, m->help, base, types[m->type]);
+		strcpy(last, base);
+	}
+	if (m->type != METRIC_HISTOGRAM) {
+		fprintf(f, "%s %lld\n", m->name, (long long)m->value);
+		return;
+	}
+	for (b = 0; b < METRIC_BUCKETS; b++) {
+		cum += m->bucket[b];
+		fprintf(f, "%s_bucket{%s%s", base,
+			labels ? labels : "", labels ? "," : "");
+		if (b < METRIC_BUCKETS - 1)
+			fprintf(f, "le=\"%g\"} %llu\n", bounds[b] / 1000,
+				(unsigned long long)cum);
+		else
+			fprintf(f, "le=\"+Inf\"} %llu\n",
+				(unsigned long long)cum);
+	}
+	fprintf(f, "%s_sum%s%s%s %g\n", base, labels ? "{" : "",
+		labels ? labels : "", labels ? "}" : "", m->sum_us / 1e6);
+	fprintf(f, "%s_count%s%s%s %llu\n", base, labels ? "{" : "",
+		labels ? labels : "", labels ? "}" : "",
+		(unsigned long long)cum);
+}
+
+#define TEXT_FAMILIES	16
+
+/* Copy a .prom file, noting the families it has in 'fam' */
+static int export_text(FILE *f, const char *path,
+		       char (*fam)[sizeof(scratch.name)], int nfam)
+{
+	FILE *in = fopen(path, "r");
+	char line[512];
+
+	if (!in)
+		return nfam;
+	while (fgets(line, sizeof(line), in)) {
+		if (strncmp(line, "# TYPE ", 7) == 0 && nfam < TEXT_FAMILIES) {
+			sscanf(line + 7, "%95s", fam[nfam]);
+			nfam++;
+		}
+		fputs(line, f);
+	}
+	fclose(in);
+	return nfam;
+}
+
+struct export {
+	struct metric	*m;
+	char		base[sizeof(scratch.name)];
+	int		order;		/* as found */
+};
+
+static int export_cmp(const void *a, const void *b)
+{
+	const struct export *x = a, *y = b;
+	int c = strcmp(x->base, y->base);
+
+	return c ? c : x->order - y->order;
+}
+
+/* Write every component's metrics in Prometheus text format.  All
+ * the series of a family must be together, but they can come from
+ * different components or have been registered apart, so they are
+ * sorted by family, keeping the order within each.
+ */
+void metrics_export(FILE *f)
+{
+	char last[sizeof(scratch.name)] = "";
+	char fam[TEXT_FAMILIES][sizeof(scratch.name)];
+	DIR *dir = opendir(STATS);
+	struct dirent *de;
+	struct metfile **files = NULL;
+	char **names = NULL;
+	struct export *ex = NULL;
+	int nfiles = 0, nex = 0, nfam = 0;
+	int i, k;
+
+	if (!dir)
+		return;
+	while ((de = readdir(dir)) != NULL) {
+		struct metfile *m, **nf;
+		struct export *ne;
+		struct stat stb;
+		char path[256];
+		char **nn;
+		unsigned j, n;
+		int fd;
+
+		if (de->d_name[0] == '.')
+			continue;
+		if (snprintf(path, sizeof(path), STATS "/%s", de->d_name)
+		    >= sizeof(path))
+			continue;
+		n = strlen(de->d_name);
+		if (n > 5 && strcmp(de->d_name + n - 5, ".prom") == 0) {
+			nfam = export_text(f, path, fam, nfam);
+			continue;
+		}
+		fd = open(path, O_RDONLY|O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		/* A short file would SIGBUS us */
+		if (fstat(fd, &stb) < 0 || stb.st_size < sizeof(*m)) {
+			close(fd);
+			continue;
+		}
+		m = mmap(NULL, sizeof(*m), PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (m == MAP_FAILED)
+			continue;
+		n = __atomic_load_n(&m->count, __ATOMIC_ACQUIRE);
+		if (memcmp(m->magic, MAGIC, 8) != 0 || n > NMETRICS) {
+			munmap(m, sizeof(*m));
+			continue;
+		}
+		nf = realloc(files, (nfiles + 1) * sizeof(*files));
+		if (nf)
+			files = nf;
+		nn = realloc(names, (nfiles + 1) * sizeof(*names));
+		if (nn)
+			names = nn;
+		ne = realloc(ex, (nex + n + 1) * sizeof(*ex));
+		if (ne)
+			ex = ne;
+		if (!nf || !nn || !ne ||
+		    !(names[nfiles] = strdup(de->d_name))) {
+			munmap(m, sizeof(*m));
+			continue;
+		}
+		files[nfiles++] = m;
+		for (j = 0; j < n; j++) {
+			ex[nex].m = &m->m[j];
+			base_name(m->m[j].name, ex[nex].base);
+			ex[nex].order = nex;
+			nex++;
+		}
+	}
+	closedir(dir);
+
+	qsort(ex, nex, sizeof(*ex), export_cmp);
+	for (i = 0; i < nex; i++) {
+		/* A family from a .prom file replaces any left here
+		 * by an older version of the component.
+		 */
+		for (k = 0; k < nfam; k++)
+			if (strcmp(ex[i].base, fam[k]) == 0)
+				break;
+		if (k == nfam)
+			export_one(f, ex[i].m, last);
+	}
+	if (nfiles)
+		fprintf(f, "# HELP susman_metrics_dropped Metrics which didn't"
+			" fit in the component's table\n"
+			"# TYPE susman_metrics_dropped gauge\n");
+	for (i = 0; i < nfiles; i++) {
+		fprintf(f, "susman_metrics_dropped{component=\"%s\"} %u\n",
+			names[i], files[i]->dropped);
+		munmap(files[i], sizeof(*files[i]));
+		free(names[i]);
+	}
+	free(files);
+	free(names);
+	free(ex);
+}
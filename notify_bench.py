@@ -0,0 +1,123 @@
+#!/usr/bin/env python
+
+# Compare dnotify.py and inotify.py as suspend.py uses them: one
+# file in a directory changes, as 'watching' does on each suspend
+# and resume, while 'files' other files there are watched too.  A
+# child process makes 'count' changes, writing the time into the
+# file, and waits for each to be noticed before the next.  Reports
+# the latency from the write to the callback, and the CPU the
+# watching process used per change.
+#
+# Usage: notify_bench.py [-n count] [-f files] dnotify|inotify
+#
+# dnotify.py is Python 2 only, so compare them with python2.
+
+# Copyright (C) 2011 Neil Brown <neilb@suse.de>
+#
+#    This program is free software; you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation; either version 2 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License along
+#    with this program; if not, write to the Free Software Foundation, Inc.,
+#    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+import os, sys, time, select, getopt, tempfile, shutil
+
+def usage():
+    sys.stderr.write('Usage: notify_bench.py [-n count] [-f files] '
+                     'dnotify|inotify\n')
+    sys.exit(1)
+
+def changer(path, count, ack):
+    # One change per acknowledgement
+    for i in range(count):
+        if not os.read(ack, 1):
+            break
+        fd = os.open(path, os.O_WRONLY|os.O_TRUNC)
+        os.write(fd, ('%.9f' % time.time()).encode())
+        os.close(fd)
+    os._exit(0)
+
+def main():
+    count = 1000
+    files = 8
+    try:
+        opts, args = getopt.getopt(sys.argv[1:], 'n:f:')
+    except getopt.GetoptError:
+        usage()
+    for o, v in opts:
+        if o == '-n':
+            count = int(v)
+        else:
+            files = int(v)
+    if len(args) != 1 or args[0] not in ('dnotify', 'inotify'):
+        usage()
+    mod = __import__(args[0])
+
+    d = tempfile.mkdtemp(prefix='notify_bench.')
+    path = os.path.join(d, 'watching')
+    for n in ['watching'] + ['other%d' % i for i in range(files)]:
+        open(os.path.join(d, n), 'w').close()
+
+    lat = []
+    last = [None]
+    r, w = os.pipe()
+    def changed(f):
+        try:
+            stamp = open(path).read()
+        except IOError:
+            return
+        # A truncate is seen before the write
+        if not stamp or stamp == last[0]:
+            return
+        lat.append(time.time() - float(stamp))
+        last[0] = stamp
+        if len(lat) < count:
+            os.write(w, b'x')
+
+    watcher = mod.dir(d)
+    for i in range(files):
+        watcher.watch('other%d' % i, changed)
+    watcher.watch('watching', changed)
+    fd = hasattr(watcher, 'fileno') and watcher.fileno()
+
+    pid = os.fork()
+    if pid == 0:
+        os.close(w)
+        changer(path, count, r)
+    os.close(r)
+    t0 = os.times()
+    start = time.time()
+    os.write(w, b'x')
+    while len(lat) < count:
+        try:
+            ready = select.select(fd and [fd] or [], [], [], 1)[0]
+        except (select.error, OSError):
+            # dnotify's SIGIO: the callbacks have already run
+            continue
+        if ready:
+            watcher.handle()
+    elapsed = time.time() - start
+    t1 = os.times()
+    os.close(w)
+    os.waitpid(pid, 0)
+    shutil.rmtree(d)
+
+    lat.sort()
+    cpu = (t1[0] - t0[0]) + (t1[1] - t0[1])
+    print('%s: %d changes with %d other files watched in %.2fs'
+          % (args[0], count, files, elapsed))
+    print('latency   p50 %.0fus, p99 %.0fus, max %.0fus'
+          % (lat[len(lat) // 2] * 1e6, lat[(len(lat) - 1) * 99 // 100] * 1e6,
+             lat[-1] * 1e6))
+    print('cpu       %.1fus per change' % (cpu * 1e6 / count))
+
+if __name__ == '__main__':
+    main()
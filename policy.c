@@ -0,0 +1,146 @@
+/*
+ * policy - decide whether an idle system is worth suspending.
+ *
+ * Suspending and resuming costs time (and so energy), and if the
+ * system will be woken again almost at once it is better to stay
+ * awake.  We predict how long a suspend would last as the shorter
+ * of the time until the next wake alarm and a moving average of
+ * how long past idle periods turned out to be, and suspend only if
+ * that exceeds the break-even time: the measured cost of a suspend
+ * and resume times 'ratio', but never less than 'min_ms'.
+ *
+ * Idle periods are learnt both from actual suspends and from the
+ * time we spend awake waiting with no blockers.  Waiting longer
+ * than expected raises the prediction, so an idle system does get
+ * suspended eventually.
+ *
+ * This does no I/O of its own: lsusd feeds it real times, and
+ * sussim simulated ones.
+ *
+ * Copyright (C) 2011 Neil Brown <neilb@suse.de>
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "susman.h"
+
+#define MIN_WAIT	100	/* msec */
+#define MAX_WAIT	60000
+
+void policy_init(struct policy *p)
+{
+	memset(p, 0, sizeof(*p));
+	p->alpha = 0.25;
+	p->min_ms = 2000;
+	p->ratio = 4;
+	/* Be optimistic until we know better */
+	p->sleep_ms = 60000;
+}
+
+/* Settings are words like "min_ms=2000 ratio=4 alpha=0.25" */
+void policy_parse(struct policy *p, const char *conf)
+{
+	const char *c = conf;
+
+	while (c && *c) {
+		double v;
+		char key[16];
+		if (sscanf(c, " %15[a-z_]=%lf", key, &v) == 2) {
+			if (strcmp(key, "min_ms") == 0 && v >= 0)
+				p->min_ms = v;
+			else if (strcmp(key, "ratio") == 0 && v >= 0)
+				p->ratio = v;
+			else if (strcmp(key, "alpha") == 0 && v > 0 && v <= 1)
+				p->alpha = v;
+		}
+		c = strpbrk(c, " \t\n");
+		if (c)
+			c++;
+	}
+}
+
+static void ema(struct policy *p, double *avg, double sample)
+{
+	*avg += p->alpha * (sample - *avg);
+}
+
+/* 'alarm_ms' is the time until the next wake alarm, or negative if
+ * there isn't one.  Returns 0 if we should suspend now, else how
+ * long to wait before asking again.
+ */
+long policy_decide(struct policy *p, double alarm_ms)
+{
+	double pred = p->sleep_ms;
+	double be = p->cost_ms * p->ratio;
+	long wait;
+	int limited = 0;
+
+	if (be < p->min_ms)
+		be = p->min_ms;
+	if (alarm_ms >= 0 && alarm_ms < pred) {
+		pred = alarm_ms;
+		limited = 1;
+	}
+	p->predicted = pred;
+	p->breakeven = be;
+	p->decisions++;
+	if (pred >= be) {
+		p->suspends++;
+		return 0;
+	}
+	p->deferrals++;
+	if (limited) {
+		/* Nothing will change until the alarm has gone off */
+		p->alarm_limited++;
+		wait = alarm_ms + 1000;
+	} else
+		wait = be - pred;
+	if (wait < MIN_WAIT)
+		wait = MIN_WAIT;
+	if (wait > MAX_WAIT)
+		wait = MAX_WAIT;
+	return wait;
+}
+
+/* We were awake and idle for 'ms'.  If 'ended', a blocker then
+ * appeared so that is a whole idle period, otherwise it is still
+ * going and only tells us idle periods can be at least this long.
+ */
+void policy_idle(struct policy *p, double ms, int ended)
+{
+	if (ended || ms > p->sleep_ms)
+		ema(p, &p->sleep_ms, ms);
+}
+
+/* We suspended for 'slept_ms', and suspend plus resume took 'cost_ms' */
+void policy_slept(struct policy *p, double slept_ms, double cost_ms)
+{
+	double err = slept_ms - p->predicted;
+
+	if (err < 0)
+		err = -err;
+	p->samples++;
+	p->err_sum_ms += err;
+	p->last_err_ms = err;
+	if (slept_ms < p->breakeven)
+		p->short_sleeps++;
+	if (p->cost_ms == 0)
+		p->cost_ms = cost_ms;
+	else
+		ema(p, &p->cost_ms, cost_ms);
+	ema(p, &p->sleep_ms, slept_ms);
+}
@@ -0,0 +1,114 @@
+/*
+ * Test the binary protocol on the SOCK_SEQPACKET sockets.
+ * Registers two fds with lsused and asks for an alarm in 'secs'
+ * (default 2) from wakealarmd, each with all its requests in one
+ * datagram, checks the replies, then answers SUSP_SUSPEND with
+ * SUSP_READY and reports SUSP_AWAKE until the alarm's SUSP_NOW.
+ * One fd is left readable so every suspend attempt asks us.
+ *
+ * Copyright (C) 2011 Neil Brown <neilb@suse.de>
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <poll.h>
+#include <time.h>
+#include <event.h>
+#include "libsus.h"
+
+static void expect(struct susp_frame *f, int n, int i, int op, int id,
+		   long long arg)
+{
+	if (n <= i || f->msg[i].op != op || f->msg[i].id != id ||
+	    f->msg[i].arg != arg) {
+		fprintf(stderr, "proto_test: reply %d: wanted op %d id %d arg %lld,"
+			" got %d messages\n", i, op, id, arg, n);
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct susp_frame f;
+	struct pollfd pfd[2];
+	int p1[2], p2[2], fds[2];
+	int reg, alarm, n, i;
+	time_t when = time(0) + (argc > 1 ? atoi(argv[1]) : 2);
+
+	reg = susp_connect(SUSP_REGISTRATION);
+	alarm = susp_connect(SUSP_WAKEALARM);
+	if (reg < 0 || alarm < 0 || pipe(p1) < 0 || pipe(p2) < 0) {
+		fprintf(stderr, "proto_test: cannot connect\n");
+		exit(1);
+	}
+	write(p1[1], "x", 1);
+	fds[0] = p1[0];
+	fds[1] = p2[0];
+
+	susp_init(&f);
+	susp_add(&f, SUSP_HELLO, 1, SUSP_CAP_WATCH | SUSP_CAP_CLASS |
+		 SUSP_CAP_ALARM);
+	susp_add(&f, SUSP_CLASS, 2, WAKE_PROMPT);
+	susp_add(&f, SUSP_WATCH, 3, 2);
+	susp_add(&f, 999, 4, 0);
+	susp_send(reg, &f, fds, 2);
+	n = susp_recv(reg, &f, NULL, NULL);
+	expect(&f, n, 0, SUSP_HELLO, 1, SUSP_CAP_WATCH | SUSP_CAP_CLASS);
+	expect(&f, n, 1, SUSP_WATCHED, 3, 2);
+	expect(&f, n, 2, SUSP_ERROR, 4, 999);
+	printf("lsused: %d replies in one datagram\n", n);
+
+	susp_init(&f);
+	susp_add(&f, SUSP_HELLO, 1, SUSP_CAP_WATCH | SUSP_CAP_ALARM);
+	susp_add(&f, SUSP_ALARM, 7, when);
+	susp_send(alarm, &f, NULL, 0);
+	n = susp_recv(alarm, &f, NULL, NULL);
+	expect(&f, n, 0, SUSP_HELLO, 1, SUSP_CAP_ALARM);
+	expect(&f, n, 1, SUSP_ALARM_SET, 7, when);
+	printf("wakealarmd: %d replies in one datagram\n", n);
+	fflush(stdout);
+
+	pfd[0].fd = reg;
+	pfd[1].fd = alarm;
+	pfd[0].events = pfd[1].events = POLLIN;
+	while (poll(pfd, 2, -1) > 0) {
+		if (pfd[0].revents) {
+			n = susp_recv(reg, &f, NULL, NULL);
+			if (n <= 0)
+				break;
+			for (i = 0; i < n; i++)
+				if (f.msg[i].op == SUSP_SUSPEND) {
+					printf("suspend\n");
+					susp_init(&f);
+					susp_add(&f, SUSP_READY, 0, 0);
+					susp_send(reg, &f, NULL, 0);
+					break;
+				} else if (f.msg[i].op == SUSP_AWAKE)
+					printf("awake\n");
+		}
+		if (pfd[1].revents) {
+			n = susp_recv(alarm, &f, NULL, NULL);
+			expect(&f, n, 0, SUSP_NOW, 7, when);
+			printf("alarm at %ld for %ld\n", (long)time(0),
+			       (long)when);
+			exit(0);
+		}
+		fflush(stdout);
+	}
+	fprintf(stderr, "proto_test: lost lsused\n");
+	exit(1);
+}
@@ -0,0 +1,73 @@
+/*
+ * Helpers for libsus clients to (re)connect to a daemon socket.
+ * If a daemon restarts, all of its clients notice at the same
+ * moment, so retries are spread out with a randomised exponential
+ * backoff.
+ *
+ * Copyright (C) 2011 Neil Brown <neilb@suse.de>
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "susman.h"
+
+#define BACKOFF_MIN	100	/* msec */
+#define BACKOFF_MAX	10000
+
+/* Returns a non-blocking connected socket, or -1 */
+int sus_connect(const char *path)
+{
+	struct sockaddr_un addr;
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (sock < 0)
+		return -1;
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		close(sock);
+		return -1;
+	}
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+	return sock;
+}
+
+/* Choose the next retry delay.  *backoff is the current limit in
+ * msec which is doubled each time, the delay is a random point
+ * in the upper half of it.
+ */
+void sus_backoff(int *backoff, struct timeval *tv)
+{
+	static unsigned int seed;
+	int ms;
+
+	if (!seed)
+		seed = getpid() ^ time(0);
+	if (*backoff < BACKOFF_MIN)
+		*backoff = BACKOFF_MIN;
+	ms = *backoff / 2 + rand_r(&seed) % (*backoff / 2 + 1);
+	*backoff *= 2;
+	if (*backoff > BACKOFF_MAX)
+		*backoff = BACKOFF_MAX;
+	tv->tv_sec = ms / 1000;
+	tv->tv_usec = (ms % 1000) * 1000;
+}
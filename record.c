@@ -0,0 +1,66 @@
+/*
+ * record - log what libsus clients do, for sussim to replay.
+ *
+ * If /run/suspend/record exists the first time a client blocks
+ * suspend or handles a wake fd, each suspend_block(), the matching
+ * allow, and each wake fd callback with how long it ran, are
+ * appended to /run/suspend/record/clients as struct trace_rec, in
+ * the format the daemons record in (see trace.c).  O_APPEND keeps
+ * the records of different clients whole.  Without the directory
+ * this is one failed open() per process.
+ *
+ * Copyright (C) 2011 Neil Brown <neilb@suse.de>
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "susman.h"
+
+static int recfd = -2;		/* -2 until we have looked */
+static off_t recsize;
+
+int sus_recording(void)
+{
+	struct stat stb;
+
+	if (recfd == -2) {
+		recfd = open(RECORD_DIR "/clients",
+			     O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0666);
+		if (recfd >= 0 && fstat(recfd, &stb) == 0)
+			recsize = stb.st_size;
+	}
+	return recfd >= 0 && recsize < RECORD_MAX;
+}
+
+void sus_record(int event, int64_t a, int64_t b)
+{
+	struct trace_rec r;
+	struct timespec ts;
+
+	if (!sus_recording())
+		return;
+	clock_gettime(CLOCK_BOOTTIME, &ts);
+	r.seq = 0;
+	r.ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	r.pid = getpid();
+	r.event = event;
+	r.a = a;
+	r.b = b;
+	if (write(recfd, &r, sizeof(r)) == sizeof(r))
+		recsize += sizeof(r);
+}
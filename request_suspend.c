@@ -1,6 +1,19 @@
 /* Request suspend
  * Create the suspend-request file, then wait for it to be deleted.
  *
+ * lsusd writes how the attempt went into the file before removing
+ * it: "suspended" with how long entry took, when we went down and
+ * came back (CLOCK_REALTIME) and how long we slept, or "aborted" and
+ * why.  With -v that line is printed, with the number of attempts.
+ *
+ * -t secs or -u time asks wakealarmd to wake us then: time is
+ * seconds since the epoch, or HH:MM[:SS] (the next one).  -d secs
+ * keeps asking again for that long while attempts are aborted, but
+ * not past the wake time; if it runs out while lsusd is still
+ * waiting, the request is withdrawn and the result is "timeout".
+ *
+ * Exit status is 0 if we suspended, 1 if not, 2 for errors.
+ *
  * Copyright (C) 2011 Neil Brown <neilb@suse.de>
  *
  *    This program is free software; you can redistribute it and/or modify
@@ -21,59 +34,241 @@
 
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <fcntl.h>
-#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "libsus.h"
+
+static int alarm_fd = -1;
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static time_t parse_time(const char *s)
+{
+	struct tm tm;
+	time_t now = time(0);
+	char *end;
+	long v = strtol(s, &end, 10);
+
+	if (*end == 0 && end != s)
+		return v;
+	localtime_r(&now, &tm);
+	tm.tm_sec = 0;
+	if (!(end = strptime(s, "%H:%M:%S", &tm)) &&
+	    !(end = strptime(s, "%H:%M", &tm)))
+		return 0;
+	if (*end)
+		return 0;
+	tm.tm_isdst = -1;
+	if (mktime(&tm) <= now)
+		tm.tm_mday++;
+	tm.tm_isdst = -1;
+	return mktime(&tm);
+}
 
-static void catch(int sig)
+/* Registered with wakealarmd until we exit, or the time comes */
+static int set_alarm(time_t when)
 {
-	return;
+	struct susp_frame f;
+	int n;
+
+	alarm_fd = susp_connect(SUSP_WAKEALARM);
+	if (alarm_fd < 0)
+		return -1;
+	susp_init(&f);
+	susp_add(&f, SUSP_HELLO, 1, SUSP_CAP_ALARM);
+	susp_add(&f, SUSP_ALARM, 2, when);
+	susp_send(alarm_fd, &f, NULL, 0);
+	n = susp_recv(alarm_fd, &f, NULL, NULL);
+	if (n < 2 || f.msg[1].op != SUSP_ALARM_SET)
+		return -1;
+	return 0;
 }
 
-main(int argc, char *argv[])
+/* Wait for the request to go, as long as 'deadline' allows.
+ * Returns 1 if it went, 0 on timeout, -1 on error.
+ */
+static int wait_unlink(int ifd, int fd, long long deadline)
 {
-	int dirfd = open("/run/suspend", O_RDONLY);
-	int fd_request = open("/run/suspend/request",
-			      O_RDWR|O_CREAT, 0640);
-	int fd_watching = open("/run/suspend/watching", O_RDONLY);
-	if (fd_request < 0)
-		exit(2);
+	char buf[4096];
+	struct pollfd pfd[2];
+	struct stat stb;
+	int timeout;
+
+	while (1) {
+		if (fstat(fd, &stb) != 0)
+			return -1;
+		if (stb.st_nlink == 0)
+			return 1;
+		timeout = -1;
+		if (deadline) {
+			timeout = deadline - now_ms();
+			if (timeout <= 0)
+				return 0;
+		}
+		pfd[0].fd = ifd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = alarm_fd;
+		pfd[1].events = POLLIN;
+		if (poll(pfd, alarm_fd >= 0 ? 2 : 1, timeout) < 0)
+			return -1;
+		if (pfd[0].revents)
+			read(ifd, buf, sizeof(buf));
+		if (alarm_fd >= 0 && pfd[1].revents) {
+			/* Our time has come: wakealarmd holds suspend
+			 * off until we let go.
+			 */
+			close(alarm_fd);
+			alarm_fd = -1;
+		}
+	}
+}
 
+/* One request.  Returns 0 if we suspended, 1 if not, 2 on error,
+ * with lsusd's line in 'result'.
+ */
+static int attempt(char *result, int size, long long deadline)
+{
+	struct stat s1, s2, stb;
+	int fd_watching = -1, fd_request = -1, fd_now = -1, ifd;
+	int n, w, rv = 2;
 
-	if (dirfd < 0)
-		exit(2);
-	/* Wait for unlink */
+	ifd = inotify_init1(IN_CLOEXEC);
+	if (ifd < 0 ||
+	    inotify_add_watch(ifd, "/run/suspend", IN_DELETE) < 0)
+		goto out;
 	while (1) {
-		int fd;
-		struct stat stat;
-		sigset_t set, oldset;
-		sigemptyset(&set);
-		sigaddset(&set, SIGIO);
-
-		sigprocmask(SIG_BLOCK, &set, &oldset);
-		signal(SIGIO, catch);
-
-		fcntl(dirfd, F_NOTIFY, DN_DELETE);
-
-		if (fstat(fd_request, &stat) != 0
-		    || stat.st_nlink == 0) {
-			struct stat s1, s2;
-			int fd_watching2 = open("/run/suspend/watching",
-						O_RDONLY);
-			if (fd_watching < 0 ||
-			    fd_watching2 < 0 ||
-			    fstat(fd_watching, &s1) < 0 ||
-			    fstat(fd_watching2, &s2) < 0)
-				/* something strange */
-				exit(2);
-			if (s1.st_ino == s2.st_ino)
-				/* Didn't suspend - someone must be
-				 * blocking suspend
-				 */
-				exit(1);
-			exit(0);
+		fd_watching = open("/run/suspend/watching", O_RDONLY);
+		fd_request = open("/run/suspend/request",
+				  O_RDWR|O_CREAT, 0640);
+		if (fd_request < 0 || fstat(fd_request, &stb) != 0)
+			goto out;
+		if (stb.st_size == 0)
+			break;
+		/* That one is finished; wait for the next */
+		w = wait_unlink(ifd, fd_request, deadline);
+		close(fd_request);
+		fd_request = -1;
+		if (fd_watching >= 0)
+			close(fd_watching);
+		fd_watching = -1;
+		if (w <= 0)
+			goto waited;
+	}
+	w = wait_unlink(ifd, fd_request, deadline);
+	if (w == 0)
+		/* Withdrawn: lsusd sees it cancelled, if it got that far */
+		unlink("/run/suspend/request");
+waited:
+	if (w < 0)
+		goto out;
+	if (w == 0) {
+		snprintf(result, size, "timeout");
+		rv = 1;
+		goto out;
+	}
+	n = pread(fd_request, result, size - 1, 0);
+	if (n > 0) {
+		result[n] = 0;
+		result[strcspn(result, "\n")] = 0;
+		rv = strncmp(result, "suspended", 9) == 0 ? 0 : 1;
+		goto out;
+	}
+	/* An lsusd which doesn't say: see if the watchers moved on */
+	if (fd_watching < 0 ||
+	    (fd_now = open("/run/suspend/watching", O_RDONLY)) < 0 ||
+	    fstat(fd_watching, &s1) < 0 ||
+	    fstat(fd_now, &s2) < 0)
+		/* something strange */
+		goto out;
+	if (s1.st_ino == s2.st_ino) {
+		/* Didn't suspend - someone must be blocking suspend */
+		snprintf(result, size, "aborted");
+		rv = 1;
+	} else {
+		snprintf(result, size, "suspended");
+		rv = 0;
+	}
+out:
+	if (fd_now >= 0)
+		close(fd_now);
+	if (fd_request >= 0)
+		close(fd_request);
+	if (fd_watching >= 0)
+		close(fd_watching);
+	if (ifd >= 0)
+		close(ifd);
+	return rv;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: request_suspend [-v] [-t secs | -u time]"
+		" [-d secs]\n");
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	char result[256];
+	time_t wake = 0;
+	long long deadline = 0, wake_ms = 0;
+	int verbose = 0, attempts = 0;
+	int opt, rv;
+
+	while ((opt = getopt(argc, argv, "vt:u:d:")) != -1)
+		switch (opt) {
+		case 'v':
+			verbose = 1;
+			break;
+		case 't':
+			wake = time(0) + atol(optarg);
+			break;
+		case 'u':
+			wake = parse_time(optarg);
+			if (!wake)
+				usage();
+			break;
+		case 'd':
+			deadline = now_ms() + atof(optarg) * 1000;
+			break;
+		default:
+			usage();
 		}
+	if (optind < argc)
+		usage();
 
-		sigsuspend(&oldset);
-		sigprocmask(SIG_UNBLOCK, &set, &oldset);
+	if (wake) {
+		if (set_alarm(wake) < 0) {
+			fprintf(stderr, "request_suspend: cannot set alarm\n");
+			exit(2);
+		}
+		wake_ms = now_ms() + (wake - time(0)) * 1000LL;
+		if (deadline && deadline > wake_ms)
+			deadline = wake_ms;
 	}
+
+	do {
+		attempts++;
+		rv = attempt(result, sizeof(result), deadline);
+		if (rv != 1 || !deadline || strcmp(result, "timeout") == 0)
+			break;
+		if (strstr(result, "reason=blocked") == NULL)
+			/* Let whatever it was settle */
+			poll(NULL, 0, 100);
+	} while (now_ms() < deadline && (!wake || alarm_fd >= 0));
+
+	if (verbose && rv != 2)
+		printf("%s attempts=%d\n", result, attempts);
+	exit(rv);
 }
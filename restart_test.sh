@@ -0,0 +1,56 @@
+#!/bin/sh
+# Check that wakealarm clients survive a restart of wakealarmd.
+# Start some alarm_test clients, kill wakealarmd under them, start
+# it again and check every client still gets its alarm, at the
+# right time rather than when the connection dropped: no more than
+# 'late' seconds (default 1) after it was due.
+# Must be run from the build directory with /run/suspend writable.
+#
+# Copyright (C) 2011 Neil Brown <neilb@suse.de>
+#
+#    This program is free software; you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation; either version 2 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License along
+#    with this program; if not, write to the Free Software Foundation, Inc.,
+#    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+clients=${1-50}
+late=${2-1}
+out=/tmp/restart_test.$$
+
+mkdir -p /run/suspend
+touch /run/suspend/disabled /run/suspend/watching /run/suspend/watching-next
+
+./wakealarmd & pid=$!
+sleep 1
+i=0
+while [ $i -lt $clients ]; do
+    ./alarm_test 4 > $out.$i &
+    i=$((i+1))
+done
+sleep 1
+kill $pid
+sleep 1
+if grep -q Ping $out.* ; then
+    echo "FAIL: alarm fired when wakealarmd died"
+    kill $(jobs -p) 2> /dev/null
+    rm -f $out.*
+    exit 1
+fi
+./wakealarmd & pid=$!
+sleep 12
+kill $pid
+got=$(grep -l Ping $out.* | wc -l)
+ontime=$(cat $out.* | awk -v late=$late \
+    '/^Ping/ && $6 >= 0 && $6 <= late { n++ } END { print n+0 }')
+rm -f $out.*
+echo "$got of $clients alarms delivered, $ontime within ${late}s"
+[ $got -eq $clients ] && [ $ontime -eq $clients ]
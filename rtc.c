@@ -0,0 +1,121 @@
+/*
+ * rtc - program an RTC wake alarm through sysfs.
+ *
+ * The since_epoch and wakealarm attributes are opened once and
+ * kept open.  We remember the alarm we last programmed and the
+ * offset between the RTC and the system clock, so an alarm which
+ * hasn't changed since the last (probably aborted) suspend attempt
+ * costs a single cheap read of 'wakealarm' to check that the kernel
+ * still has it, rather than a clear and a set which each reach the
+ * RTC hardware.
+ *
+ * Copyright (C) 2011 Neil Brown <neilb@suse.de>
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include "susman.h"
+
+static int open_attr(const char *name, const char *attr, int mode)
+{
+	char path[256];
+
+	snprintf(path, sizeof(path), "%s/%s/%s",
+		 sys_path("/sys/class/rtc"), name, attr);
+	return open(path, mode|O_CLOEXEC);
+}
+
+static long long read_attr(int fd)
+{
+	char buf[24];
+	int n;
+
+	if (fd < 0)
+		return -1;
+	n = pread(fd, buf, sizeof(buf)-1, 0);
+	if (n <= 0)
+		return -1;
+	buf[n] = 0;
+	if (buf[0] < '0' || buf[0] > '9')
+		return -1;
+	return strtoll(buf, NULL, 10);
+}
+
+static void write_attr(struct rtc *rtc, long long val)
+{
+	char buf[24];
+
+	snprintf(buf, sizeof(buf), "%lld\n", val);
+	pwrite(rtc->alarmfd, buf, strlen(buf), 0);
+	rtc->writes++;
+}
+
+struct rtc *rtc_open(const char *name)
+{
+	struct rtc *rtc = calloc(1, sizeof(*rtc));
+
+	if (!rtc)
+		return NULL;
+	strncpy(rtc->name, name, sizeof(rtc->name)-1);
+	rtc->epochfd = open_attr(name, "since_epoch", O_RDONLY);
+	rtc->alarmfd = open_attr(name, "wakealarm", O_RDWR);
+	return rtc;
+}
+
+/* Arrange for the RTC to fire at 'when' in system time.
+ * Returns 1 if the hardware was reprogrammed, 0 if it already
+ * held that alarm, -1 if there is no usable RTC.
+ */
+int rtc_program(struct rtc *rtc, time_t when)
+{
+	long long want;
+
+	if (rtc->alarmfd < 0)
+		return -1;
+	if (!rtc->offset_valid) {
+		long long rtc_now = read_attr(rtc->epochfd);
+		rtc->offset = 0;
+		if (rtc_now > 0)
+			/* offset must be against a matching 'now' */
+			rtc->offset = rtc_now - time(0);
+		rtc->offset_valid = 1;
+	}
+	want = when + rtc->offset;
+
+	if (rtc->programmed == want
+	    && read_attr(rtc->alarmfd) == want) {
+		rtc->skipped++;
+		return 0;
+	}
+	/* An armed alarm can only be replaced after clearing it */
+	write_attr(rtc, 0);
+	write_attr(rtc, want);
+	rtc->programmed = want;
+	return 1;
+}
+
+/* The offset between RTC and system clock must be measured again
+ * after the clock has been set or we have been suspended.
+ * Whether the alarm is still set is checked on every use anyway.
+ */
+void rtc_invalidate(struct rtc *rtc)
+{
+	rtc->offset_valid = 0;
+}
@@ -0,0 +1,533 @@
+/*
+ * susbench - load susman and measure it.
+ *
+ * Starts a susman (./susman unless -S names another) on a fake sysfs
+ * tree in /tmp, so "suspending" is just a write to a plain file, and
+ * surrounds it with clients forked from here:
+ *   -b blockers	take and drop a lock on 'disabled', held for -h ms
+ *			(default 5) every -g ms (default 20) or so
+ *   -w watchers	suspend_watch() and say ready at once
+ *   -f wake fds	wake_set() on a pipe which becomes readable every
+ *			-g ms, so lsused has to ask them before suspend
+ *   -a alarms		keep a wake alarm 30s ahead with wakealarmd,
+ *			moving it every second (one due within a few
+ *			seconds would block suspend)
+ *   -r fds		register that many idle fds with lsused, up to
+ *			1000 from each client, which drops them all and
+ *			registers them again every second in a burst
+ * It then makes -n (default 1000) suspend requests, one after another,
+ * in the way request_suspend does, and reports how many completed
+ * per second, the latency percentiles from creating 'request' to
+ * lsusd writing the state file (entry) and to the request being
+ * cleared (cycle), and the CPU time each daemon used meanwhile with
+ * its resident size.  SUSMAN_SHARDS is passed on to lsused, so
+ *	for n in 1 2 4 8; do SUSMAN_SHARDS=$n ./susbench -r 20000; done
+ * compares it across core counts.
+ *
+ * /run/suspend is not virtualised, so this refuses to run if a susman
+ * is already answering there or autosuspend is on.
+ *
+ * Copyright (C) 2011 Neil Brown <neilb@suse.de>
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <event.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "libsus.h"
+
+#define MAXKIDS		1024
+#define TIMEOUT		10000	/* msec for one request */
+#define REGFDS		1000	/* most idle fds per -r client */
+
+static struct {
+	int	blockers, watchers, wakefds, alarms, requests;
+	int	hold_ms, gap_ms, regfds;
+} cf = { 4, 4, 8, 8, 1000, 5, 20, 0 };
+
+static pid_t kids[MAXKIDS];
+static int nkids;
+
+struct daemon {
+	char		name[16];
+	int		pid;
+	double		cpu_ms;		/* at the start of the run */
+};
+static struct daemon daemons[8];
+static int ndaemons;
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/* Clients */
+
+static void blocker(int n)
+{
+	unsigned int seed = n;
+	int fd = suspend_open();
+
+	if (fd < 0)
+		exit(1);
+	while (1) {
+		usleep((rand_r(&seed) % (2 * cf.gap_ms) + 1) * 1000);
+		suspend_block(fd);
+		usleep(cf.hold_ms * 1000);
+		suspend_allow(fd);
+	}
+}
+
+static int will_suspend(void *data)
+{
+	return 1;
+}
+
+static void did_resume(void *data)
+{
+}
+
+static void watcher(void)
+{
+	event_init();
+	if (!suspend_watch(will_suspend, did_resume, NULL))
+		exit(1);
+	event_loop(0);
+	exit(0);
+}
+
+static void drain(int fd, short ev, void *data)
+{
+	char buf[64];
+
+	read(fd, buf, sizeof(buf));
+}
+
+static struct event tick;
+
+/* Make the watched pipe readable again */
+static void poke(int fd, short ev, void *data)
+{
+	struct timeval tv = { cf.gap_ms / 1000, cf.gap_ms % 1000 * 1000 };
+
+	write(*(int *)data, "x", 1);
+	evtimer_add(&tick, &tv);
+}
+
+static void wakefd(void)
+{
+	static int p[2];
+
+	event_init();
+	event_priority_init(3);
+	if (pipe(p) < 0 || !wake_set(p[0], drain, NULL, 0))
+		exit(1);
+	evtimer_set(&tick, poke, &p[1]);
+	poke(-1, 0, &p[1]);
+	event_loop(0);
+	exit(0);
+}
+
+static void ring(int fd, short ev, void *data)
+{
+}
+
+static void move_alarm(int fd, short ev, void *data)
+{
+	static struct event *alarm;
+	struct timeval tv = { 1, 0 };
+
+	if (alarm)
+		wakealarm_destroy(alarm);
+	alarm = wakealarm_set(time(0) + 30, ring, NULL);
+	if (!alarm)
+		exit(1);
+	evtimer_add(&tick, &tv);
+}
+
+static void alarms(void)
+{
+	event_init();
+	evtimer_set(&tick, move_alarm, NULL);
+	move_alarm(-1, 0, NULL);
+	event_loop(0);
+	exit(0);
+}
+
+/* Register 'n' fds that are never readable, over and over */
+static void registrar(int n)
+{
+	struct rlimit rl;
+	struct susp_frame f;
+	int fds[REGFDS];
+	int sock, i, k;
+
+	getrlimit(RLIMIT_NOFILE, &rl);
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+	for (i = 0; i < n; i++)
+		if ((fds[i] = eventfd(0, EFD_CLOEXEC)) < 0)
+			exit(1);
+	while (1) {
+		sock = susp_connect(SUSP_REGISTRATION);
+		if (sock < 0)
+			exit(1);
+		for (i = 0; i < n; i += k) {
+			k = n - i < SUSP_MAXFDS ? n - i : SUSP_MAXFDS;
+			susp_init(&f);
+			susp_add(&f, SUSP_WATCH, i, k);
+			susp_send(sock, &f, fds + i, k);
+			if (susp_recv(sock, &f, NULL, NULL) <= 0)
+				exit(1);
+		}
+		sleep(1);
+		close(sock);
+	}
+}
+
+static void spawn(void (*fn)(int), int n)
+{
+	pid_t pid;
+
+	if (nkids >= MAXKIDS) {
+		fprintf(stderr, "susbench: too many clients\n");
+		exit(2);
+	}
+	pid = fork();
+	if (pid == 0) {
+		prctl(PR_SET_PDEATHSIG, SIGKILL);
+		fn(n);
+		exit(0);
+	}
+	if (pid > 0)
+		kids[nkids++] = pid;
+}
+
+static void watcher_n(int n) { watcher(); }
+static void wakefd_n(int n) { wakefd(); }
+static void alarms_n(int n) { alarms(); }
+
+/* The daemons */
+
+static int susman_up(void)
+{
+	struct sockaddr_un addr;
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	int ok;
+
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, "/run/suspend/registration");
+	ok = connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+	close(sock);
+	return ok;
+}
+
+static pid_t start_susman(const char *susman, const char *root)
+{
+	char path[256];
+	pid_t pid = fork();
+	int fd;
+
+	if (pid != 0)
+		return pid;
+	setsid();
+	setenv("SUSMAN_SYSFS", root, 1);
+	snprintf(path, sizeof(path), "%s/hooks", root);
+	setenv("SUSMAN_HOOKS", path, 1);
+	unsetenv("SUSMAN_SLEEP");
+	snprintf(path, sizeof(path), "%s/susman.log", root);
+	fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd >= 0) {
+		dup2(fd, 1);
+		dup2(fd, 2);
+		close(fd);
+	}
+	execl(susman, "susman", NULL);
+	perror(susman);
+	_exit(1);
+}
+
+static void put(const char *root, const char *name, const char *val)
+{
+	char path[256];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", root, name);
+	fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd >= 0) {
+		write(fd, val, strlen(val));
+		close(fd);
+	}
+}
+
+/* On-CPU time from schedstat, which unlike stat isn't in clock ticks.
+ * Summed over the threads, for a sharded lsused.
+ */
+static double cpu_ms(int pid)
+{
+	char path[300];
+	unsigned long long ns, total = 0;
+	struct dirent *de;
+	DIR *dir;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/task", pid);
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "/proc/%d/task/%s/schedstat",
+			 pid, de->d_name);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (fscanf(f, "%llu", &ns) == 1)
+			total += ns;
+		fclose(f);
+	}
+	closedir(dir);
+	return total / 1e6;
+}
+
+static long status_kb(int pid, const char *field)
+{
+	char path[64], line[128];
+	long kb = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f))
+		if (strncmp(line, field, strlen(field)) == 0)
+			kb = atol(line + strlen(field) + 1);
+	fclose(f);
+	return kb;
+}
+
+/* susman itself, and its services from /run/suspend/supervisor */
+static void find_daemons(pid_t susman)
+{
+	FILE *f = fopen("/run/suspend/supervisor", "r");
+	char name[16], state[16];
+	int pid;
+
+	ndaemons = 0;
+	strcpy(daemons[0].name, "susman");
+	daemons[ndaemons++].pid = susman;
+	while (f && ndaemons < 8 &&
+	       fscanf(f, "%15s %15s pid %d%*[^\n]", name, state, &pid) == 3) {
+		strcpy(daemons[ndaemons].name, name);
+		daemons[ndaemons++].pid = pid;
+	}
+	if (f)
+		fclose(f);
+}
+
+static int dbl_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void percentiles(const char *what, double *v, int n)
+{
+	if (n == 0)
+		return;
+	qsort(v, n, sizeof(*v), dbl_cmp);
+	printf("%-9s p50 %.2fms  p90 %.2fms  p99 %.2fms  max %.2fms\n",
+	       what, v[n / 2], v[n * 9 / 10], v[n * 99 / 100], v[n - 1]);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: susbench [-b blockers] [-w watchers] "
+		"[-f wakefds] [-a alarms]\n"
+		"                [-r fds] [-n requests] [-h hold_ms] "
+		"[-g gap_ms] [-S susman]\n");
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *susman = "./susman";
+	char root[] = "/tmp/susbench.XXXXXX";
+	char path[256];
+	double *entry, *cycle, start, t0, elapsed;
+	int nentry = 0, ncycle = 0, aborted = 0, stalled = 0;
+	int ifd, opt, i;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "b:w:f:a:r:n:h:g:S:")) != -1)
+		switch (opt) {
+		case 'b': cf.blockers = atoi(optarg); break;
+		case 'w': cf.watchers = atoi(optarg); break;
+		case 'f': cf.wakefds = atoi(optarg); break;
+		case 'a': cf.alarms = atoi(optarg); break;
+		case 'r': cf.regfds = atoi(optarg); break;
+		case 'n': cf.requests = atoi(optarg); break;
+		case 'h': cf.hold_ms = atoi(optarg); break;
+		case 'g': cf.gap_ms = atoi(optarg); break;
+		case 'S': susman = optarg; break;
+		default: usage();
+		}
+	if (cf.requests <= 0 || cf.gap_ms <= 0 || cf.hold_ms < 0)
+		usage();
+
+	if (susman_up() || access("/run/suspend/autosuspend", F_OK) == 0) {
+		fprintf(stderr, "susbench: susman is already running, "
+			"or autosuspend is on\n");
+		exit(2);
+	}
+	if (!mkdtemp(root)) {
+		perror(root);
+		exit(2);
+	}
+	snprintf(path, sizeof(path), "%s/power", root);
+	mkdir(path, 0755);
+	snprintf(path, sizeof(path), "%s/hooks", root);
+	mkdir(path, 0755);
+	put(root, "power/wakeup_count", "0\n");
+	put(root, "power/state", "");
+	snprintf(path, sizeof(path), "%s/power/state", root);
+
+	ifd = inotify_init1(IN_CLOEXEC);
+	inotify_add_watch(ifd, path, IN_CLOSE_WRITE);
+	mkdir("/run/suspend", 0770);
+	inotify_add_watch(ifd, "/run/suspend", IN_DELETE);
+
+	pid = start_susman(susman, root);
+	for (i = 0; i < 50 && !susman_up(); i++)
+		usleep(100000);
+	if (pid < 0 || i == 50) {
+		fprintf(stderr, "susbench: %s didn't start\n", susman);
+		if (pid > 0)
+			kill(-pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+		exit(2);
+	}
+
+	for (i = 0; i < cf.blockers; i++)
+		spawn(blocker, i);
+	for (i = 0; i < cf.watchers; i++)
+		spawn(watcher_n, i);
+	for (i = 0; i < cf.wakefds; i++)
+		spawn(wakefd_n, i);
+	for (i = 0; i < cf.alarms; i++)
+		spawn(alarms_n, i);
+	for (i = 0; i < cf.regfds; i += REGFDS)
+		spawn(registrar, cf.regfds - i < REGFDS ? cf.regfds - i : REGFDS);
+	/* Let lsused and wakealarmd start and the clients register */
+	usleep(500000);
+	find_daemons(pid);
+	for (i = 0; i < ndaemons; i++)
+		daemons[i].cpu_ms = cpu_ms(daemons[i].pid);
+
+	entry = calloc(cf.requests, sizeof(double));
+	cycle = calloc(cf.requests, sizeof(double));
+	start = now_ms();
+	for (i = 0; i < cf.requests && !stalled; i++) {
+		int entered = 0, done = 0;
+
+		t0 = now_ms();
+		close(open("/run/suspend/request", O_RDWR|O_CREAT, 0640));
+		while (!done) {
+			char buf[4096]
+				__attribute__((aligned(__alignof__(struct inotify_event))));
+			struct pollfd pfd = { ifd, POLLIN, 0 };
+			char *p;
+			int n;
+
+			if (poll(&pfd, 1, TIMEOUT) <= 0) {
+				stalled = 1;
+				break;
+			}
+			n = read(ifd, buf, sizeof(buf));
+			for (p = buf; p < buf + n; ) {
+				struct inotify_event *ie = (void *)p;
+				if (ie->mask & IN_CLOSE_WRITE) {
+					if (!entered)
+						entry[nentry++] = now_ms() - t0;
+					entered = 1;
+				} else if (ie->len &&
+					   strcmp(ie->name, "request") == 0)
+					done = 1;
+				p += sizeof(*ie) + ie->len;
+			}
+		}
+		if (done && entered)
+			cycle[ncycle++] = now_ms() - t0;
+		else if (done)
+			aborted++;
+	}
+	elapsed = now_ms() - start;
+
+	printf("susbench: %d blockers, %d watchers, %d wake fds, %d alarms, "
+	       "%d idle fds, %s shards on %ld cpus\n", cf.blockers,
+	       cf.watchers, cf.wakefds, cf.alarms, cf.regfds,
+	       getenv("SUSMAN_SHARDS") ? getenv("SUSMAN_SHARDS") : "no",
+	       sysconf(_SC_NPROCESSORS_ONLN));
+	printf("cycles    %d in %.2fs (%.1f/s), %d aborted%s\n", ncycle,
+	       elapsed / 1000, ncycle * 1000 / elapsed, aborted,
+	       stalled ? ", then stalled" : "");
+	percentiles("entry", entry, nentry);
+	percentiles("cycle", cycle, ncycle);
+	printf("%-12s %8s %8s %8s\n", "daemon", "cpu ms", "rss kB", "peak kB");
+	for (i = 0; i < ndaemons; i++) {
+		struct daemon *d = &daemons[i];
+		double cpu = cpu_ms(d->pid);
+		if (d->pid == 0 || cpu < 0) {
+			printf("%-12s %8s\n", d->name, "-");
+			continue;
+		}
+		printf("%-12s %8.1f %8ld %8ld\n", d->name, cpu - d->cpu_ms,
+		       status_kb(d->pid, "VmRSS:"), status_kb(d->pid, "VmHWM:"));
+	}
+
+	for (i = 0; i < nkids; i++)
+		kill(kids[i], SIGKILL);
+	while (nkids > 0 && wait(NULL) > 0)
+		nkids--;
+	kill(-pid, SIGTERM);
+	usleep(100000);
+	kill(-pid, SIGKILL);
+	unlink("/run/suspend/request");
+	snprintf(path, sizeof(path), "rm -rf %s", root);
+	system(path);
+	exit(stalled ? 1 : 0);
+}
@@ -1,9 +1,33 @@
 /*
  * susman - manage suspend
- * This daemon forks and runs three processes
+ * This daemon forks and runs four processes
  * - one which manages suspend based on files in /run/suspend
  * - one which listens on a socket and handles suspend requests that way,
- * - one which provides a wakeup service using the RTC alarm.
+ * - one which provides a wakeup service using the RTC alarm,
+ * - one which hands out named suspend leases.
+ * Only lsusd is started straight away.  We bind the sockets for the
+ * others ourselves and only start each service when a client
+ * first connects (or, for wakealarmd, if alarms were left over from
+ * a previous run).  The socket is passed as fd 3 with LISTEN_FDS,
+ * and lsused and wakealarmd's SOCK_SEQPACKET socket as fd 4.
+ * When lsused or wakealarmd hands over to a new copy of this binary
+ * (see handoff.c), SUSMAN_SERVICE tells us which one to be.
+ *
+ * We then stay around as a supervisor.  If a service dies it is
+ * restarted, after a delay which grows if it keeps dying.  As we
+ * still hold the listening sockets, clients just queue meanwhile.
+ * While lsused, wakealarmd or leased is down, suspend is blocked as
+ * nobody is protecting their clients.
+ * Each child can tell us its new pid over a socket named by
+ * SUSMAN_SUPERVISOR when it hands over to a new copy, and as we are
+ * a subreaper we will see that copy exit.
+ * Restart counts and latencies are written to /run/suspend/supervisor.
+ *
+ * We also serve the metrics kept by every component (see metrics.c)
+ * on /run/suspend/metrics, as plain text or to an HTTP GET, and a
+ * list of who holds locks on 'disabled', 'watching' and
+ * 'watching-next' (see locks.c) on /run/suspend/blockers.
+ * "susman blockers" prints that list.
  *
  * Copyright (C) 2011 Neil Brown <neilb@suse.de>
  *
@@ -24,19 +48,137 @@
 #define _GNU_SOURCE
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/prctl.h>
+#include "libsus.h"
+#include "susman.h"
 
 int lsusd(int argc, char *argv[]);
 int lsused(int argc, char *argv[]);
 int wakealarmd(int argc, char *argv[]);
+int leased(int argc, char *argv[]);
+
+#define MAX_BACKOFF	60	/* seconds */
+#define STABLE		10	/* running this long resets backoff */
+#define SERVE_TIME	10	/* seconds a metrics or blockers client gets */
 
-void runone(int (*fun)(int argc, char *argv[]))
+struct service {
+	char		*name;
+	int		(*fun)(int argc, char *argv[]);
+	char		*path;		/* listening socket, if any */
+	int		critical;	/* block suspend while it is down */
+	char		*pktpath;	/* SOCK_SEQPACKET socket, if any */
+	int		sock, pkt;
+	int		sup[2];		/* [1] is given to the child */
+	pid_t		pid;		/* 0 when not running */
+	int		started;	/* has ever been started */
+	time_t		start_time;
+	time_t		restart_at;	/* when down, time to restart */
+	int		backoff;	/* seconds */
+	struct timespec	died;
+	int		restarts;
+	double		restart_ms;	/* latency of last restart */
+	double		max_restart_ms;
+	struct metric	*m_restarts, *m_up, *m_latency;
+} services[] = {
+	{ "lsusd", lsusd, NULL, 0},
+	{ "lsused", lsused, "/run/suspend/registration", 1,
+	  SUSP_REGISTRATION},
+	{ "wakealarmd", wakealarmd, "/run/suspend/wakealarm", 1,
+	  SUSP_WAKEALARM},
+	{ "leased", leased, "/run/suspend/lease", 1},
+	{ NULL }
+};
+
+static sigset_t oldmask;
+static int sigfd = -1;
+static int blockfd = -1;	/* held while a service is down */
+static int blocked;
+static int startfd = -1;	/* held while a service starts */
+static int msock = -1;		/* metrics */
+static int bsock = -1;		/* blockers */
+
+static time_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static void child_setup(struct service *s)
+{
+	char num[20];
+	int sock = -1, pkt = -1;
+	int i;
+
+	sigprocmask(SIG_SETMASK, &oldmask, NULL);
+	close(sigfd);
+	/* A lock lasts while any fd shares it, so these must go */
+	if (blockfd >= 0)
+		close(blockfd);
+	if (startfd >= 0)
+		close(startfd);
+	if (msock >= 0)
+		close(msock);
+	if (bsock >= 0)
+		close(bsock);
+	/* Out of the way while the others are closed */
+	if (s->sup[1] < 5) {
+		int fd = fcntl(s->sup[1], F_DUPFD_CLOEXEC, 10);
+		close(s->sup[1]);
+		s->sup[1] = fd;
+	}
+	if (s->sock >= 0)
+		sock = fcntl(s->sock, F_DUPFD_CLOEXEC, 10);
+	if (s->pkt >= 0)
+		pkt = fcntl(s->pkt, F_DUPFD_CLOEXEC, 10);
+	for (i = 0; services[i].name; i++) {
+		struct service *o = &services[i];
+		if (o->sock >= 0)
+			close(o->sock);
+		if (o->pkt >= 0)
+			close(o->pkt);
+		close(o->sup[0]);
+		if (o != s)
+			close(o->sup[1]);
+	}
+	if (sock >= 0) {
+		dup2(sock, 3);
+		close(sock);
+		snprintf(num, sizeof(num), "%d", getpid());
+		setenv("LISTEN_FDS", "1", 1);
+		setenv("LISTEN_PID", num, 1);
+		if (pkt >= 0) {
+			dup2(pkt, 4);
+			close(pkt);
+			setenv("LISTEN_FDS", "2", 1);
+		}
+	}
+	/* must survive an exec by handoff */
+	fcntl(s->sup[1], F_SETFD, 0);
+	snprintf(num, sizeof(num), "%d", s->sup[1]);
+	setenv("SUSMAN_SUPERVISOR", num, 1);
+}
+
+void runone(struct service *s)
 {
 	int pfd[2];
 	char c;
+	pid_t pid;
 
 	if (pipe(pfd) < 0)
 		exit(2);
-	switch (fork()) {
+	switch (pid = fork()) {
 	case -1:
 		exit (2);
 	default:
@@ -45,22 +187,353 @@ void runone(int (*fun)(int argc, char *argv[]))
 		close(pfd[0]);
 		dup2(pfd[1], 0);
 		close(pfd[1]);
-		(*fun)(0, NULL);
+		child_setup(s);
+		(*s->fun)(0, NULL);
 		exit(1);
 	}
 	close(pfd[1]);
-	/* Block for lsused to start up */
+	/* Block for it to start up */
 	read(pfd[0], &c, 1);
 	close(pfd[0]);
+	s->pid = pid;
+	s->started = 1;
+	s->start_time = now();
+}
+
+/* Don't allow suspend while a critical service is down */
+static void check_block(void)
+{
+	int down = 0;
+	int i;
+
+	for (i = 0; services[i].name; i++)
+		if (services[i].critical && services[i].started &&
+		    services[i].pid == 0)
+			down = 1;
+	if (down && !blocked)
+		blockfd = suspend_block(blockfd);
+	if (!down && blocked)
+		suspend_allow(blockfd);
+	blocked = down;
+}
+
+static void write_stats(void)
+{
+	FILE *f = fopen("/run/suspend/supervisor.new", "w");
+	int i;
+
+	if (!f)
+		return;
+	for (i = 0; services[i].name; i++) {
+		struct service *s = &services[i];
+		metric_set(s->m_up, s->pid != 0);
+		fprintf(f, "%s %s pid %d restarts %d "
+			"restart_ms %.1f max_restart_ms %.1f\n",
+			s->name, !s->started ? "idle" :
+			s->pid ? "up" : "down", (int)s->pid,
+			s->restarts, s->restart_ms, s->max_restart_ms);
+	}
+	fclose(f);
+	rename("/run/suspend/supervisor.new", "/run/suspend/supervisor");
+}
+
+/* Start a service that a client is waiting for.  Any client that
+ * has connected may already be counting on it, so don't allow
+ * suspend until it is running.
+ */
+static void start(struct service *s)
+{
+	startfd = suspend_block(-1);
+	runone(s);
+	suspend_close(startfd);
+	startfd = -1;
+}
+
+static void restart(struct service *s)
+{
+	struct timespec ts;
+	double ms;
+
+	runone(s);
+	trace(TR_RESTART, s - services, s->pid);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ms = (ts.tv_sec - s->died.tv_sec) * 1000.0
+		+ (ts.tv_nsec - s->died.tv_nsec) / 1000000.0;
+	s->restarts++;
+	metric_add(s->m_restarts, 1);
+	metric_observe(s->m_latency, ms);
+	s->restart_ms = ms;
+	if (ms > s->max_restart_ms)
+		s->max_restart_ms = ms;
+}
+
+static void reap(void)
+{
+	struct signalfd_siginfo si;
+	pid_t pid;
+	int i;
+
+	while (read(sigfd, &si, sizeof(si)) == sizeof(si))
+		;
+	while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+		for (i = 0; services[i].name; i++) {
+			struct service *s = &services[i];
+			if (s->pid != pid)
+				continue;
+			trace(TR_EXIT, i, pid);
+			s->pid = 0;
+			clock_gettime(CLOCK_MONOTONIC, &s->died);
+			if (now() - s->start_time >= STABLE)
+				s->backoff = 0;
+			s->restart_at = now() + s->backoff;
+			s->backoff = s->backoff ? s->backoff * 2 : 1;
+			if (s->backoff > MAX_BACKOFF)
+				s->backoff = MAX_BACKOFF;
+		}
+}
+
+static void metrics_init(void)
+{
+	char name[96];
+	int i;
+
+	metrics_open("susman");
+	for (i = 0; services[i].name; i++) {
+		snprintf(name, sizeof(name),
+			 "susman_restarts_total{service=\"%s\"}",
+			 services[i].name);
+		services[i].m_restarts =
+			metric_new(name, "Times a service was restarted",
+				   METRIC_COUNTER);
+	}
+	for (i = 0; services[i].name; i++) {
+		snprintf(name, sizeof(name), "susman_up{service=\"%s\"}",
+			 services[i].name);
+		services[i].m_up = metric_new(name, "Service is running",
+					      METRIC_GAUGE);
+	}
+	for (i = 0; services[i].name; i++) {
+		snprintf(name, sizeof(name),
+			 "susman_restart_seconds{service=\"%s\"}",
+			 services[i].name);
+		services[i].m_latency =
+			metric_new(name, "From a service dying to running again",
+				   METRIC_HISTOGRAM);
+	}
+}
+
+static void send_metrics(int fd)
+{
+	struct pollfd pfd;
+	char req[512];
+	int blockers;
+	FILE *f;
+
+	/* While the supervisor's scan is fresh, before the wait below */
+	blockers = locks_blockers();
+
+	/* An HTTP client will send a request first, give it
+	 * a moment.  Anyone else just gets the text.
+	 */
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	req[0] = 0;
+	if (poll(&pfd, 1, 100) == 1 && read(fd, req, sizeof(req)) < 0)
+		req[0] = 0;
+	f = fdopen(fd, "w");
+	if (!f)
+		return;
+	if (strncmp(req, "GET", 3) == 0)
+		fprintf(f, "HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n\r\n");
+	fprintf(f, "# HELP susman_blockers Processes blocking suspend\n"
+		"# TYPE susman_blockers gauge\n"
+		"susman_blockers %d\n", blockers);
+	metrics_export(f);
+	fclose(f);
+}
+
+static void send_blockers(int fd)
+{
+	FILE *f = fdopen(fd, "w");
+
+	if (!f)
+		return;
+	locks_report(f);
+	fclose(f);
+}
+
+/* Each client is served by a child, so one which is slow to send or
+ * read can't hold up reaping and restarting services.  The child
+ * gives up after SERVE_TIME.  /proc/locks is scanned here first, so
+ * that the table of holders, with when each was first seen, lives on
+ * in the supervisor and the child just formats its copy.
+ */
+static void serve(int sock, void (*fn)(int fd))
+{
+	int fd, n;
+
+	while ((fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+		locks_get(&n);
+		if (fork() == 0) {
+			sigprocmask(SIG_SETMASK, &oldmask, NULL);
+			/* Don't keep suspend blocked after we do */
+			if (blockfd >= 0)
+				close(blockfd);
+			if (startfd >= 0)
+				close(startfd);
+			alarm(SERVE_TIME);
+			fn(fd);
+			_exit(0);
+		}
+		close(fd);
+	}
+}
+
+/* "susman blockers": ask the running susman, which remembers how
+ * long locks have been held, else look for ourselves.
+ */
+static void show_blockers(void)
+{
+	char buf[4096];
+	int fd = sus_connect("/run/suspend/blockers");
+	int n;
+
+	if (fd < 0) {
+		locks_report(stdout);
+		return;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		fwrite(buf, 1, n, stdout);
+	close(fd);
+}
+
+static int alarms_pending(void)
+{
+	struct alarmtab *tab = alarmtab_open("/run/suspend/wakealarm.table");
+	int n;
+
+	if (!tab)
+		return 0;
+	n = alarmtab_count(tab);
+	alarmtab_close(tab);
+	return n > 0;
 }
 
 int main(int argc, char *argv[])
 {
-	int pfd[2];
-	char c;
+	char *service = getenv("SUSMAN_SERVICE");
+	sigset_t set;
+	int i;
+
+	if (service && strcmp(service, "lsused") == 0)
+		exit(lsused(0, NULL));
+	if (service && strcmp(service, "wakealarmd") == 0)
+		exit(wakealarmd(0, NULL));
+	if (argc > 1 && strcmp(argv[1], "blockers") == 0) {
+		show_blockers();
+		exit(0);
+	}
 
-	runone(lsusd);
-	runone(lsused);
-	wakealarmd(0, NULL);
-	exit(0);
+	mkdir("/run/suspend", 0770);
+	prctl(PR_SET_CHILD_SUBREAPER, 1);
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &set, &oldmask);
+	sigfd = signalfd(-1, &set, SFD_NONBLOCK|SFD_CLOEXEC);
+	if (sigfd < 0)
+		exit(1);
+
+	for (i = 0; services[i].name; i++) {
+		struct service *s = &services[i];
+		s->sock = s->pkt = -1;
+		if (s->path) {
+			s->sock = listen_socket(s->path);
+			if (s->sock < 0)
+				exit(1);
+		}
+		if (s->pktpath) {
+			s->pkt = listen_seqpacket(s->pktpath);
+			if (s->pkt < 0)
+				exit(1);
+		}
+		if (socketpair(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC|SOCK_NONBLOCK,
+			       0, s->sup) < 0)
+			exit(1);
+	}
+
+	metrics_init();
+	trace_open("susman");
+	msock = listen_socket("/run/suspend/metrics");
+	bsock = listen_socket("/run/suspend/blockers");
+
+	runone(&services[0]);
+	if (alarms_pending())
+		start(&services[2]);
+	write_stats();
+
+	while (1) {
+		struct pollfd pfd[3 + 12];
+		int timeout = -1;
+		int n = 3;
+		time_t t = now();
+
+		pfd[0].fd = sigfd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = msock;
+		pfd[1].events = POLLIN;
+		pfd[2].fd = bsock;
+		pfd[2].events = POLLIN;
+		for (i = 0; services[i].name; i++) {
+			struct service *s = &services[i];
+			pfd[n].fd = s->sup[0];
+			pfd[n++].events = POLLIN;
+			/* Start lazily on the first connection */
+			pfd[n].fd = s->started ? -1 : s->sock;
+			pfd[n++].events = POLLIN;
+			pfd[n].fd = s->started ? -1 : s->pkt;
+			pfd[n++].events = POLLIN;
+			if (s->started && s->pid == 0) {
+				int ms = (s->restart_at - t) * 1000;
+				if (ms < 0)
+					ms = 0;
+				if (timeout < 0 || ms < timeout)
+					timeout = ms;
+			}
+		}
+		if (poll(pfd, n, timeout) < 0)
+			continue;
+
+		for (i = 0; services[i].name; i++) {
+			struct service *s = &services[i];
+			pid_t pid;
+			/* Service has handed over to a new copy.  Check
+			 * this before reaping as it will exit soon after.
+			 */
+			while (recv(s->sup[0], &pid, sizeof(pid), 0)
+			       == sizeof(pid))
+				s->pid = pid;
+		}
+		if (pfd[0].revents)
+			reap();
+		if (pfd[1].revents)
+			serve(msock, send_metrics);
+		if (pfd[2].revents)
+			serve(bsock, send_blockers);
+		check_block();
+
+		t = now();
+		for (i = 0; services[i].name; i++) {
+			struct service *s = &services[i];
+			if (!s->started &&
+			    (pfd[4 + 3*i].revents || pfd[5 + 3*i].revents))
+				start(s);
+			else if (s->started && s->pid == 0 &&
+				 s->restart_at <= t)
+				restart(s);
+		}
+		check_block();
+		write_stats();
+	}
 }
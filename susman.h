@@ -0,0 +1,201 @@
+/* internal interfaces shared by the susman daemons.
+ *
+ * Copyright (C) 2011 Neil Brown <neilb@suse.de>
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <time.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/* alarmtab.c - persistent table of wakealarmd alarms */
+struct alarmtab;
+struct alarmtab *alarmtab_open(const char *path);
+void alarmtab_close(struct alarmtab *tab);
+int alarmtab_alloc(struct alarmtab *tab);
+void alarmtab_set(struct alarmtab *tab, int slot, time_t stamp);
+void alarmtab_free(struct alarmtab *tab, int slot);
+void alarmtab_set_next(struct alarmtab *tab, time_t stamp);
+time_t alarmtab_next(const char *path);
+int alarmtab_count(struct alarmtab *tab);
+int alarmtab_recover(struct alarmtab *tab,
+		     void (*fn)(int slot, time_t stamp, void *data),
+		     void *data);
+
+/* rtc.c - cached access to an RTC wake alarm */
+struct rtc {
+	char		name[16];	/* e.g. "rtc0" */
+	int		epochfd;	/* since_epoch */
+	int		alarmfd;	/* wakealarm */
+	long long	offset;		/* RTC time - system time */
+	int		offset_valid;
+	long long	programmed;	/* RTC time last written, or 0 */
+	unsigned long	writes;		/* writes to wakealarm */
+	unsigned long	skipped;	/* reprogramming avoided */
+};
+struct rtc *rtc_open(const char *name);
+int rtc_program(struct rtc *rtc, time_t when);
+void rtc_invalidate(struct rtc *rtc);
+
+/* reconnect.c - used by libsus clients */
+struct timeval;
+int sus_connect(const char *path);
+void sus_backoff(int *backoff, struct timeval *tv);
+
+/* handoff.c - pass sockets and state to a new instance */
+int handoff_start(const char *service, char *argv[],
+		  int *fds, int nfds, void *state, int len);
+int handoff_receive(int **fdsp, void **statep, int *lenp);
+void handoff_done(void);
+int listen_socket(const char *path);
+int listen_seqpacket(const char *path);
+
+/* fanout.c - send one short message to many clients, batched */
+struct fanout {
+	struct msg	*msgs;		/* queued, not yet sent */
+	int		n, size;
+	struct uring	*ring;		/* NULL if using write() */
+	unsigned long	flushes;
+	unsigned long	syscalls;	/* used to send them */
+	unsigned long	sent;		/* messages */
+};
+struct fanout *fanout_new(void);
+const char *fanout_engine(struct fanout *f);
+void fanout_add(struct fanout *f, int fd, const char *buf, int len);
+void fanout_flush(struct fanout *f);
+
+/* metrics.c - counters and histograms shared through /run/suspend/stats */
+enum { METRIC_COUNTER, METRIC_GAUGE, METRIC_HISTOGRAM };
+#define METRIC_BUCKETS	14
+struct metric {
+	char		name[96];	/* may include {labels} */
+	char		help[80];
+	uint32_t	type;
+	uint32_t	pad;
+	int64_t		value;		/* or count of observations */
+	int64_t		sum_us;
+	uint64_t	bucket[METRIC_BUCKETS];
+};
+int metrics_open(const char *component);
+struct metric *metric_new(const char *name, const char *help, int type);
+void metric_add(struct metric *m, int64_t v);
+void metric_set(struct metric *m, int64_t v);
+void metric_observe(struct metric *m, double ms);
+double metric_ms(struct timespec *from);
+void metrics_export(FILE *f);
+
+/* trace.c - binary event rings in /run/suspend/trace */
+#define TRACE_DIR	"/run/suspend/trace"
+#define TRACE_MAGIC	"SUSTRC1"
+#define TRACE_RECS	4096
+enum {
+	TR_START, TR_REQUEST, TR_BLOCKED, TR_ALERT, TR_COUNT,
+	TR_SUSPEND, TR_RESUME, TR_ABORT,			/* lsusd */
+	TR_CHECK, TR_SEND, TR_REPLY, TR_READY, TR_AWAKE,	/* lsused */
+	TR_ALARM_SET, TR_ALARM_FIRE, TR_RTC,			/* wakealarmd */
+	TR_EXIT, TR_RESTART,					/* susman */
+	TR_WAKE, TR_POLICY, TR_AUTOSLEEP,			/* lsusd */
+	TR_LEASE, TR_RELEASE,					/* leased */
+	TR_HOOK,						/* lsusd */
+	TR_ALARM_CLEAR,						/* wakealarmd */
+	TR_CLIENT_BLOCK, TR_CLIENT_ALLOW, TR_CLIENT_WAKE,	/* libsus */
+	TR_MAX
+};
+struct trace_rec {
+	uint64_t	seq;		/* index + 1, 0 while being written */
+	uint64_t	ns;		/* CLOCK_BOOTTIME */
+	int32_t		pid;
+	int32_t		event;
+	int64_t		a, b;
+};
+struct tracering {
+	char		magic[8];
+	uint64_t	head;		/* records ever written */
+	char		pad[48];
+	struct trace_rec rec[TRACE_RECS];
+};
+/* 'a' for TR_ABORT */
+enum { AB_BLOCKED = 1, AB_CANCELLED, AB_READ, AB_COUNT, AB_KERNEL };
+extern const char *trace_names[TR_MAX];
+struct tracering *trace_map(const char *path, int create);
+void trace_open(const char *component);
+void trace(int event, int64_t a, int64_t b);
+int trace_read(struct tracering *ring, int i, struct trace_rec *r);
+
+/* record.c - libsus clients' part of /run/suspend/record */
+#define RECORD_DIR	"/run/suspend/record"
+#define RECORD_MAX	(64 << 20)	/* bytes per file */
+int sus_recording(void);
+void sus_record(int event, int64_t a, int64_t b);
+
+/* wakeup.c - attribute each resume to kernel wakeup sources */
+void wakeup_before(void);
+int wakeup_after(void);
+
+/* policy.c - is a suspend now worth it?  Times are in msec. */
+struct policy {
+	double		alpha;		/* weight of each new sample */
+	double		min_ms;		/* least break-even time */
+	double		ratio;		/* break-even / suspend cost */
+	double		sleep_ms;	/* average idle period */
+	double		cost_ms;	/* average suspend+resume time */
+	double		predicted;	/* at the last decision */
+	double		breakeven;
+	unsigned long	decisions, suspends, deferrals, alarm_limited;
+	unsigned long	samples;	/* suspends measured */
+	unsigned long	short_sleeps;	/* slept less than break-even */
+	double		err_sum_ms;	/* of |actual - predicted| */
+	double		last_err_ms;
+};
+void policy_init(struct policy *p);
+void policy_parse(struct policy *p, const char *conf);
+long policy_decide(struct policy *p, double alarm_ms);
+void policy_idle(struct policy *p, double ms, int ended);
+void policy_slept(struct policy *p, double slept_ms, double cost_ms);
+
+/* sysfs.c - /sys, or the fake tree named by SUSMAN_SYSFS */
+const char *sys_path(const char *path);
+int sys_write(const char *path, const char *val);
+long long sys_read_num(const char *path);
+
+/* locks.c - who holds locks on the files in /run/suspend */
+#define LOCK_FILES	3	/* disabled, watching, watching-next */
+struct lock_holder {
+	int		file;		/* index in lock_files */
+	pid_t		pid;
+	int		write;		/* exclusive */
+	int		waiting;	/* not granted yet */
+	int		count;		/* locks like this */
+	int		seen;		/* in the latest scan */
+	time_t		since;		/* first seen */
+	char		comm[16];
+};
+extern const char *lock_files[LOCK_FILES];
+struct lock_holder *locks_get(int *n);
+int locks_blockers(void);
+void locks_report(FILE *f);
+
+/* hooks.c - run hooks.d before suspend and after resume */
+enum { HOOK_SUSPEND, HOOK_RESUME };
+void hooks_start(int phase);
+int hooks_finish(void);
+int hooks_run(int phase);
+int hooks_present(void);
+
+/* autosleep.c - leave the suspend loop to the kernel */
+int autosleep_enabled(void);
+void autosleep_reset(void);
+int autosleep_run(int disable, int (*wanted)(void));
@@ -18,21 +18,36 @@
 #    with this program; if not, write to the Free Software Foundation, Inc.,
 #    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 
-import dnotify, fcntl, os
+import fcntl, os, socket
 
-lock_watcher = None
+lock_watcher = None     # dnotify, shared by the default monitors
+poll_watcher = None     # inotify, for poll=True
 
 class monitor:
-    def __init__(self, suspend_callback, resume_callback):
+    def __init__(self, suspend_callback, resume_callback, poll = False):
         """
         Arrange that suspend_callback is called before we suspend, and
         resume_callback is called when we resume.
         If suspend_callback returns False, it must have arranged for
         'release' to be called soon to allow suspend to continue.
+        By default the callbacks are made from dnotify's SIGIO handler.
+        With poll=True no signals are used: callbacks are only made
+        from handle(), which must be called whenever fileno() is
+        readable.
         """
-        global lock_watcher
-        if not lock_watcher:
-            lock_watcher = dnotify.dir('/run/suspend')
+        global lock_watcher, poll_watcher
+        # Imported here: dnotify.py is Python 2 only
+        if poll:
+            if not poll_watcher:
+                import inotify
+                poll_watcher = inotify.dir('/run/suspend')
+            self.watcher = poll_watcher
+        else:
+            if not lock_watcher:
+                import dnotify
+                lock_watcher = dnotify.dir('/run/suspend')
+            self.watcher = lock_watcher
+        self.poll = poll
 
         self.f = open('/run/suspend/watching', 'r')
         self.getlock()
@@ -44,7 +59,7 @@ class monitor:
         self.suspended = False
         self.suspend = suspend_callback
         self.resume = resume_callback
-        self.watch = lock_watcher.watch("watching", self.change)
+        self.watch = self.watcher.watch("watching", self.change)
         self.immediate_fd = None
 
     def getlock(self):
@@ -57,15 +72,22 @@ class monitor:
             except IOError:
                 pass
 
+    def fileno(self):
+        # Only with poll=True
+        return self.watcher.fileno()
+
+    def handle(self):
+        if self.poll:
+            self.watcher.handle()
+
     def change(self, watched):
         if self.suspended:
             # resume has happened if watching-next has been renamed.
             if (os.fstat(self.f.fileno()).st_ino ==
                 os.stat('/run/suspend/watching').st_ino):
-                global lock_watcher
                 self.suspended = False
                 self.watch.cancel()
-                self.watch = lock_watcher.watch("watching", self.change)
+                self.watch = self.watcher.watch("watching", self.change)
                 if self.resume:
                     self.resume()
             else:
@@ -78,13 +100,12 @@ class monitor:
 
     def release(self):
         # ready for suspend
-        global lock_watcher
         old = self.f
         self.f = open('/run/suspend/watching-next', 'r')
         self.getlock()
         self.suspended = True
         self.watch.cancel()
-        self.watch = lock_watcher.watch("watching-next", self.change)
+        self.watch = self.watcher.watch("watching-next", self.change)
         fcntl.flock(old, fcntl.LOCK_UN)
         old.close()
 
@@ -116,6 +137,23 @@ class blocker:
     def abort(self):
         self.blockfd.read(1)
 
+class lease:
+    # A named lease from leased: suspend is blocked until release(),
+    # or until 'timeout' msec pass, when fileno() becomes readable.
+    def __init__(self, name, timeout = 0):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.connect('/run/suspend/lease')
+        self.sock.sendall('L %s %d\n' % (name, timeout))
+        if self.sock.recv(3) != 'OK\n':
+            self.sock.close()
+            raise IOError('lease refused')
+    def fileno(self):
+        return self.sock.fileno()
+    def release(self):
+        if self.sock:
+            self.sock.close()
+            self.sock = None
+
 
 def abort_cycle():
     fd = open('/run/suspend/disabled')
@@ -123,10 +161,19 @@ def abort_cycle():
     fd.close()
 
 if __name__ == '__main__':
-    import signal
-    def sus(): print "Suspending"; return True
-    def res(): print "Resuming"
-    monitor(sus, res)
-    print "ready"
-    while True:
-        signal.pause()
+    import sys
+    def sus(): print("Suspending"); return True
+    def res(): print("Resuming")
+    if sys.argv[1:] == ['poll']:
+        import select
+        m = monitor(sus, res, poll = True)
+        print("ready")
+        while True:
+            select.select([m], [], [])
+            m.handle()
+    else:
+        import signal
+        monitor(sus, res)
+        print("ready")
+        while True:
+            signal.pause()
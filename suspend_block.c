@@ -1,6 +1,11 @@
 /*
  * Library routine to block and re-enable suspend.
  *
+ * If 'disabled' is locked exclusively, either a suspend is under way
+ * or lsusd has left suspending to the kernel (see autosleep.c).  In
+ * the second case lsusd only lets go when it sees the file opened,
+ * so we "knock" by opening it before waiting for our lock.
+ *
  * Copyright (C) 2011 Neil Brown <neilb@suse.de>
  *
  *    This program is free software; you can redistribute it and/or modify
@@ -22,12 +27,24 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include "libsus.h"
+#include "susman.h"
+
+/* Handles we hold a lock on, so a close can be recorded as an allow */
+static unsigned char held[1024];
 
 int suspend_open()
 {
 	return open("/run/suspend/disabled", O_RDONLY|O_CLOEXEC);
 }
 
+static void knock(void)
+{
+	int fd = suspend_open();
+
+	if (fd >= 0)
+		close(fd);
+}
+
 int suspend_block(int handle)
 {
 	if (handle < 0)
@@ -35,17 +52,32 @@ int suspend_block(int handle)
 	if (handle < 0)
 		return handle;
 
-	flock(handle, LOCK_SH);
+	if (flock(handle, LOCK_SH|LOCK_NB) != 0) {
+		knock();
+		flock(handle, LOCK_SH);
+	}
+	if (sus_recording() && handle < sizeof(held)) {
+		held[handle] = 1;
+		sus_record(TR_CLIENT_BLOCK, handle, 0);
+	}
 	return handle;
 }
 
 void suspend_allow(int handle)
 {
 	flock(handle, LOCK_UN);
+	if (handle >= 0 && handle < sizeof(held) && held[handle]) {
+		held[handle] = 0;
+		sus_record(TR_CLIENT_ALLOW, handle, 0);
+	}
 }
 
 int suspend_close(int handle)
 {
+	if (handle >= 0 && handle < sizeof(held) && held[handle]) {
+		held[handle] = 0;
+		sus_record(TR_CLIENT_ALLOW, handle, 0);
+	}
 	if (handle >= 0)
 		close(handle);
 }
@@ -57,6 +89,8 @@ void suspend_abort(int handle)
 	if (handle < 0)
 		h = suspend_open();
 	read(h, &c, 1);
+	if (handle >= 0)
+		knock();
 	if (handle < 0)
 		suspend_close(h);
 }
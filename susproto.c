@@ -0,0 +1,199 @@
+/*
+ * susproto - the binary protocol spoken on the SOCK_SEQPACKET sockets.
+ *
+ * lsused and wakealarmd each listen on a SOCK_SEQPACKET socket as well
+ * as their SOCK_STREAM one.  Every datagram is a struct susp_hdr
+ * followed by 'count' struct susp_msg, all fixed size, so a datagram
+ * is checked with one comparison of its length and needs no framing
+ * of its own: a read is always exactly one datagram, never part of
+ * one or two run together.  A client can send several requests (and
+ * fds for lsused) in one datagram and gets all the replies to them
+ * in one datagram.
+ *
+ * A connection starts with SUSP_HELLO offering the SUSP_CAP_*
+ * capabilities the client wants; the reply grants those the daemon
+ * has.  The version is in every header.  A message the daemon
+ * doesn't understand gets SUSP_ERROR with the same id.  Datagrams
+ * with the wrong magic, version or length are refused with EPROTO.
+ *
+ * Values are in host byte order: these are local sockets.
+ *
+ * Copyright (C) 2011 Neil Brown <neilb@suse.de>
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <event.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "libsus.h"
+
+/* Returns a connected (blocking) socket, or -1 */
+int susp_connect(const char *path)
+{
+	struct sockaddr_un addr;
+	int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+	if (sock < 0)
+		return -1;
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+void susp_init(struct susp_frame *f)
+{
+	f->hdr.magic = SUSP_MAGIC;
+	f->hdr.version = SUSP_VERSION;
+	f->hdr.count = 0;
+}
+
+/* Returns -1 if the frame is full */
+int susp_add(struct susp_frame *f, int op, uint32_t id, int64_t arg)
+{
+	struct susp_msg *m;
+
+	if (f->hdr.count >= SUSP_BATCH)
+		return -1;
+	m = &f->msg[f->hdr.count++];
+	m->op = op;
+	m->flags = 0;
+	m->id = id;
+	m->arg = arg;
+	return 0;
+}
+
+int susp_len(const struct susp_frame *f)
+{
+	return sizeof(f->hdr) + f->hdr.count * sizeof(f->msg[0]);
+}
+
+/* Encode a datagram of just one message into 'buf', which must
+ * have room for SUSP_ONE bytes.  Returns the length.
+ */
+int susp_one(void *buf, int op, uint32_t id, int64_t arg)
+{
+	struct susp_frame *f = buf;
+
+	susp_init(f);
+	susp_add(f, op, id, arg);
+	return SUSP_ONE;
+}
+
+/* Returns the number of messages in a datagram of 'len' bytes, or
+ * -1 if it isn't one of ours.
+ */
+int susp_parse(const void *buf, int len)
+{
+	const struct susp_hdr *h = buf;
+
+	if (len < (int)sizeof(*h) ||
+	    h->magic != SUSP_MAGIC || h->version != SUSP_VERSION ||
+	    h->count > SUSP_BATCH ||
+	    len != (int)(sizeof(*h) + h->count * sizeof(struct susp_msg)))
+		return -1;
+	return h->count;
+}
+
+/* Send the frame, and 'fds' with it, then empty it.  Returns 0 or -1 */
+int susp_send(int sock, struct susp_frame *f, const int *fds, int nfds)
+{
+	char cbuf[CMSG_SPACE(SUSP_MAXFDS * sizeof(int))];
+	struct msghdr msg = {0};
+	struct iovec iov;
+	int len = susp_len(f);
+	int n;
+
+	if (nfds > SUSP_MAXFDS) {
+		errno = EINVAL;
+		return -1;
+	}
+	iov.iov_base = f;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (nfds > 0) {
+		struct cmsghdr *cm;
+		msg.msg_control = cbuf;
+		msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		cm = CMSG_FIRSTHDR(&msg);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cm), fds, nfds * sizeof(int));
+	}
+	n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	f->hdr.count = 0;
+	return n == len ? 0 : -1;
+}
+
+/* Receive one datagram into 'f'.  Any fds with it are stored in
+ * 'fds' (room for SUSP_MAXFDS) and counted in *nfds, if 'fds' is
+ * given, and otherwise closed.  Returns the number of messages, 0 at
+ * end of file, or -1 with errno set (EPROTO for a bad datagram).
+ */
+int susp_recv(int sock, struct susp_frame *f, int *fds, int *nfds)
+{
+	char cbuf[CMSG_SPACE(SUSP_MAXFDS * sizeof(int))];
+	struct msghdr msg = {0};
+	struct cmsghdr *cm;
+	struct iovec iov;
+	int got = 0;
+	int n;
+
+	iov.iov_base = f;
+	iov.iov_len = sizeof(*f);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	if (n <= 0)
+		return n;
+	for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+		int *p = (int *)CMSG_DATA(cm);
+		int i, cnt;
+		if (cm->cmsg_level != SOL_SOCKET ||
+		    cm->cmsg_type != SCM_RIGHTS)
+			continue;
+		cnt = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < cnt; i++)
+			if (fds && got < SUSP_MAXFDS)
+				fds[got++] = p[i];
+			else
+				close(p[i]);
+	}
+	if (nfds)
+		*nfds = got;
+	n = (msg.msg_flags & MSG_TRUNC) ? -1 : susp_parse(f, n);
+	if (n <= 0) {
+		while (got > 0)
+			close(fds[--got]);
+		if (nfds)
+			*nfds = 0;
+		errno = EPROTO;
+		return -1;
+	}
+	return n;
+}
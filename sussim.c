@@ -0,0 +1,967 @@
+/*
+ * sussim - simulate a day of suspend and resume in a fraction of a second.
+ *
+ * A deterministic discrete-event model of lsusd, lsused and
+ * wakealarmd in virtual time.  Nothing touches /sys or the RTC:
+ * suspend and resume and what they cost, the kernel's wakeup_count,
+ * the RTC alarm and all the clients are simulated.  Each source of
+ * client activity has its own random stream seeded from '-s', so a
+ * given seed always gives the same run and the same workload is
+ * seen whatever the policy settings.  Autosuspend decisions are made
+ * by the real policy.c.
+ *
+ * The model follows lsusd's loop.  An attempt waits while anything
+ * holds 'disabled' (a blocker, or a client handling an alarm), asks
+ * the policy, then alerts the watchers: lsused sends 'S' to clients
+ * with a readable fd and waits for their 'R', and wakealarmd blocks
+ * suspend if an alarm is due within 4 seconds.  It then aborts if a
+ * blocker appeared or wakeup_count moved, and otherwise suspends.  A
+ * wake event or a due alarm during entry makes the kernel refuse.
+ * Asleep, only a wake event or the RTC (the next alarm) wakes us.
+ * Processes are frozen from entry until resume completes, so blockers
+ * and alarms due then are seen after it, and an alarm's lateness is
+ * measured from when it was due.
+ *
+ * With -r, the client activity comes instead from what was recorded
+ * in that directory (see trace.c and record.c): the blocks and
+ * allows and wake fd callbacks of libsus clients, the alarms set and
+ * cleared in wakealarmd, and wakeups which resumed the system other
+ * than for an alarm.  What actually happened while recording is
+ * reported first, then how the simulated stack handled the same
+ * activity, so the effect of a policy or cost setting on a real
+ * workload can be seen.  The synthetic sources default to off, but
+ * can be added on top.
+ *
+ * Usage: sussim [-v] [-s seed] [-r dir] [key=value ...]
+ *   hours=24		length of the run (default for -r: the recording)
+ *   blockers=60	blockers per hour, each holding for about
+ *   block_ms=3000
+ *   wakes=30		wake fd events per hour, each handled in about
+ *   handle_ms=200
+ *   alarms=3		clients with a repeating alarm every about
+ *   period_s=900	and holding suspend for about
+ *   alarm_ms=500
+ *   suspend_ms=300	time to enter and leave suspend, +/- 20%
+ *   resume_ms=700
+ *   policy=1		0 suspends whenever nothing blocks
+ *   min_ms, ratio, alpha	as in /run/suspend/autosuspend
+ * -v prints each simulated event.
+ *
+ * Copyright (C) 2011 Neil Brown <neilb@suse.de>
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <math.h>
+#include <sys/stat.h>
+#include "susman.h"
+
+#define WATCH_MS	10	/* for watchers to move their locks */
+#define ALARM_NEAR	4000	/* wakealarmd won't suspend this close */
+#define RTC_WAKE_MS	5000	/* alarm this soon after a resume: RTC woke us */
+
+typedef long long msec;
+
+enum { EV_END, EV_LSUSD, EV_BLOCK, EV_UNBLOCK, EV_WAKE, EV_ALARM,
+       EV_ALARM_DONE, EV_ALARM_ADD, EV_ALARM_DROP };
+
+struct ev {
+	msec		at;
+	unsigned long	seq;		/* ties go in the order queued */
+	int		type;
+	int		arg;		/* alarm slot, lsusd generation, or 1
+					 * for a recorded block or wake */
+	msec		due;		/* when it first happened */
+	msec		len;		/* how long it blocks suspend */
+};
+
+/* What lsusd is doing */
+enum { L_CHECK, L_BLOCKED, L_WAITING, L_ALERT, L_ENTRY, L_ASLEEP,
+       L_RESUME };
+
+static struct {
+	double	hours, blockers, block_ms, wakes, handle_ms;
+	double	alarms, period_s, alarm_ms, suspend_ms, resume_ms, policy;
+} cf = { 24, 60, 3000, 30, 200, 3, 900, 500, 300, 700, 1 };
+
+static struct key {
+	const char	*name;
+	double		*val;
+} keys[] = {
+	{ "hours", &cf.hours },		{ "blockers", &cf.blockers },
+	{ "block_ms", &cf.block_ms },	{ "wakes", &cf.wakes },
+	{ "handle_ms", &cf.handle_ms },	{ "alarms", &cf.alarms },
+	{ "period_s", &cf.period_s },	{ "alarm_ms", &cf.alarm_ms },
+	{ "suspend_ms", &cf.suspend_ms }, { "resume_ms", &cf.resume_ms },
+	{ "policy", &cf.policy },
+	{ "min_ms", NULL }, { "ratio", NULL }, { "alpha", NULL },
+	{ NULL }
+};
+
+/* Random streams */
+enum { R_BLOCK, R_WAKE, R_COST, R_ALARM };
+static uint64_t *rng;
+
+static struct ev *heap, *deferred;
+static int nheap, heapsize, ndeferred, defsize;
+static unsigned long seqno, nevents;
+
+static msec now, end;
+static int verbose;
+static int state;
+static int gen;				/* of the one pending EV_LSUSD */
+static int blockers, holds;		/* on 'disabled' */
+static int near_hold;			/* wakealarmd's, for a close alarm */
+static msec readable_until;		/* some wake fd is readable */
+static unsigned long wakeup_count, count_at_alert;
+static int entry_refused, woke_ok;
+static msec blocked_since, asleep_since, request_at, slept, cost;
+static msec idle_since = -1;
+static struct policy policy;
+
+/* Alarm slots: the synthetic clients first, then recorded alarms.
+ * alarm_due is -1 for a slot with nothing pending; 'live' lists the
+ * others so finding the next alarm doesn't scan the whole recording.
+ */
+static msec *alarm_due;
+static int *live, *livepos, nlive, nslots, slotsize;
+
+struct samples {
+	msec		*v;
+	unsigned long	n, size;
+};
+
+struct result {
+	msec		span, asleep;
+	unsigned long	suspends, aborts[AB_KERNEL + 1];
+	struct samples	entry, late;
+};
+static struct result sim, rec;
+static unsigned long attempts, by_alarm, by_fd;
+
+static const char *reasons[] = {
+	[AB_BLOCKED]	= "blocked",
+	[AB_CANCELLED]	= "cancelled",
+	[AB_READ]	= "read",
+	[AB_COUNT]	= "wakeup_count",
+	[AB_KERNEL]	= "kernel",
+};
+
+/* xorshift64*, one state per stream */
+static double uniform(int stream)
+{
+	uint64_t x = rng[stream];
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	rng[stream] = x;
+	return ((x * 2685821657736338717ULL) >> 11) / 9007199254740992.0;
+}
+
+static msec expo(int stream, double mean)
+{
+	return -mean * log(1 - uniform(stream));
+}
+
+static msec jitter(int stream, double v)
+{
+	return v * (0.8 + 0.4 * uniform(stream));
+}
+
+static void sample(struct samples *s, msec v)
+{
+	if (s->n >= s->size) {
+		s->size = s->size ? s->size * 2 : 256;
+		s->v = realloc(s->v, s->size * sizeof(msec));
+		if (!s->v)
+			exit(2);
+	}
+	s->v[s->n++] = v;
+}
+
+static void say(int event, const char *fmt, ...)
+{
+	va_list ap;
+	msec t = now;
+
+	if (!verbose)
+		return;
+	printf("%02lld:%02lld:%02lld.%03lld %-16s ", t / 3600000,
+	       t / 60000 % 60, t / 1000 % 60, t % 1000,
+	       event >= 0 ? trace_names[event] : "");
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	putchar('\n');
+}
+
+static int before(struct ev *a, struct ev *b)
+{
+	if (a->at != b->at)
+		return a->at < b->at;
+	return a->seq < b->seq;
+}
+
+static void push(msec at, int type, int arg, msec due, msec len)
+{
+	struct ev e = { at, seqno++, type, arg, due, len };
+	int i;
+
+	if (nheap >= heapsize) {
+		heapsize = heapsize ? heapsize * 2 : 64;
+		heap = realloc(heap, heapsize * sizeof(*heap));
+		if (!heap)
+			exit(2);
+	}
+	for (i = nheap++; i > 0 && before(&e, &heap[(i-1)/2]); i = (i-1)/2)
+		heap[i] = heap[(i-1)/2];
+	heap[i] = e;
+}
+
+static struct ev pop(void)
+{
+	struct ev top = heap[0], last = heap[--nheap];
+	int i = 0, c;
+
+	while ((c = 2*i + 1) < nheap) {
+		if (c + 1 < nheap && before(&heap[c+1], &heap[c]))
+			c++;
+		if (!before(&heap[c], &last))
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = last;
+	return top;
+}
+
+/* Processes are frozen; it happens after the resume */
+static void defer(struct ev *e)
+{
+	if (ndeferred >= defsize) {
+		defsize = defsize ? defsize * 2 : 16;
+		deferred = realloc(deferred, defsize * sizeof(*deferred));
+		if (!deferred)
+			exit(2);
+	}
+	deferred[ndeferred++] = *e;
+}
+
+/* Run lsusd's next step in 'ms' */
+static void after(msec ms)
+{
+	push(now + ms, EV_LSUSD, ++gen, now + ms, 0);
+}
+
+static int new_slot(void)
+{
+	if (nslots >= slotsize) {
+		slotsize = slotsize ? slotsize * 2 : 64;
+		alarm_due = realloc(alarm_due, slotsize * sizeof(msec));
+		live = realloc(live, slotsize * sizeof(int));
+		livepos = realloc(livepos, slotsize * sizeof(int));
+		if (!alarm_due || !live || !livepos)
+			exit(2);
+	}
+	alarm_due[nslots] = -1;
+	return nslots++;
+}
+
+static void alarm_arm(int slot, msec due)
+{
+	if (alarm_due[slot] < 0) {
+		livepos[slot] = nlive;
+		live[nlive++] = slot;
+	}
+	alarm_due[slot] = due;
+}
+
+static void alarm_disarm(int slot)
+{
+	int p = livepos[slot];
+
+	if (alarm_due[slot] < 0)
+		return;
+	live[p] = live[--nlive];
+	livepos[live[p]] = p;
+	alarm_due[slot] = -1;
+}
+
+static msec next_alarm(void)
+{
+	msec next = -1;
+	int i;
+
+	for (i = 0; i < nlive; i++)
+		if (next < 0 || alarm_due[live[i]] < next)
+			next = alarm_due[live[i]];
+	return next;
+}
+
+static long sim_policy(void)
+{
+	msec next = next_alarm();
+	double alarm_ms = -1;
+	long wait;
+
+	if (next >= 0)
+		alarm_ms = next > now ? next - now : 0;
+	if (idle_since < 0)
+		idle_since = now;
+	else
+		policy_idle(&policy, now - idle_since, 0);
+	wait = policy_decide(&policy, alarm_ms);
+	say(TR_POLICY, "predict %.0fms, break-even %.0fms%s",
+	    policy.predicted, policy.breakeven, wait ? ", waiting" : "");
+	return wait;
+}
+
+static void sim_abort(int why)
+{
+	sim.aborts[why]++;
+	say(TR_ABORT, "%s", reasons[why]);
+}
+
+/* The top of lsusd's loop */
+static void check(void)
+{
+	msec next;
+	long wait;
+
+	request_at = now;
+	if (blockers || holds) {
+		sim_abort(AB_BLOCKED);
+		if (idle_since >= 0) {
+			policy_idle(&policy, now - idle_since, 1);
+			idle_since = -1;
+		}
+		state = L_BLOCKED;
+		blocked_since = now;
+		return;
+	}
+	if (cf.policy && (wait = sim_policy()) != 0) {
+		state = L_WAITING;
+		after(wait);
+		return;
+	}
+	attempts++;
+	count_at_alert = wakeup_count;
+	say(TR_COUNT, "%lu", wakeup_count);
+	say(TR_ALERT, "");
+	state = L_ALERT;
+	next = next_alarm();
+	if (next >= 0 && next <= now + ALARM_NEAR && !near_hold) {
+		/* Until that alarm has been handled */
+		near_hold = 1;
+		holds++;
+	}
+	if (readable_until > now + WATCH_MS) {
+		say(TR_SEND, "waiting %lldms for 'R'", readable_until - now);
+		after(readable_until - now);
+	} else
+		after(WATCH_MS);
+}
+
+static void unblocked(void)
+{
+	if (state != L_BLOCKED || blockers || holds)
+		return;
+	say(TR_BLOCKED, "waited %lldms", now - blocked_since);
+	state = L_CHECK;
+	after(0);
+}
+
+static void lsusd_step(void)
+{
+	int i;
+
+	switch (state) {
+	case L_CHECK:
+	case L_WAITING:
+		check();
+		break;
+	case L_ALERT:
+		state = L_CHECK;
+		if (blockers || holds)
+			sim_abort(AB_BLOCKED);
+		else if (wakeup_count != count_at_alert)
+			sim_abort(AB_COUNT);
+		else {
+			say(TR_SUSPEND, "wakeup_count %lu", wakeup_count);
+			sample(&sim.entry, now - request_at);
+			state = L_ENTRY;
+			entry_refused = 0;
+			cost = jitter(R_COST, cf.suspend_ms);
+			after(cost);
+			break;
+		}
+		after(0);
+		break;
+	case L_ENTRY:
+		if (entry_refused) {
+			sim_abort(AB_KERNEL);
+			woke_ok = 0;
+			state = L_RESUME;
+			after(jitter(R_COST, cf.resume_ms));
+			break;
+		}
+		state = L_ASLEEP;
+		asleep_since = now;
+		break;
+	case L_RESUME:
+		say(TR_RESUME, woke_ok ? "ok" : "failed");
+		idle_since = -1;
+		if (woke_ok) {
+			sim.suspends++;
+			policy_slept(&policy, slept, cost);
+		}
+		/* Thawed: everything that waited happens now */
+		for (i = 0; i < ndeferred; i++)
+			push(now, deferred[i].type, deferred[i].arg,
+			     deferred[i].due, deferred[i].len);
+		ndeferred = 0;
+		state = L_CHECK;
+		after(0);
+		break;
+	}
+}
+
+/* A wake event or the RTC while suspended */
+static void wake(struct ev *e, const char *why)
+{
+	msec r;
+
+	slept = now - asleep_since;
+	sim.asleep += slept;
+	if (e->type == EV_ALARM)
+		by_alarm++;
+	else
+		by_fd++;
+	say(TR_WAKE, "%s after %lldms", why, slept);
+	r = jitter(R_COST, cf.resume_ms);
+	cost += r;
+	woke_ok = 1;
+	state = L_RESUME;
+	after(r);
+}
+
+static int frozen(void)
+{
+	return state == L_ENTRY || state == L_ASLEEP || state == L_RESUME;
+}
+
+static void alarm_fire(struct ev *e)
+{
+	int i = e->arg;
+
+	say(TR_ALARM_FIRE, "slot %d, %lldms late", i, now - e->due);
+	sample(&sim.late, now - e->due);
+	holds++;
+	push(now + e->len, EV_ALARM_DONE, i, now + e->len, 0);
+	if (near_hold) {
+		near_hold = 0;
+		holds--;
+	}
+	if (i >= (int)cf.alarms) {
+		/* Recorded: the recording says when it is set again */
+		alarm_disarm(i);
+		return;
+	}
+	/* The client asks again, for its next period */
+	alarm_due[i] = e->due + jitter(R_ALARM + i, cf.period_s * 1000);
+	while (alarm_due[i] <= now)
+		alarm_due[i] += cf.period_s * 1000;
+	push(alarm_due[i], EV_ALARM, i, alarm_due[i],
+	     expo(R_ALARM + i, cf.alarm_ms));
+	say(TR_ALARM_SET, "slot %d, in %lldms", i, alarm_due[i] - now);
+}
+
+static void event(struct ev *e)
+{
+	switch (e->type) {
+	case EV_LSUSD:
+		if (e->arg == gen)
+			lsusd_step();
+		break;
+	case EV_BLOCK:
+		/* due < 0: just arrived, rather than after a resume */
+		if (e->due < 0) {
+			if (!e->arg)
+				push(now + expo(R_BLOCK, 3600000 / cf.blockers),
+				     EV_BLOCK, 0, -1,
+				     expo(R_BLOCK, cf.block_ms));
+			e->due = now;
+		}
+		if (frozen()) {
+			defer(e);
+			break;
+		}
+		blockers++;
+		say(-1, "blocker for %lldms", e->len);
+		push(now + e->len, EV_UNBLOCK, 0, now + e->len, 0);
+		break;
+	case EV_UNBLOCK:
+		blockers--;
+		unblocked();
+		break;
+	case EV_ALARM_DONE:
+		holds--;
+		unblocked();
+		break;
+	case EV_WAKE:
+		if (e->due < 0) {
+			if (!e->arg)
+				push(now + expo(R_WAKE, 3600000 / cf.wakes),
+				     EV_WAKE, 0, -1,
+				     expo(R_WAKE, cf.handle_ms));
+			e->due = now;
+			wakeup_count++;
+		}
+		if (state == L_ENTRY)
+			entry_refused = 1;
+		if (state == L_ASLEEP)
+			wake(e, "wake fd");
+		if (frozen()) {
+			defer(e);
+			break;
+		}
+		say(-1, "fd readable for %lldms", e->len);
+		if (now + e->len > readable_until)
+			readable_until = now + e->len;
+		break;
+	case EV_ALARM:
+		if (alarm_due[e->arg] != e->due)
+			break;		/* replaced or cleared */
+		if (state == L_ENTRY)
+			entry_refused = 1;
+		if (state == L_ASLEEP)
+			wake(e, "rtc");
+		if (frozen())
+			defer(e);
+		else
+			alarm_fire(e);
+		break;
+	case EV_ALARM_ADD:
+		alarm_arm(e->arg, e->due);
+		push(e->due, EV_ALARM, e->arg, e->due, e->len);
+		break;
+	case EV_ALARM_DROP:
+		alarm_disarm(e->arg);
+		if (near_hold) {
+			/* The client went away without waiting for it */
+			near_hold = 0;
+			holds--;
+			unblocked();
+		}
+		break;
+	}
+}
+
+/* Replay */
+
+struct rrec {
+	struct trace_rec	r;
+	int			client;
+};
+
+static int rrec_cmp(const void *a, const void *b)
+{
+	const struct rrec *x = a, *y = b;
+
+	if (x->r.ns != y->r.ns)
+		return x->r.ns < y->r.ns ? -1 : 1;
+	return x->client - y->client;
+}
+
+static struct rrec *read_records(const char *dirname, int *np)
+{
+	struct rrec *recs = NULL;
+	int n = 0, size = 0;
+	struct dirent *de;
+	DIR *dir = opendir(dirname);
+
+	if (!dir) {
+		perror(dirname);
+		exit(1);
+	}
+	while ((de = readdir(dir)) != NULL) {
+		char path[512];
+		struct trace_rec r;
+		int fd;
+
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dirname, de->d_name);
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			continue;
+		while (read(fd, &r, sizeof(r)) == sizeof(r)) {
+			if (r.event < 0 || r.event >= TR_MAX)
+				continue;
+			if (n >= size) {
+				size = size ? size * 2 : 4096;
+				recs = realloc(recs, size * sizeof(*recs));
+				if (!recs)
+					exit(2);
+			}
+			recs[n].r = r;
+			recs[n].client = strcmp(de->d_name, "clients") == 0;
+			n++;
+		}
+		close(fd);
+	}
+	closedir(dir);
+	qsort(recs, n, sizeof(*recs), rrec_cmp);
+	*np = n;
+	return recs;
+}
+
+static int is_daemon(int *pids, int npids, int pid)
+{
+	int i;
+
+	for (i = 0; i < npids; i++)
+		if (pids[i] == pid)
+			return 1;
+	return 0;
+}
+
+/* Turn the records into events, and tally what happened */
+static void load(const char *dirname)
+{
+	struct blk { int pid; int64_t fd; msec start; } *open_blk = NULL;
+	int nblk = 0, blksize = 0;
+	int *pids = NULL, npids = 0;
+	int fdslot[4096];
+	msec *slot_due = NULL;
+	struct rrec *recs;
+	int64_t offset = 0;
+	uint64_t t0;
+	msec request = -1, resumed = -1;
+	int n, i, j;
+
+	recs = read_records(dirname, &n);
+	if (n == 0) {
+		fprintf(stderr, "sussim: nothing recorded in %s\n", dirname);
+		exit(1);
+	}
+	for (i = 0; i < n; i++) {
+		struct trace_rec *r = &recs[i].r;
+		if (recs[i].client)
+			continue;
+		if (!is_daemon(pids, npids, r->pid)) {
+			pids = realloc(pids, (npids + 1) * sizeof(int));
+			pids[npids++] = r->pid;
+		}
+		if (r->event == TR_START && r->a && !offset)
+			offset = r->a;
+	}
+	for (i = 0; i < 4096; i++)
+		fdslot[i] = -1;
+	t0 = recs[0].r.ns;
+	rec.span = (recs[n-1].r.ns - t0) / 1000000;
+
+	for (i = 0; i < n; i++) {
+		struct trace_rec *r = &recs[i].r;
+		msec t = (r->ns - t0) / 1000000;
+		int fd = r->a, s;
+
+		if (resumed >= 0 && t > resumed + RTC_WAKE_MS) {
+			/* Something other than the RTC woke us */
+			push(resumed - cf.resume_ms, EV_WAKE, 1, -1, 0);
+			resumed = -1;
+		}
+		if (recs[i].client) {
+			/* lsused and wakealarmd use libsus too */
+			if (is_daemon(pids, npids, r->pid))
+				continue;
+			switch (r->event) {
+			case TR_CLIENT_BLOCK:
+				if (nblk >= blksize) {
+					blksize = blksize ? blksize * 2 : 16;
+					open_blk = realloc(open_blk, blksize *
+							   sizeof(*open_blk));
+				}
+				open_blk[nblk].pid = r->pid;
+				open_blk[nblk].fd = r->a;
+				open_blk[nblk++].start = t;
+				break;
+			case TR_CLIENT_ALLOW:
+				for (j = 0; j < nblk; j++)
+					if (open_blk[j].pid == r->pid &&
+					    open_blk[j].fd == r->a)
+						break;
+				if (j == nblk)
+					break;
+				push(open_blk[j].start, EV_BLOCK, 1, -1,
+				     t - open_blk[j].start);
+				open_blk[j] = open_blk[--nblk];
+				break;
+			case TR_CLIENT_WAKE:
+				push(t, EV_WAKE, 1, -1, r->b / 1000);
+				break;
+			}
+			continue;
+		}
+		switch (r->event) {
+		case TR_REQUEST:
+			request = t;
+			break;
+		case TR_SUSPEND:
+			if (request >= 0)
+				sample(&rec.entry, t - request);
+			break;
+		case TR_RESUME:
+			if (!r->a)
+				break;
+			rec.suspends++;
+			rec.asleep += r->b;
+			break;
+		case TR_WAKE:
+			if (resumed < 0)
+				resumed = t;
+			break;
+		case TR_ABORT:
+			if (r->a > 0 && r->a <= AB_KERNEL)
+				rec.aborts[r->a]++;
+			break;
+		case TR_ALARM_FIRE:
+			sample(&rec.late, (r->ns + offset) / 1000000
+			       - r->b * 1000);
+			if (resumed >= 0)
+				resumed = -1;	/* the RTC woke us */
+			break;
+		case TR_ALARM_SET:
+			if (!offset)
+				break;
+			if (fd >= 0 && fd < 4096 && fdslot[fd] >= 0 &&
+			    slot_due[fdslot[fd]] > t)
+				push(t, EV_ALARM_DROP, fdslot[fd], t, 0);
+			s = new_slot();
+			slot_due = realloc(slot_due, slotsize * sizeof(msec));
+			if (!slot_due)
+				exit(2);
+			slot_due[s] = r->b * 1000 - (int64_t)(t0 + offset)
+				/ 1000000;
+			if (fd >= 0 && fd < 4096)
+				fdslot[fd] = s;
+			push(t, EV_ALARM_ADD, s, slot_due[s],
+			     jitter(R_COST, cf.alarm_ms));
+			break;
+		case TR_ALARM_CLEAR:
+			if (fd >= 0 && fd < 4096 && fdslot[fd] >= 0) {
+				if (slot_due[fdslot[fd]] > t)
+					push(t, EV_ALARM_DROP, fdslot[fd],
+					     t, 0);
+				fdslot[fd] = -1;
+			}
+			break;
+		}
+	}
+	if (resumed >= 0)
+		push(resumed - cf.resume_ms, EV_WAKE, 1, -1, 0);
+	/* Still held when the recording stopped */
+	for (j = 0; j < nblk; j++)
+		push(open_blk[j].start, EV_BLOCK, 1, -1,
+		     rec.span - open_blk[j].start);
+	free(open_blk);
+	free(pids);
+	free(slot_due);
+	free(recs);
+}
+
+/* Report */
+
+static int msec_cmp(const void *a, const void *b)
+{
+	msec x = *(const msec *)a, y = *(const msec *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static msec pct(struct samples *s, int p)
+{
+	return s->v[((s->n - 1) * p + 99) / 100];
+}
+
+static void summary(const char *what, struct result *r)
+{
+	msec awake = r->span - r->asleep;
+	double sum = 0;
+	unsigned long i, late = 0;
+	int a;
+
+	if (r->span >= 3600000)
+		printf("%-9s %.1fh", what, r->span / 3600000.0);
+	else
+		printf("%-9s %.1fs", what, r->span / 1000.0);
+	printf(": awake %.2fh (%.1f%%), asleep %.2fh, %lu suspends\n",
+	       awake / 3600000.0, awake * 100.0 / r->span,
+	       r->asleep / 3600000.0, r->suspends);
+	printf("aborts   ");
+	for (a = AB_BLOCKED; a <= AB_KERNEL; a++)
+		if (r->aborts[a] || a == AB_BLOCKED || a == AB_COUNT ||
+		    a == AB_KERNEL)
+			printf(" %s %lu", reasons[a], r->aborts[a]);
+	putchar('\n');
+	if (r->entry.n) {
+		qsort(r->entry.v, r->entry.n, sizeof(msec), msec_cmp);
+		printf("entry     p50 %lldms, p99 %lldms, max %lldms\n",
+		       pct(&r->entry, 50), pct(&r->entry, 99),
+		       pct(&r->entry, 100));
+	}
+	if (r->late.n) {
+		for (i = 0; i < r->late.n; i++) {
+			sum += r->late.v[i];
+			if (r->late.v[i] > 0)
+				late++;
+		}
+		qsort(r->late.v, r->late.n, sizeof(msec), msec_cmp);
+		printf("alarms    %lu, %lu late: mean %.0fms, p99 %lldms, "
+		       "max %lldms\n", r->late.n, late, sum / r->late.n,
+		       pct(&r->late, 99), pct(&r->late, 100));
+	}
+}
+
+static void report(double secs, unsigned long seed, const char *dir)
+{
+	if (dir) {
+		summary("recorded", &rec);
+		putchar('\n');
+		printf("replayed %s in %.3fs (%lu events)\n", dir, secs,
+		       nevents);
+	} else
+		printf("seed %lu, %lu events in %.3fs\n", seed, nevents,
+		       secs);
+	summary("simulated", &sim);
+	printf("attempts  %lu, woken by rtc %lu, wake fd %lu\n",
+	       attempts, by_alarm, by_fd);
+	if (cf.policy)
+		printf("policy    %lu decisions, %lu deferred, %lu short "
+		       "sleeps, mean error %.1fs\n", policy.decisions,
+		       policy.deferrals, policy.short_sleeps,
+		       policy.samples ? policy.err_sum_ms / policy.samples
+		       / 1000 : 0.0);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: sussim [-v] [-s seed] [-r dir] [key=value ...]\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long seed = 1;
+	const char *dir = NULL;
+	int hours_set = 0;
+	struct timespec start;
+	int opt, i;
+
+	policy_init(&policy);
+	while ((opt = getopt(argc, argv, "vs:r:")) != -1)
+		switch (opt) {
+		case 'v':
+			verbose = 1;
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			dir = optarg;
+			cf.blockers = cf.wakes = cf.alarms = 0;
+			break;
+		default:
+			usage();
+		}
+	for (; optind < argc; optind++) {
+		char *eq = strchr(argv[optind], '=');
+		struct key *k;
+
+		for (k = keys; k->name; k++)
+			if (eq && strlen(k->name) == eq - argv[optind] &&
+			    strncmp(k->name, argv[optind], eq - argv[optind]) == 0)
+				break;
+		if (!k->name || atof(eq + 1) < 0) {
+			fprintf(stderr, "sussim: bad setting %s\n", argv[optind]);
+			usage();
+		}
+		if (k->val)
+			*k->val = atof(eq + 1);
+		else
+			policy_parse(&policy, argv[optind]);
+		if (k->val == &cf.hours)
+			hours_set = 1;
+	}
+
+	rng = calloc(R_ALARM + (int)cf.alarms, sizeof(*rng));
+	if (!rng)
+		exit(2);
+	/* splitmix64, so nearby seeds give unrelated streams */
+	for (i = 0; i < R_ALARM + (int)cf.alarms; i++) {
+		uint64_t z = (seed + i + 1) * 0x9E3779B97F4A7C15ULL;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		rng[i] = (z ^ (z >> 31)) | 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < (int)cf.alarms; i++)
+		new_slot();
+	end = cf.hours * 3600000;
+	if (dir) {
+		load(dir);
+		if (!hours_set)
+			end = rec.span;
+	}
+	sim.span = end;
+	push(end, EV_END, 0, end, 0);
+	if (cf.blockers > 0)
+		push(expo(R_BLOCK, 3600000 / cf.blockers), EV_BLOCK, 0, -1,
+		     expo(R_BLOCK, cf.block_ms));
+	if (cf.wakes > 0)
+		push(expo(R_WAKE, 3600000 / cf.wakes), EV_WAKE, 0, -1,
+		     expo(R_WAKE, cf.handle_ms));
+	for (i = 0; i < (int)cf.alarms; i++) {
+		alarm_arm(i, uniform(R_ALARM + i) * cf.period_s * 1000);
+		push(alarm_due[i], EV_ALARM, i, alarm_due[i],
+		     expo(R_ALARM + i, cf.alarm_ms));
+	}
+	state = L_CHECK;
+	after(0);
+
+	while (1) {
+		struct ev e = pop();
+
+		now = e.at;
+		if (e.type == EV_END)
+			break;
+		nevents++;
+		event(&e);
+	}
+	if (state == L_ASLEEP)
+		sim.asleep += now - asleep_since;
+	report(metric_ms(&start) / 1000, seed, dir);
+	exit(0);
+}
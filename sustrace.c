@@ -0,0 +1,229 @@
+/*
+ * sustrace - merge the susman trace rings into one timeline.
+ *
+ * Usage: sustrace [directory]
+ * Reads every ring in the directory (default /run/suspend/trace,
+ * but a copy taken from another machine works as well), discards
+ * records that were overwritten or only half written, and prints
+ * the rest in time order with the wall clock time and the gap
+ * since the previous record.
+ *
+ * Copyright (C) 2011 Neil Brown <neilb@suse.de>
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include "susman.h"
+
+struct ent {
+	struct trace_rec	r;
+	const char		*comp;
+};
+
+static const char *services[] = { "lsusd", "lsused", "wakealarmd", "leased" };
+static const char *reasons[] = {
+	[AB_BLOCKED]	= "blocked",
+	[AB_CANCELLED]	= "request cancelled",
+	[AB_READ]	= "'disabled' was read",
+	[AB_COUNT]	= "wakeup_count changed",
+	[AB_KERNEL]	= "kernel refused",
+};
+
+static int ent_cmp(const void *a, const void *b)
+{
+	const struct ent *ea = a, *eb = b;
+
+	if (ea->r.ns != eb->r.ns)
+		return ea->r.ns < eb->r.ns ? -1 : 1;
+	return strcmp(ea->comp, eb->comp);
+}
+
+static void describe(struct trace_rec *r, char *buf, int len)
+{
+	long long a = r->a, b = r->b;
+
+	switch (r->event) {
+	case TR_BLOCKED:
+		snprintf(buf, len, "waited %.1fms", a / 1000.0);
+		break;
+	case TR_COUNT:
+	case TR_SUSPEND:
+		snprintf(buf, len, "wakeup_count %lld", a);
+		break;
+	case TR_RESUME:
+		if (a)
+			snprintf(buf, len, "ok, asleep %lldms", b);
+		else
+			snprintf(buf, len, "failed");
+		break;
+	case TR_ABORT:
+		snprintf(buf, len, "%s",
+			 a > 0 && a <= AB_KERNEL ? reasons[a] : "?");
+		break;
+	case TR_CHECK:
+		snprintf(buf, len, "%lld of %lld fds ready", a, b);
+		break;
+	case TR_SEND:
+		snprintf(buf, len, "fd %lld", a);
+		break;
+	case TR_REPLY:
+		snprintf(buf, len, "fd %lld after %.1fms", a, b / 1000.0);
+		break;
+	case TR_AWAKE:
+		snprintf(buf, len, "%lld clients, class %s", a,
+			 b == 0 ? "prompt" : b == 1 ? "normal" : "bulk");
+		break;
+	case TR_ALARM_SET:
+	case TR_ALARM_FIRE:
+	case TR_ALARM_CLEAR:
+		if (a < 0)
+			snprintf(buf, len, "orphan, time %lld", b);
+		else
+			snprintf(buf, len, "fd %lld, time %lld", a, b);
+		break;
+	case TR_RTC:
+		snprintf(buf, len, "%lld %s", a,
+			 b > 0 ? "written" : b == 0 ? "unchanged" : "no RTC");
+		break;
+	case TR_WAKE:
+		if (a >= 0)
+			snprintf(buf, len, "wakeup%lld (%lld times)", a, b);
+		else
+			snprintf(buf, len, "a debugfs source (%lld times)", b);
+		break;
+	case TR_POLICY:
+		snprintf(buf, len, "predict %lldms, break-even %lldms%s",
+			 a, b, a >= b ? "" : ", waiting");
+		break;
+	case TR_AUTOSLEEP:
+		if (a)
+			snprintf(buf, len, "kernel may suspend");
+		else
+			snprintf(buf, len, "wake lock taken, %lld suspends", b);
+		break;
+	case TR_LEASE:
+		snprintf(buf, len, "uid %lld, timeout %lldms", a, b);
+		break;
+	case TR_RELEASE:
+		snprintf(buf, len, "uid %lld after %lldms", a, b);
+		break;
+	case TR_HOOK:
+		if (a == -1)
+			snprintf(buf, len, "killed after %.1fms", b / 1000.0);
+		else
+			snprintf(buf, len, "exit %lld after %.1fms",
+				 a, b / 1000.0);
+		break;
+	case TR_CLIENT_BLOCK:
+	case TR_CLIENT_ALLOW:
+		snprintf(buf, len, "fd %lld", a);
+		break;
+	case TR_CLIENT_WAKE:
+		snprintf(buf, len, "fd %lld, handled in %.1fms", a, b / 1000.0);
+		break;
+	case TR_EXIT:
+	case TR_RESTART:
+		snprintf(buf, len, "%s pid %lld",
+			 a >= 0 && a < 4 ? services[a] : "?", b);
+		break;
+	default:
+		buf[0] = 0;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const char *dirname = argc > 1 ? argv[1] : TRACE_DIR;
+	struct ent *ents = NULL;
+	int nents = 0, size = 0;
+	struct timespec rt, bt;
+	long long offset;
+	uint64_t prev = 0;
+	struct dirent *de;
+	DIR *dir;
+	int i;
+
+	dir = opendir(dirname);
+	if (!dir) {
+		perror(dirname);
+		exit(1);
+	}
+	while ((de = readdir(dir)) != NULL) {
+		struct tracering *ring;
+		char path[512];
+		char *comp;
+		uint64_t head;
+
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dirname, de->d_name);
+		ring = trace_map(path, 0);
+		if (!ring)
+			continue;
+		comp = strdup(de->d_name);
+		if (!comp)
+			exit(2);
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		for (i = 0; i < TRACE_RECS; i++) {
+			struct trace_rec r;
+			/* must be the latest use of this slot */
+			if (trace_read(ring, i, &r) < 0 ||
+			    (r.seq - 1) % TRACE_RECS != i ||
+			    r.seq > head || r.seq + TRACE_RECS <= head ||
+			    r.event < 0 || r.event >= TR_MAX)
+				continue;
+			if (nents >= size) {
+				size = size ? size * 2 : 4096;
+				ents = realloc(ents, size * sizeof(*ents));
+				if (!ents)
+					exit(2);
+			}
+			ents[nents].r = r;
+			ents[nents].comp = comp;
+			nents++;
+		}
+		munmap(ring, sizeof(*ring));
+	}
+	closedir(dir);
+	qsort(ents, nents, sizeof(*ents), ent_cmp);
+
+	/* Wall clock for a BOOTTIME stamp, as things are now */
+	clock_gettime(CLOCK_REALTIME, &rt);
+	clock_gettime(CLOCK_BOOTTIME, &bt);
+	offset = (rt.tv_sec - bt.tv_sec) * 1000000000LL
+		+ (rt.tv_nsec - bt.tv_nsec);
+
+	for (i = 0; i < nents; i++) {
+		struct trace_rec *r = &ents[i].r;
+		long long wall = r->ns + offset;
+		time_t secs = wall / 1000000000LL;
+		char when[32], what[128];
+
+		strftime(when, sizeof(when), "%H:%M:%S", localtime(&secs));
+		describe(r, what, sizeof(what));
+		printf("%s.%06lld %+10.3fms %-10s %6d %-16s %s\n",
+		       when, (wall % 1000000000LL) / 1000,
+		       prev ? (r->ns - prev) / 1000000.0 : 0.0,
+		       ents[i].comp, r->pid, trace_names[r->event], what);
+		prev = r->ns;
+	}
+	exit(0);
+}
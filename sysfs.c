@@ -0,0 +1,84 @@
+/*
+ * sysfs - find the kernel's files, or a stand-in for them.
+ *
+ * If SUSMAN_SYSFS is set, every /sys path the daemons use is looked
+ * up under that directory instead, so lsusd, wakealarmd and the
+ * wakeup attribution can be run against a fake tree of plain files
+ * without suspending (or needing) real hardware.
+ *
+ * Copyright (C) 2011 Neil Brown <neilb@suse.de>
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include "susman.h"
+
+/* 'path' starts "/sys".  The result is only good until the
+ * fourth call after this one.
+ */
+const char *sys_path(const char *path)
+{
+	static char bufs[4][256];
+	static int next;
+	static const char *root;
+	char *buf;
+
+	if (!root) {
+		root = getenv("SUSMAN_SYSFS");
+		if (!root || !*root)
+			root = "/sys";
+	}
+	if (strcmp(root, "/sys") == 0 || strncmp(path, "/sys", 4) != 0)
+		return path;
+	buf = bufs[next];
+	next = (next + 1) % 4;
+	snprintf(buf, sizeof(bufs[0]), "%s%s", root, path + 4);
+	return buf;
+}
+
+/* Write a short string to a sysfs attribute.  Returns 0 on success. */
+int sys_write(const char *path, const char *val)
+{
+	int fd = open(sys_path(path), O_WRONLY|O_TRUNC|O_CLOEXEC);
+	int n;
+
+	if (fd < 0)
+		return -1;
+	n = write(fd, val, strlen(val));
+	close(fd);
+	return n == strlen(val) ? 0 : -1;
+}
+
+/* Read a number from a sysfs attribute, or -1 */
+long long sys_read_num(const char *path)
+{
+	char buf[32];
+	int fd = open(sys_path(path), O_RDONLY|O_CLOEXEC);
+	int n;
+
+	if (fd < 0)
+		return -1;
+	n = read(fd, buf, sizeof(buf)-1);
+	close(fd);
+	if (n <= 0)
+		return -1;
+	buf[n] = 0;
+	return strtoll(buf, NULL, 10);
+}
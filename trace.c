@@ -0,0 +1,195 @@
+/*
+ * trace - record what the susman daemons do, for post-mortems.
+ *
+ * If the directory /run/suspend/trace exists when a component
+ * starts, it mmaps a fixed size ring of binary records from
+ * /run/suspend/trace/<component> and trace() appends to it: a
+ * CLOCK_BOOTTIME timestamp (so rings from different processes, and
+ * from either side of a suspend, line up), the pid, an event code
+ * and two numbers.  That is a vDSO clock read and a few stores, so
+ * it can be left on.  If the directory doesn't exist trace() does
+ * nothing.
+ *
+ * Each record's 'seq' is zeroed before and set after the rest is
+ * written, as in a seqlock, and trace_read() only accepts a copy
+ * if 'seq' was the same non-zero value on both sides of it, so a
+ * reader can skip records being overwritten even while the daemon
+ * runs.  sustrace merges all the rings into one timeline.
+ *
+ * If /run/suspend/record exists, every record is also appended to
+ * /run/suspend/record/<component>, up to RECORD_MAX bytes, for sussim
+ * to replay.  TR_START's 'a' is then CLOCK_REALTIME - CLOCK_BOOTTIME
+ * in nsec, so alarm times can be placed on the same timeline.
+ *
+ * Copyright (C) 2011 Neil Brown <neilb@suse.de>
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "susman.h"
+
+const char *trace_names[TR_MAX] = {
+	[TR_START]	= "start",
+	[TR_REQUEST]	= "request",
+	[TR_BLOCKED]	= "blocked",
+	[TR_ALERT]	= "watchers-alerted",
+	[TR_COUNT]	= "wakeup_count",
+	[TR_SUSPEND]	= "suspend",
+	[TR_RESUME]	= "resume",
+	[TR_ABORT]	= "abort",
+	[TR_CHECK]	= "check",
+	[TR_SEND]	= "send-S",
+	[TR_REPLY]	= "reply-R",
+	[TR_READY]	= "ready",
+	[TR_AWAKE]	= "send-A",
+	[TR_ALARM_SET]	= "alarm-set",
+	[TR_ALARM_FIRE]	= "alarm-fire",
+	[TR_RTC]	= "rtc",
+	[TR_EXIT]	= "exit",
+	[TR_RESTART]	= "restart",
+	[TR_WAKE]	= "woken-by",
+	[TR_POLICY]	= "policy",
+	[TR_AUTOSLEEP]	= "autosleep",
+	[TR_LEASE]	= "lease",
+	[TR_RELEASE]	= "release",
+	[TR_HOOK]	= "hook",
+	[TR_ALARM_CLEAR] = "alarm-clear",
+	[TR_CLIENT_BLOCK] = "block",
+	[TR_CLIENT_ALLOW] = "allow",
+	[TR_CLIENT_WAKE] = "fd-ready",
+};
+
+static struct tracering *ring;
+static pid_t pid;		/* getpid() is a real syscall */
+static int recfd = -1;
+static off_t recsize;
+
+struct tracering *trace_map(const char *path, int create)
+{
+	struct tracering *r;
+	struct stat stb;
+	int fd;
+
+	fd = open(path, (create ? O_RDWR|O_CREAT : O_RDONLY)|O_CLOEXEC, 0644);
+	if (fd < 0)
+		return NULL;
+	if (create && ftruncate(fd, sizeof(*r)) < 0)
+		goto fail;
+	/* A short file would SIGBUS us */
+	if (fstat(fd, &stb) < 0 || stb.st_size < sizeof(*r))
+		goto fail;
+	r = mmap(NULL, sizeof(*r), create ? PROT_READ|PROT_WRITE : PROT_READ,
+		 MAP_SHARED, fd, 0);
+	close(fd);
+	if (r == MAP_FAILED)
+		return NULL;
+	if (create && memcmp(r->magic, TRACE_MAGIC, 8) != 0) {
+		memset(r, 0, sizeof(*r));
+		memcpy(r->magic, TRACE_MAGIC, 8);
+	}
+	if (memcmp(r->magic, TRACE_MAGIC, 8) != 0) {
+		munmap(r, sizeof(*r));
+		return NULL;
+	}
+	return r;
+fail:
+	close(fd);
+	return NULL;
+}
+
+void trace_open(const char *component)
+{
+	char path[256];
+	struct stat stb;
+	struct timespec rt, bt;
+
+	pid = getpid();
+	if (stat(TRACE_DIR, &stb) == 0 && S_ISDIR(stb.st_mode)) {
+		snprintf(path, sizeof(path), TRACE_DIR "/%s", component);
+		ring = trace_map(path, 1);
+	}
+	if (stat(RECORD_DIR, &stb) == 0 && S_ISDIR(stb.st_mode)) {
+		snprintf(path, sizeof(path), RECORD_DIR "/%s", component);
+		recfd = open(path, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0644);
+		if (recfd >= 0 && fstat(recfd, &stb) == 0)
+			recsize = stb.st_size;
+	}
+	clock_gettime(CLOCK_REALTIME, &rt);
+	clock_gettime(CLOCK_BOOTTIME, &bt);
+	trace(TR_START, (rt.tv_sec - bt.tv_sec) * 1000000000LL
+	      + (rt.tv_nsec - bt.tv_nsec), 0);
+}
+
+void trace(int event, int64_t a, int64_t b)
+{
+	struct trace_rec *t, r;
+	struct timespec ts;
+	uint64_t seq;
+
+	if (!ring && recfd < 0)
+		return;
+	clock_gettime(CLOCK_BOOTTIME, &ts);
+	r.seq = 0;
+	r.ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	r.pid = pid;
+	r.event = event;
+	r.a = a;
+	r.b = b;
+	if (recfd >= 0 && recsize < RECORD_MAX &&
+	    write(recfd, &r, sizeof(r)) == sizeof(r))
+		recsize += sizeof(r);
+	if (!ring)
+		return;
+	/* Old and new copy both write during an upgrade */
+	seq = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+	t = &ring->rec[seq % TRACE_RECS];
+	__atomic_store_n(&t->seq, 0, __ATOMIC_RELAXED);
+	/* The zero must be seen before any of the new contents */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&t->ns, r.ns, __ATOMIC_RELAXED);
+	__atomic_store_n(&t->pid, pid, __ATOMIC_RELAXED);
+	__atomic_store_n(&t->event, event, __ATOMIC_RELAXED);
+	__atomic_store_n(&t->a, a, __ATOMIC_RELAXED);
+	__atomic_store_n(&t->b, b, __ATOMIC_RELAXED);
+	__atomic_store_n(&t->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Copy record 'i' of a ring which may be being written.  Returns 0
+ * for a complete record, -1 for one which is empty or changed while
+ * it was copied.
+ */
+int trace_read(struct tracering *ring, int i, struct trace_rec *r)
+{
+	struct trace_rec *t = &ring->rec[i];
+
+	r->seq = __atomic_load_n(&t->seq, __ATOMIC_ACQUIRE);
+	if (r->seq == 0)
+		return -1;
+	r->ns = __atomic_load_n(&t->ns, __ATOMIC_RELAXED);
+	r->pid = __atomic_load_n(&t->pid, __ATOMIC_RELAXED);
+	r->event = __atomic_load_n(&t->event, __ATOMIC_RELAXED);
+	r->a = __atomic_load_n(&t->a, __ATOMIC_RELAXED);
+	r->b = __atomic_load_n(&t->b, __ATOMIC_RELAXED);
+	/* Nothing above may be read after 'seq' is checked again */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&t->seq, __ATOMIC_RELAXED) == r->seq ? 0 : -1;
+}
@@ -2,6 +2,8 @@
 /*
  * Library code to allow libevent app to register for a wake alarm
  * and register with wakealarmd to keep suspend at bay for the time.
+ * If wakealarmd goes away we block suspend, so the alarm cannot be
+ * slept through, and keep trying to reconnect and register again.
  *
  * Copyright (C) 2011 Neil Brown <neilb@suse.de>
  *
@@ -28,15 +30,34 @@
 #include <fcntl.h>
 #include <errno.h>
 #include "libsus.h"
+#include "susman.h"
 
 struct han {
 	struct event	ev;
+	struct event	rev;		/* reconnect timer */
 	int		sock;
 	int		disable;
+	time_t		when;
+	int		backoff;	/* msec */
 	void		(*fn)(int,short,void*);
 	void		*data;
 };
 
+static void reconnect(int fd, short ev, void *data);
+static void lost_sock(struct han *h)
+{
+	struct timeval tv;
+
+	if (h->sock >= 0) {
+		event_del(&h->ev);
+		close(h->sock);
+		h->sock = -1;
+		suspend_block(h->disable);
+	}
+	sus_backoff(&h->backoff, &tv);
+	evtimer_add(&h->rev, &tv);
+}
+
 static void alarm_clock(int fd, short ev, void *data)
 {
 	char buf[20];
@@ -46,42 +67,66 @@ static void alarm_clock(int fd, short ev, void *data)
 	n = read(fd, buf, sizeof(buf)-1);
 	if (n < 0 && errno == EAGAIN)
 		return;
-	if (n <= 0 ||
-	    strncmp(buf, "Now", 3) == 0) {
+	if (n <= 0) {
+		/* wakealarmd has gone, this isn't the alarm */
+		lost_sock(h);
+		return;
+	}
+	/* After a reconnect "Now" can arrive with the echoed time */
+	buf[n] = 0;
+	if (strstr(buf, "Now") != NULL) {
 		h->fn(-1, ev, h->data);
 		wakealarm_destroy(&h->ev);
 	}
 	/* Some other message, keep waiting */
 }
 
+static void send_when(struct han *h)
+{
+	char buf[20];
+
+	sprintf(buf, "%lld\n", (long long)h->when);
+	write(h->sock, buf, strlen(buf));
+	event_set(&h->ev, h->sock, EV_READ|EV_PERSIST, alarm_clock, h);
+	event_add(&h->ev, NULL);
+}
+
+static void reconnect(int fd, short ev, void *data)
+{
+	struct han *h = data;
+
+	h->sock = sus_connect("/run/suspend/wakealarm");
+	if (h->sock < 0) {
+		lost_sock(h);
+		return;
+	}
+	/* If the time has passed while we were away, wakealarmd
+	 * will say "Now" straight away.
+	 */
+	send_when(h);
+	h->backoff = 0;
+	suspend_allow(h->disable);
+}
+
 struct event *wakealarm_set(time_t when, void(*fn)(int, short, void*),
 			    void *data)
 {
-	struct sockaddr_un addr;
 	struct han *h = malloc(sizeof(*h));
-	char buf[20];
 
 	if (!h)
 		return NULL;
 
 	h->fn = fn;
 	h->data = data;
+	h->when = when;
+	h->backoff = 0;
 	h->disable = suspend_open();
-	h->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	h->sock = sus_connect("/run/suspend/wakealarm");
 	if (h->sock < 0 || h->disable < 0)
 		goto abort;
 
-	addr.sun_family = AF_UNIX;
-	strcpy(addr.sun_path, "/run/suspend/wakealarm");
-	if (connect(h->sock, (struct sockaddr*)&addr, sizeof(addr)) != 0)
-		goto abort;
-
-	fcntl(h->sock, F_SETFL, fcntl(h->sock, F_GETFL, 0) | O_NONBLOCK);
-	sprintf(buf, "%lld\n", (long long)when);
-	write(h->sock, buf, strlen(buf));
-
-	event_set(&h->ev, h->sock, EV_READ|EV_PERSIST, alarm_clock, h);
-	event_add(&h->ev, NULL);
+	evtimer_set(&h->rev, reconnect, h);
+	send_when(h);
 
 	return &h->ev;
 
@@ -93,11 +138,21 @@ abort:
 	return NULL;
 }
 
+/* 'fn' will get 'data' from now on */
+void wakealarm_set_data(struct event *ev, void *data)
+{
+	struct han *h = (struct han *)ev;
+	h->data = data;
+}
+
 void wakealarm_destroy(struct event *ev)
 {
 	struct han *h = (struct han *)ev;
-	event_del(&h->ev);
-	close(h->sock);
+	evtimer_del(&h->rev);
+	if (h->sock >= 0) {
+		event_del(&h->ev);
+		close(h->sock);
+	}
 	suspend_close(h->disable);
 	free(h);
 }
@@ -8,6 +8,22 @@
  * We echo back the time and then when the time comes we echo "Now".
  * We keep system awake until another time is written, or until
  * connection is closed.
+ * A line starting '?' instead gets a report of RTC programming.
+ * The same is offered with the binary protocol of susproto.c on
+ * /run/suspend/wakealarm.pkt: SUSP_ALARM is answered with
+ * SUSP_ALARM_SET and later SUSP_NOW, both carrying the client's id.
+ *
+ * Registered times are also kept in an mmapped table in /run/suspend
+ * so that if we are restarted, alarms whose clients have not yet
+ * reconnected still get the system woken at the right time.
+ *
+ * The next alarm is armed as an absolute CLOCK_REALTIME timerfd which
+ * is cancelled whenever the clock is set, so deadlines are recomputed
+ * immediately after NTP steps or settimeofday, and the time spent
+ * suspended is tracked with CLOCK_BOOTTIME.
+ *
+ * On SIGHUP we pass the listening socket, all clients and their
+ * times to a freshly exec'ed copy of ourselves (see handoff.c).
  *
  * Copyright (C) 2011 Neil Brown <neilb@suse.de>
  *
@@ -34,27 +50,101 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/timerfd.h>
+#include <signal.h>
 #include "libsus.h"
+#include "susman.h"
+
+#define TABLE "/run/suspend/wakealarm.table"
+
+static struct metric *m_clients, *m_stored, *m_set, *m_fired, *m_late;
+static struct metric *m_rtc_writes, *m_rtc_skipped, *m_slept;
+
+static void metrics_init(void)
+{
+	metrics_open("wakealarmd");
+	m_clients = metric_new("wakealarmd_clients", "Connected clients",
+			       METRIC_GAUGE);
+	m_stored = metric_new("wakealarmd_alarms", "Alarms in the table",
+			      METRIC_GAUGE);
+	m_set = metric_new("wakealarmd_alarms_set_total",
+			   "Alarm times registered", METRIC_COUNTER);
+	m_fired = metric_new("wakealarmd_alarms_fired_total",
+			     "Alarms which reached their time", METRIC_COUNTER);
+	m_late = metric_new("wakealarmd_lateness_seconds",
+			    "How long after its time an alarm fired",
+			    METRIC_HISTOGRAM);
+	m_rtc_writes = metric_new("wakealarmd_rtc_writes_total",
+				  "Writes to the RTC wakealarm",
+				  METRIC_COUNTER);
+	m_rtc_skipped = metric_new("wakealarmd_rtc_skipped_total",
+				   "RTC reprogramming found unnecessary",
+				   METRIC_COUNTER);
+	m_slept = metric_new("wakealarmd_suspended_seconds_total",
+			     "Time seen spent suspended", METRIC_COUNTER);
+	metric_set(m_clients, 0);
+}
+
+static void fired(int fd, time_t stamp)
+{
+	struct timespec now;
+
+	trace(TR_ALARM_FIRE, fd, stamp);
+	clock_gettime(CLOCK_REALTIME, &now);
+	metric_add(m_fired, 1);
+	metric_observe(m_late, (now.tv_sec - stamp) * 1000.0
+		       + now.tv_nsec / 1000000.0);
+}
 
 struct conn {
 	struct event	ev;
 	time_t		stamp;	/* When to wake */
 	int		active; /* stamp has passed */
+	int		orphan;	/* recovered from table, no connection */
+	int		slot;	/* in alarm table, or -1 */
+	int		pkt;	/* on the SOCK_SEQPACKET socket */
+	uint32_t	id;	/* of its SUSP_ALARM */
+	char		now[SUSP_ONE];	/* its SUSP_NOW */
 	struct conn	*next;	/* sorted by 'stamp' */
 	struct state	*state;
 };
 
 struct state {
 	struct event	ev;
-	struct event	tev;
+	struct event	tev;		/* on tfd */
+	int		tfd;		/* timerfd for next alarm */
+	struct timespec	sus_boot;	/* BOOTTIME when suspend started */
+	struct timespec	sus_mono;	/* MONOTONIC when suspend started */
+	struct rtc	*rtc;
 	int		disablefd;
 	int		disabled;
 	void		*watcher;
 	struct conn	*conns;
 	int		active_count;
+	struct alarmtab	*tab;
+	struct fanout	*fan;		/* for "Now" */
+	int		listen;		/* listening socket */
+	int		listen_pkt;	/* and the SOCK_SEQPACKET one */
+	char		**argv;		/* for handoff */
 };
 
 static void do_timeout(int fd, short ev, void *data);
+static void update_watch(struct state *state);
+
+static void set_timer(struct state *state, time_t when)
+{
+	/* Absolute time, so a clock change doesn't make us late,
+	 * and we hear about any such change.  Zero disarms.
+	 */
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = when;
+	timerfd_settime(state->tfd,
+			TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+			&its, NULL);
+}
+
 static void add_han(struct conn *han)
 {
 	struct state *state = han->state;
@@ -68,8 +158,6 @@ static void add_han(struct conn *han)
 	han->next = *hanp;
 	*hanp = han;
 
-	if (event_get_base(&state->tev))
-		evtimer_del(&state->tev);
 	do_timeout(0, 0, (void*)state);
 }
 
@@ -97,75 +185,255 @@ static void del_han(struct conn *han)
 
 static void destroy_han(struct conn *han)
 {
+	metric_add(m_clients, -1);
 	event_del(&han->ev);
+	alarmtab_free(han->state->tab, han->slot);
+	metric_set(m_stored, alarmtab_count(han->state->tab));
 	free(han);
 }
 
+static void adopt_orphan(struct conn *han)
+{
+	/* A client which was registered before we restarted has
+	 * presumably re-registered, so we don't need to remember
+	 * the old entry any more.
+	 */
+	struct state *state = han->state;
+	struct conn **hanp = &state->conns;
+	struct conn *o;
+
+	while ((o = *hanp) != NULL && o->stamp <= han->stamp) {
+		if (o->orphan && o->stamp == han->stamp) {
+			*hanp = o->next;
+			alarmtab_free(state->tab, o->slot);
+			free(o);
+			return;
+		}
+		hanp = &o->next;
+	}
+}
+
+static void drop_conn(struct conn *han)
+{
+	struct state *state = han->state;
+	int fd = EVENT_FD(&han->ev);
+
+	trace(TR_ALARM_CLEAR, fd, han->stamp);
+	del_han(han);
+	destroy_han(han);
+	close(fd);
+	update_watch(state);
+}
+
+/* Record the new time.  The caller must then reply and add_han() */
+static void set_alarm(struct conn *han, time_t stamp)
+{
+	del_han(han);
+	han->stamp = stamp;
+	metric_add(m_set, 1);
+	trace(TR_ALARM_SET, EVENT_FD(&han->ev), han->stamp);
+	if (han->slot < 0)
+		han->slot = alarmtab_alloc(han->state->tab);
+	alarmtab_set(han->state->tab, han->slot, han->stamp);
+	metric_set(m_stored, alarmtab_count(han->state->tab));
+	adopt_orphan(han);
+	if (han->pkt)
+		susp_one(han->now, SUSP_NOW, han->id, han->stamp);
+}
+
 static void do_read(int fd, short ev, void *data)
 {
 	struct conn *han = data;
-	char buf[20];
+	char buf[64], *line, *nl;
 	int n;
 
 	n = read(fd, buf, sizeof(buf)-1);
 	if (n < 0 && errno == EAGAIN)
 		return;
 	if (n <= 0) {
-		del_han(han);
-		destroy_han(han);
-		close(fd);
+		drop_conn(han);
 		return;
 	}
-	del_han(han);
-	han->stamp = atol(buf);
-	sprintf(buf, "%lld\n", (long long)han->stamp);
-	write(fd, buf, strlen(buf));
+	buf[n] = 0;
+	if (buf[0] == '?') {
+		/* Status request - doesn't change our alarm */
+		struct rtc *rtc = han->state->rtc;
+		struct fanout *fan = han->state->fan;
+		char msg[200];
+		snprintf(msg, sizeof(msg),
+			 "%s writes %lu skipped %lu programmed %lld"
+			 " io %s sent %lu syscalls %lu\n",
+			 rtc->name, rtc->writes, rtc->skipped,
+			 rtc->programmed, fanout_engine(fan),
+			 fan->sent, fan->syscalls);
+		write(fd, msg, strlen(msg));
+		return;
+	}
+	/* Times written together arrive together: each is echoed,
+	 * and the last one counts.
+	 */
+	for (line = buf; *line; line = nl) {
+		char echo[24];
+		nl = strchr(line, '\n');
+		nl = nl ? nl + 1 : line + strlen(line);
+		set_alarm(han, atol(line));
+		sprintf(echo, "%lld\n", (long long)han->stamp);
+		write(fd, echo, strlen(echo));
+	}
 	add_han(han);
+	update_watch(han->state);
+}
+
+/* One datagram of requests gets one datagram of replies */
+static void do_read_pkt(int fd, short ev, void *data)
+{
+	struct conn *han = data;
+	struct susp_frame in, out;
+	int set = 0;
+	int n, i;
+
+	n = susp_recv(fd, &in, NULL, NULL);
+	if (n < 0 && errno == EAGAIN)
+		return;
+	if (n <= 0) {
+		drop_conn(han);
+		return;
+	}
+	susp_init(&out);
+	for (i = 0; i < n; i++) {
+		struct susp_msg *m = &in.msg[i];
+		switch (m->op) {
+		case SUSP_HELLO:
+			susp_add(&out, SUSP_HELLO, m->id,
+				 m->arg & SUSP_CAP_ALARM);
+			break;
+		case SUSP_ALARM:
+			han->id = m->id;
+			set_alarm(han, m->arg);
+			susp_add(&out, SUSP_ALARM_SET, m->id, han->stamp);
+			set = 1;
+			break;
+		default:
+			susp_add(&out, SUSP_ERROR, m->id, m->op);
+		}
+	}
+	/* The reply must go before any SUSP_NOW */
+	if (out.hdr.count)
+		susp_send(fd, &out, NULL, 0);
+	if (set) {
+		add_han(han);
+		update_watch(han->state);
+	}
 }
 
 static void do_timeout(int fd, short ev, void *data)
 {
 	struct state *state = data;
+	struct conn **hanp = &state->conns;
 	struct conn *han;
 	time_t now = time(0);
 
-	for (han = state->conns; han && han->stamp <= now; han = han->next)
+	while ((han = *hanp) != NULL && han->stamp <= now) {
+		if (han->orphan) {
+			/* Nobody to tell, but we are awake which is
+			 * what they asked for.
+			 */
+			*hanp = han->next;
+			fired(-1, han->stamp);
+			alarmtab_free(state->tab, han->slot);
+			free(han);
+			if (state->active_count == 0 && state->disabled) {
+				suspend_allow(state->disablefd);
+				state->disabled = 0;
+			}
+			continue;
+		}
 		if (!han->active) {
 			han->active = 1;
 			han->state->active_count++;
-			write(EVENT_FD(&han->ev), "Now\n", 4);
+			fired(EVENT_FD(&han->ev), han->stamp);
+			if (han->pkt)
+				fanout_add(state->fan, EVENT_FD(&han->ev),
+					   han->now, SUSP_ONE);
+			else
+				fanout_add(state->fan, EVENT_FD(&han->ev),
+					   "Now\n", 4);
 		}
+		hanp = &han->next;
+	}
+	fanout_flush(state->fan);
+	metric_set(m_stored, alarmtab_count(state->tab));
 	if (han) {
-		struct timeval tv;
-		tv.tv_sec = han->stamp - now;
-		tv.tv_usec = 0;
-		evtimer_add(&state->tev, &tv);
+		set_timer(state, han->stamp);
+		alarmtab_set_next(state->tab, han->stamp);
+	} else {
+		set_timer(state, 0);
+		alarmtab_set_next(state->tab, 0);
 	}
 }
 
-static void do_accept(int fd, short ev, void *data)
+static void do_tick(int fd, short ev, void *data)
 {
 	struct state *state = data;
-	struct conn *han;
-	int newfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+	uint64_t cnt;
+
+	/* ECANCELED means the clock was set, which is exactly when
+	 * we need to look at the deadlines again.
+	 */
+	if (read(fd, &cnt, sizeof(cnt)) < 0) {
+		if (errno != ECANCELED)
+			return;
+		rtc_invalidate(state->rtc);
+	}
+	do_timeout(fd, ev, data);
+	/* Not from do_timeout(): that runs inside the watcher too */
+	update_watch(state);
+}
+
+static struct conn *new_conn(struct state *state, int fd, int pkt)
+{
+	struct conn *han = malloc(sizeof(*han));
 
-	if (newfd < 0)
-		return;
-	han = malloc(sizeof(*han));
 	if (!han) {
-		close(newfd);
-		return;
+		close(fd);
+		return NULL;
 	}
 	han->state = state;
 	han->stamp = 0;
 	han->active = 1;
+	han->orphan = 0;
+	han->slot = -1;
+	han->pkt = pkt;
+	han->id = 0;
 	state->active_count++;
-	han->next = state->conns;
-	state->conns = han;
-
-	event_set(&han->ev, newfd, EV_READ | EV_PERSIST, do_read, han);
+	metric_add(m_clients, 1);
+	event_set(&han->ev, fd, EV_READ | EV_PERSIST,
+		  pkt ? do_read_pkt : do_read, han);
 	event_add(&han->ev, NULL);
-	write(newfd, "0\n", 2);
+	return han;
+}
+
+static void do_accept(int fd, short ev, void *data)
+{
+	struct state *state = data;
+	struct conn *han;
+	int pkt = fd == state->listen_pkt;
+	int newfd;
+
+	/* Take everyone who is waiting, not just one per wakeup */
+	while ((newfd = accept4(fd, NULL, NULL,
+				SOCK_NONBLOCK|SOCK_CLOEXEC)) >= 0) {
+		han = new_conn(state, newfd, pkt);
+		if (!han)
+			continue;
+		han->next = state->conns;
+		state->conns = han;
+		/* binary clients start with SUSP_HELLO instead */
+		if (!pkt)
+			fanout_add(state->fan, newfd, "0\n", 2);
+	}
+	fanout_flush(state->fan);
+	update_watch(state);
 }
 
 static int do_suspend(void *data)
@@ -174,35 +442,20 @@ static int do_suspend(void *data)
 	time_t now;
 
 	time(&now);
+	clock_gettime(CLOCK_BOOTTIME, &state->sus_boot);
+	clock_gettime(CLOCK_MONOTONIC, &state->sus_mono);
 
-	if (event_get_base(&state->tev))
-		evtimer_del(&state->tev);
 	/* active_count must be zero */
 	if (state->conns == NULL)
 		return 1;
 
 	if (state->conns->stamp > now + 4) {
-		int fd = open("/sys/class/rtc/rtc0/since_epoch", O_RDONLY);
-		time_t rtc_now = now;
-		if (fd) {
-			char buf[20];
-			int n = read(fd, buf, 20);
-			close(fd);
-			if (n > 1 && n < 20) {
-				buf[n] = 0;
-				rtc_now = strtoul(buf, NULL, 10);
-			}
-		}
-		fd = open("/sys/class/rtc/rtc0/wakealarm", O_WRONLY);
-		if (fd >= 0) {
-			char buf[20];
-			write(fd, "0\n", 2);
-			sprintf(buf, "%lld\n",
-				(long long)state->conns->stamp
-				- now + rtc_now - 2);
-			write(fd, buf, strlen(buf));
-			close(fd);
-		}
+		unsigned long w = state->rtc->writes;
+		int r = rtc_program(state->rtc, state->conns->stamp - 2);
+		trace(TR_RTC, state->rtc->programmed, r);
+		if (r == 0)
+			metric_add(m_rtc_skipped, 1);
+		metric_add(m_rtc_writes, state->rtc->writes - w);
 		return 1;
 	}
 	/* too close to next wakeup */
@@ -216,34 +469,282 @@ static int do_suspend(void *data)
 static void do_resume(void *data)
 {
 	struct state *state = data;
+	struct timespec boot, mono;
+	time_t slept;
+
+	/* BOOTTIME advances while suspended, MONOTONIC doesn't */
+	clock_gettime(CLOCK_BOOTTIME, &boot);
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	slept = (boot.tv_sec - state->sus_boot.tv_sec)
+		- (mono.tv_sec - state->sus_mono.tv_sec);
+	if (slept > 0) {
+		/* RTC and system clock may have drifted apart */
+		metric_add(m_slept, slept);
+		rtc_invalidate(state->rtc);
+	}
 
 	do_timeout(0, 0, (void*)state);
 }
 
+/* We only need to hear about suspend while we have clients or
+ * orphaned alarms; without a watcher lsusd can leave suspend to the
+ * kernel's autosleep.
+ */
+static void update_watch(struct state *state)
+{
+	if (state->conns && !state->watcher) {
+		/* We may have slept unseen, and the RTC drifted */
+		rtc_invalidate(state->rtc);
+		state->watcher = suspend_watch(do_suspend, do_resume, state);
+	} else if (!state->conns && state->watcher) {
+		suspend_unwatch(state->watcher);
+		state->watcher = NULL;
+	}
+}
+
+/* Handoff state is one 'struct saved' per connection, in list
+ * order, then one 'struct saved_pkt' for each, then SUSP_MAGIC as a
+ * long long (an older copy sends neither).  The fds are the listening
+ * socket, one per connection, then the SOCK_SEQPACKET listening
+ * socket if any.  Orphans aren't sent as they are found again in the
+ * table.
+ */
+struct saved {
+	long long	stamp;
+	int		active;
+	int		slot;
+};
+
+struct saved_pkt {
+	int		pkt;
+	uint32_t	id;
+};
+
+static void do_upgrade(int sig, short ev, void *data)
+{
+	struct state *state = data;
+	struct conn *han;
+	struct saved *rec;
+	struct saved_pkt *pkt;
+	long long *magic;
+	int *fds;
+	int n = 0, nfds;
+
+	for (han = state->conns; han; han = han->next)
+		n++;
+	rec = malloc(n * (sizeof(*rec) + sizeof(*pkt)) + sizeof(*magic));
+	fds = malloc((n + 2) * sizeof(int));
+	if (!rec || !fds)
+		goto out;
+	fds[0] = state->listen;
+	n = 0;
+	for (han = state->conns; han; han = han->next) {
+		if (han->orphan)
+			continue;
+		rec[n].stamp = han->stamp;
+		rec[n].active = han->active;
+		rec[n].slot = han->slot;
+		fds[++n] = EVENT_FD(&han->ev);
+	}
+	pkt = (struct saved_pkt *)(rec + n);
+	n = 0;
+	for (han = state->conns; han; han = han->next) {
+		if (han->orphan)
+			continue;
+		pkt[n].pkt = han->pkt;
+		pkt[n++].id = han->id;
+	}
+	magic = (long long *)(pkt + n);
+	*magic = SUSP_MAGIC;
+	nfds = n + 1;
+	if (state->listen_pkt >= 0)
+		fds[nfds++] = state->listen_pkt;
+	if (handoff_start("wakealarmd", state->argv, fds, nfds, rec,
+			  (char *)(magic + 1) - (char *)rec) == 0)
+		exit(0);
+out:
+	free(rec);
+	free(fds);
+}
+
+static int restore(struct state *st)
+{
+	struct conn **tail = &st->conns;
+	struct saved *rec;
+	struct saved_pkt *pkt = NULL;
+	int *fds;
+	int nfds, len, n;
+	int i;
+
+	nfds = handoff_receive(&fds, (void**)&rec, &len);
+	if (nfds < 0)
+		return -1;
+	n = nfds - 1;
+	if (len >= sizeof(long long) &&
+	    *(long long *)((char *)rec + len - sizeof(long long)) == SUSP_MAGIC) {
+		n = (len - sizeof(long long)) /
+			(sizeof(*rec) + sizeof(*pkt));
+		pkt = (struct saved_pkt *)(rec + n);
+		if (nfds > n + 1)
+			st->listen_pkt = fds[n + 1];
+	}
+	for (i = 1; i <= n; i++) {
+		struct conn *han = new_conn(st, fds[i], pkt ? pkt[i-1].pkt : 0);
+		if (!han)
+			exit(1);
+		han->stamp = rec[i-1].stamp;
+		han->slot = rec[i-1].slot;
+		if (pkt) {
+			han->id = pkt[i-1].id;
+			susp_one(han->now, SUSP_NOW, han->id, han->stamp);
+		}
+		if (!rec[i-1].active) {
+			han->active = 0;
+			st->active_count--;
+		}
+		*tail = han;
+		tail = &han->next;
+	}
+	i = fds[0];
+	free(rec);
+	free(fds);
+	return i;
+}
+
+struct recovery {
+	struct conn	*list;		/* orphans found */
+	struct conn	**tail;
+	int		*claimed;	/* sorted slots owned by conns */
+	int		nclaimed;
+};
+
+static int int_cmp(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+static void recover_one(int slot, time_t stamp, void *data)
+{
+	struct recovery *rc = data;
+	struct conn *han;
+
+	if (bsearch(&slot, rc->claimed, rc->nclaimed, sizeof(int), int_cmp))
+		/* still has a connection, after handoff */
+		return;
+	han = calloc(1, sizeof(*han));
+	if (!han)
+		return;
+	/* slots arrive in time order, so just append */
+	han->stamp = stamp;
+	han->orphan = 1;
+	han->slot = slot;
+	*rc->tail = han;
+	rc->tail = &han->next;
+}
+
+static void recover(struct state *st)
+{
+	struct recovery rc;
+	struct conn **hanp;
+	struct conn *han;
+
+	st->tab = alarmtab_open(TABLE);
+	if (!st->tab)
+		return;
+
+	rc.nclaimed = 0;
+	for (han = st->conns; han; han = han->next)
+		rc.nclaimed++;
+	rc.claimed = malloc((rc.nclaimed + 1) * sizeof(int));
+	rc.nclaimed = 0;
+	for (han = st->conns; han; han = han->next)
+		if (han->slot >= 0)
+			rc.claimed[rc.nclaimed++] = han->slot;
+	qsort(rc.claimed, rc.nclaimed, sizeof(int), int_cmp);
+	rc.list = NULL;
+	rc.tail = &rc.list;
+	alarmtab_recover(st->tab, recover_one, &rc);
+	free(rc.claimed);
+
+	/* Merge the orphans in with any handed-over connections */
+	hanp = &st->conns;
+	while (rc.list) {
+		han = rc.list;
+		while (*hanp && (*hanp)->stamp <= han->stamp)
+			hanp = &(*hanp)->next;
+		rc.list = han->next;
+		han->next = *hanp;
+		han->state = st;
+		*hanp = han;
+		hanp = &han->next;
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	struct state st;
-	struct sockaddr_un addr;
+	struct event hupev, pev;
+	int restored;
 	int s;
+	int blockfd;
 
+	memset(&st, 0, sizeof(st));
+	metrics_init();
+	trace_open("wakealarmd");
 	st.disablefd = suspend_open();
 	st.disabled = 0;
 	st.conns = NULL;
 	st.active_count = 0;
-
-	s = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
-	addr.sun_family = AF_UNIX;
-	strcpy(addr.sun_path, "/run/suspend/wakealarm");
-	unlink("/run/suspend/wakealarm");
-	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	st.argv = argv;
+	st.listen_pkt = -1;
+	/* Optional argument names the RTC to use */
+	st.rtc = rtc_open(argc > 1 ? argv[1] : "rtc0");
+	if (!st.rtc)
+		exit(2);
+	st.fan = fanout_new();
+	if (!st.fan)
+		exit(2);
+	st.tfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (st.tfd < 0)
 		exit(2);
-	listen(s, 20);
 
+	/* Don't let suspend happen until any alarms from a previous
+	 * life are covered by the RTC again.
+	 */
+	blockfd = suspend_block(-1);
 	event_init();
-	st.watcher = suspend_watch(do_suspend, do_resume, &st);
+	event_set(&st.tev, st.tfd, EV_READ | EV_PERSIST, do_tick, &st);
+	event_add(&st.tev, NULL);
+	s = restore(&st);
+	restored = s >= 0;
+	recover(&st);
+	do_suspend(&st);
+	do_timeout(0, 0, &st);
+
+	if (!restored)
+		s = listen_socket("/run/suspend/wakealarm");
+	if (s < 0)
+		exit(2);
+	st.listen = s;
+	if (st.listen_pkt < 0)
+		st.listen_pkt = listen_seqpacket(SUSP_WAKEALARM);
+
+	update_watch(&st);
 	event_set(&st.ev, s, EV_READ | EV_PERSIST, do_accept, &st);
 	event_add(&st.ev, NULL);
-	evtimer_set(&st.tev, do_timeout, &st);
+	if (st.listen_pkt >= 0) {
+		event_set(&pev, st.listen_pkt, EV_READ | EV_PERSIST,
+			  do_accept, &st);
+		event_add(&pev, NULL);
+	}
+	signal_set(&hupev, SIGHUP, do_upgrade, &st);
+	signal_add(&hupev, NULL);
+	suspend_close(blockfd);
+	if (restored)
+		handoff_done();
+	else
+		/* Incase someone is waiting for us... */
+		close(0);
 
 	event_loop(0);
 	exit(0);
@@ -7,6 +7,10 @@
  * it the same fd.
  * At a lower priority, when we read 'S' from the daemon we reply
  * with 'R'.
+ * If the daemon goes away we block suspend, as the fd is no longer
+ * being watched, and keep trying to reconnect and register it again.
+ * wake_set_class() says how soon after resume we want to hear about
+ * it (the 'A' which follows an 'S'), compared to other clients.
  *
  * Copyright (C) 2011 Neil Brown <neilb@suse.de>
  *
@@ -32,16 +36,26 @@
 #include <fcntl.h>
 #include <errno.h>
 #include "libsus.h"
+#include "susman.h"
 
 struct han {
 	struct event	ev;
 	struct event	sev;
+	struct event	rev;		/* reconnect timer */
 	int		sock;
+	int		fd;		/* the fd registered */
+	int		prio;
 	int		disable;
+	int		backoff;	/* msec */
+	int		class;
+	int		replied;	/* 'R' sent, 'A' not yet seen */
 	void		(*fn)(int,short,void*);
+	void		(*resumed)(void *data);
 	void		*data;
 };
 
+static const char class_msg[] = "PNB";	/* by class */
+
 static void wakeup_call(int fd, short ev, void *data)
 {
 	/* A (potential) wakeup event can be read from this fd.
@@ -49,7 +63,36 @@ static void wakeup_call(int fd, short ev, void *data)
 	 * 'S' yet as that is handle with a lower priority.
 	 */
 	struct han *han = data;
+	struct timespec t0, t1;
+
+	if (!sus_recording()) {
+		han->fn(fd, ev, han->data);
+		return;
+	}
+	/* han may be gone when fn returns */
+	clock_gettime(CLOCK_MONOTONIC, &t0);
 	han->fn(fd, ev, han->data);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	sus_record(TR_CLIENT_WAKE, fd, (t1.tv_sec - t0.tv_sec) * 1000000LL
+		   + (t1.tv_nsec - t0.tv_nsec) / 1000);
+}
+
+static void reconnect(int fd, short ev, void *data);
+static void lost_sock(struct han *han)
+{
+	struct timeval tv;
+
+	/* Nobody is watching the fd for us now, so we must
+	 * keep the system awake until that is fixed.
+	 */
+	if (han->sock >= 0) {
+		event_del(&han->sev);
+		close(han->sock);
+		han->sock = -1;
+		suspend_block(han->disable);
+	}
+	sus_backoff(&han->backoff, &tv);
+	evtimer_add(&han->rev, &tv);
 }
 
 static void wakeup_sock(int fd, short ev, void *data)
@@ -61,15 +104,20 @@ static void wakeup_sock(int fd, short ev, void *data)
 	if (n < 0 && errno == EAGAIN)
 		return;
 	if (n != 1) {
-		/* How do I signal an error ?*/
-		event_del(&han->sev);
+		lost_sock(han);
 		return;
 	}
-	if (buf == 'S')
+	if (buf == 'S') {
 		/* As we are at a lower priority (higher number)
 		 * than the main event, we must have handled everything
 		 */
 		write(fd, "R", 1);
+		han->replied = 1;
+	} else if (buf == 'A' && han->replied) {
+		han->replied = 0;
+		if (han->resumed)
+			han->resumed(han->data);
+	}
 }
 
 static void send_fd(int sock, int fd)
@@ -97,9 +145,28 @@ static void send_fd(int sock, int fd)
 	sendmsg(sock, &msg, 0);
 }
 
+static void reconnect(int fd, short ev, void *data)
+{
+	struct han *h = data;
+
+	h->sock = sus_connect("/run/suspend/registration");
+	if (h->sock < 0) {
+		lost_sock(h);
+		return;
+	}
+	send_fd(h->sock, h->fd);
+	if (h->class != WAKE_NORMAL)
+		write(h->sock, &class_msg[h->class], 1);
+	h->replied = 0;
+	event_set(&h->sev, h->sock, EV_READ|EV_PERSIST, wakeup_sock, h);
+	event_priority_set(&h->sev, h->prio+1);
+	event_add(&h->sev, NULL);
+	h->backoff = 0;
+	suspend_allow(h->disable);
+}
+
 struct event *wake_set(int fd, void(*fn)(int,short,void*), void *data, int prio)
 {
-	struct sockaddr_un addr;
 	struct han *h = malloc(sizeof(*h));
 
 	if (!h)
@@ -107,21 +174,22 @@ struct event *wake_set(int fd, void(*fn)(int,short,void*), void *data, int prio)
 
 	h->fn = fn;
 	h->data = data;
+	h->fd = fd;
+	h->prio = prio;
+	h->backoff = 0;
+	h->class = WAKE_NORMAL;
+	h->replied = 0;
+	h->resumed = NULL;
 	h->disable = suspend_open();
-	h->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	h->sock = sus_connect("/run/suspend/registration");
 	if (h->sock < 0 || h->disable < 0)
 		goto abort;
-	addr.sun_family = AF_UNIX;
-	strcpy(addr.sun_path, "/run/suspend/registration");
-	if (connect(h->sock, (struct sockaddr*)&addr, sizeof(addr)) != 0)
-		goto abort;
-
-	fcntl(h->sock, F_SETFL, fcntl(h->sock, F_GETFL, 0) | O_NONBLOCK);
 
 	send_fd(h->sock, fd);
 
 	event_set(&h->ev, fd, EV_READ|EV_PERSIST, wakeup_call, h);
 	event_set(&h->sev, h->sock, EV_READ|EV_PERSIST, wakeup_sock, h);
+	evtimer_set(&h->rev, reconnect, h);
 	event_priority_set(&h->ev, prio);
 	event_priority_set(&h->sev, prio+1);
 	event_add(&h->ev, NULL);
@@ -137,12 +205,37 @@ abort:
 	return NULL;
 }
 
+/* 'resumed', if given, is called when lsused says we are awake again
+ * after we have told it we were ready to suspend.
+ */
+void wake_set_class(struct event *ev, int class, void (*resumed)(void *data))
+{
+	struct han *h = (struct han *)ev;
+
+	if (class < 0 || class >= WAKE_CLASSES)
+		return;
+	h->class = class;
+	h->resumed = resumed;
+	if (h->sock >= 0)
+		write(h->sock, &class_msg[class], 1);
+}
+
+/* 'fn' and 'resumed' will get 'data' from now on */
+void wake_set_data(struct event *ev, void *data)
+{
+	struct han *h = (struct han *)ev;
+	h->data = data;
+}
+
 void wake_destroy(struct event *ev)
 {
 	struct han *h = (struct han *)ev;
 	event_del(&h->ev);
-	event_del(&h->sev);
-	close(h->sock);
+	evtimer_del(&h->rev);
+	if (h->sock >= 0) {
+		event_del(&h->sev);
+		close(h->sock);
+	}
 	suspend_close(h->disable);
 	free(h);
 }
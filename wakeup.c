@@ -0,0 +1,321 @@
+/*
+ * wakeup - work out what woke us from suspend.
+ *
+ * Before each suspend lsusd takes a snapshot of the counters of
+ * every kernel wakeup source, from /sys/class/wakeup or, on older
+ * kernels, debugfs' wakeup_sources.  After resume it takes another,
+ * and blames the resume on every source whose wakeup_count went up,
+ * or failing that whose event_count did.  The time we then stay
+ * awake, until the next suspend, is charged to the same sources.
+ *
+ * Sources are found again by directory name so their attribute
+ * files are only opened once.  The totals are written to
+ * /run/suspend/wakeups, and as one lsusd_wakeups_total family to
+ * /run/suspend/stats/lsusd-wakeups.prom for susman to export:
+ * there may be more sources than fit in lsusd's metrics file.
+ *
+ * Copyright (C) 2011 Neil Brown <neilb@suse.de>
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include "susman.h"
+
+#define CLASS	"/sys/class/wakeup"
+#define DEBUGFS	"/sys/kernel/debug/wakeup_sources"
+#define REPORT	"/run/suspend/wakeups"
+#define PROM	"/run/suspend/stats/lsusd-wakeups.prom"
+
+struct wakesrc {
+	char		dir[32];	/* in CLASS, or "" from DEBUGFS */
+	char		name[64];
+	int		wfd, efd;	/* wakeup_count, event_count */
+	uint64_t	wakeup_count, event_count;
+	uint64_t	before_wakeup, before_event;
+	int		present;
+	int		snapped;	/* present before suspend */
+	int		blamed;		/* for the current awake period */
+	unsigned long	wakes;
+	unsigned long long awake_ms;
+};
+
+static struct wakesrc *srcs;
+static int nsrcs, size;
+static unsigned long unknown;		/* resumes nobody owned up to */
+static struct timespec resumed;
+static int awake;			/* 'resumed' is valid */
+
+static struct wakesrc *find(const char *dir, const char *name)
+{
+	struct wakesrc *w;
+	int i;
+
+	for (i = 0; i < nsrcs; i++)
+		if (strcmp(srcs[i].dir, dir) == 0 &&
+		    strcmp(srcs[i].name, name) == 0)
+			return &srcs[i];
+	if (nsrcs >= size) {
+		int nsize = size ? size * 2 : 32;
+		w = realloc(srcs, nsize * sizeof(*w));
+		if (!w)
+			return NULL;
+		srcs = w;
+		size = nsize;
+	}
+	w = &srcs[nsrcs++];
+	memset(w, 0, sizeof(*w));
+	strncpy(w->dir, dir, sizeof(w->dir)-1);
+	strncpy(w->name, name, sizeof(w->name)-1);
+	w->wfd = w->efd = -1;
+	return w;
+}
+
+static long long read_num(int fd)
+{
+	char buf[32];
+	int n = pread(fd, buf, sizeof(buf)-1, 0);
+
+	if (n <= 0)
+		return -1;
+	buf[n] = 0;
+	return strtoll(buf, NULL, 10);
+}
+
+static int read_name(const char *dir, char *name, int len)
+{
+	char path[256];
+	int fd, n;
+
+	if (snprintf(path, sizeof(path), "%s/%s/name", sys_path(CLASS), dir)
+	    >= sizeof(path))
+		return -1;
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	n = read(fd, name, len-1);
+	close(fd);
+	if (n <= 0)
+		return -1;
+	name[n] = 0;
+	name[strcspn(name, "\n")] = 0;
+	return 0;
+}
+
+static int open_attr(const char *dir, const char *attr)
+{
+	char path[256];
+
+	if (snprintf(path, sizeof(path), "%s/%s/%s", sys_path(CLASS), dir, attr)
+	    >= sizeof(path))
+		return -1;
+	return open(path, O_RDONLY|O_CLOEXEC);
+}
+
+static int scan_class(void)
+{
+	DIR *d = opendir(sys_path(CLASS));
+	struct dirent *de;
+
+	if (!d)
+		return -1;
+	while ((de = readdir(d)) != NULL) {
+		struct wakesrc *w;
+		char name[64];
+		long long wc, ec;
+		int i;
+
+		if (de->d_name[0] == '.')
+			continue;
+		/* A known dir keeps its name, don't read it again */
+		for (i = 0; i < nsrcs; i++)
+			if (strcmp(srcs[i].dir, de->d_name) == 0)
+				break;
+		if (i < nsrcs && srcs[i].wfd >= 0)
+			w = &srcs[i];
+		else {
+			if (read_name(de->d_name, name, sizeof(name)) < 0)
+				continue;
+			w = find(de->d_name, name);
+			if (!w)
+				continue;
+			w->wfd = open_attr(de->d_name, "wakeup_count");
+			w->efd = open_attr(de->d_name, "event_count");
+		}
+		wc = read_num(w->wfd);
+		ec = read_num(w->efd);
+		if (wc < 0) {
+			/* gone, or replaced by another of the same dir */
+			close(w->wfd);
+			close(w->efd);
+			w->wfd = w->efd = -1;
+			continue;
+		}
+		w->wakeup_count = wc;
+		w->event_count = ec < 0 ? 0 : ec;
+		w->present = 1;
+	}
+	closedir(d);
+	return 0;
+}
+
+static int scan_debugfs(void)
+{
+	FILE *f = fopen(sys_path(DEBUGFS), "r");
+	char line[512];
+
+	if (!f)
+		return -1;
+	/* first line is a header */
+	if (!fgets(line, sizeof(line), f)) {
+		fclose(f);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		char name[64];
+		unsigned long long active, ec, wc;
+		struct wakesrc *w;
+
+		if (sscanf(line, "%63s %llu %llu %llu",
+			   name, &active, &ec, &wc) != 4)
+			continue;
+		w = find("", name);
+		if (!w)
+			continue;
+		w->wakeup_count = wc;
+		w->event_count = ec;
+		w->present = 1;
+	}
+	fclose(f);
+	return 0;
+}
+
+static void scan(void)
+{
+	int i;
+
+	for (i = 0; i < nsrcs; i++)
+		srcs[i].present = 0;
+	if (scan_class() < 0)
+		scan_debugfs();
+}
+
+static void report(void)
+{
+	FILE *f = fopen(REPORT ".new", "w");
+	int i;
+
+	if (!f)
+		return;
+	for (i = 0; i < nsrcs; i++)
+		if (srcs[i].wakes)
+			fprintf(f, "%s wakes %lu awake_ms %llu\n",
+				srcs[i].name, srcs[i].wakes,
+				srcs[i].awake_ms);
+	fprintf(f, "unknown wakes %lu\n", unknown);
+	fclose(f);
+	rename(REPORT ".new", REPORT);
+}
+
+static void prom_source(FILE *f, const char *name, unsigned long wakes)
+{
+	fputs("lsusd_wakeups_total{source=\"", f);
+	for (; *name; name++) {
+		if (*name == '"' || *name == '\\')
+			fputc('\\', f);
+		fputc(*name, f);
+	}
+	fprintf(f, "\"} %lu\n", wakes);
+}
+
+static void report_metrics(void)
+{
+	FILE *f = fopen(PROM ".new", "w");
+	int i;
+
+	if (!f)
+		return;
+	fprintf(f, "# HELP lsusd_wakeups_total Resumes attributed to each"
+		" source\n# TYPE lsusd_wakeups_total counter\n");
+	for (i = 0; i < nsrcs; i++)
+		if (srcs[i].wakes)
+			prom_source(f, srcs[i].name, srcs[i].wakes);
+	prom_source(f, "unknown", unknown);
+	fclose(f);
+	rename(PROM ".new", PROM);
+}
+
+/* Just before suspend: close the awake period and take a snapshot */
+void wakeup_before(void)
+{
+	int i;
+
+	if (awake) {
+		unsigned long long ms = metric_ms(&resumed);
+		for (i = 0; i < nsrcs; i++)
+			if (srcs[i].blamed)
+				srcs[i].awake_ms += ms;
+		awake = 0;
+	}
+	scan();
+	for (i = 0; i < nsrcs; i++) {
+		srcs[i].before_wakeup = srcs[i].wakeup_count;
+		srcs[i].before_event = srcs[i].event_count;
+		srcs[i].snapped = srcs[i].present;
+		srcs[i].blamed = 0;
+	}
+}
+
+/* After resume: blame whoever moved.  Returns how many did. */
+int wakeup_after(void)
+{
+	int blamed = 0;
+	int i;
+
+	scan();
+	for (i = 0; i < nsrcs; i++)
+		if (srcs[i].present && srcs[i].snapped &&
+		    srcs[i].wakeup_count > srcs[i].before_wakeup)
+			srcs[i].blamed = 1;
+	for (i = 0; i < nsrcs; i++)
+		blamed += srcs[i].blamed;
+	if (!blamed)
+		/* Not all drivers report wakeups, try events */
+		for (i = 0; i < nsrcs; i++)
+			if (srcs[i].present && srcs[i].snapped &&
+			    srcs[i].event_count > srcs[i].before_event) {
+				srcs[i].blamed = 1;
+				blamed++;
+			}
+	for (i = 0; i < nsrcs; i++)
+		if (srcs[i].blamed) {
+			srcs[i].wakes++;
+			/* N of wakeupN, which sustrace can't look up */
+			trace(TR_WAKE, strncmp(srcs[i].dir, "wakeup", 6) == 0
+			      ? atoi(srcs[i].dir + 6) : -1, srcs[i].wakes);
+		}
+	if (!blamed)
+		unknown++;
+	clock_gettime(CLOCK_MONOTONIC, &resumed);
+	awake = 1;
+	report();
+	report_metrics();
+	return blamed;
+}
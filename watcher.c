@@ -39,6 +39,7 @@ struct cb {
 	void *data;
 	int dirfd;
 	int fd, nextfd;
+	struct timespec resumed;	/* when lsusd last wrote 'watching' */
 	struct event ev;
 };
 
@@ -60,6 +61,7 @@ static void checkdir(int efd, short ev, void *vp)
 			/*false alarm */
 			return;
 		/* back from resume */
+		han->resumed = stb.st_mtim;
 		close(han->fd);
 		han->fd = han->nextfd;
 		han->nextfd = -1;
@@ -128,6 +130,22 @@ abort:
 	free(han);
 }
 
+/* Callbacks will get 'data' from now on */
+void suspend_watch_data(void *v, void *data)
+{
+	struct cb *han = v;
+	han->data = data;
+}
+
+/* When lsusd announced the last resume, by CLOCK_REALTIME.  Only
+ * meaningful in or after a did_resume callback.
+ */
+void suspend_resumed_at(void *v, struct timespec *ts)
+{
+	struct cb *han = v;
+	*ts = han->resumed;
+}
+
 void suspend_unwatch(void *v)
 {
 	struct cb *han = v;